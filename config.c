@@ -1,6 +1,7 @@
 void read_config(char *);
 void process_setting(input_t *, char *, char *);
 input_t *add_input(char *, input_t *);
+histogram *parse_histogram(char *);
 void set(char **, char *);
 char *itoa(int);
 char *itodur(int);
@@ -27,6 +28,15 @@ void read_config(char *config) {
   }
 
   settings.skipexistlines = 1;
+  settings.sqlitebatch = DB_BATCH_ROWS;
+  settings.sqlitecommit = DB_BATCH_MSEC;
+  settings.dbqueuesize = DB_RING_SIZE;
+  settings.spoolmax = DB_SPOOL_MAX*1048576LL;
+  settings.journalsize = JOURNAL_SIZE*1048576;
+  settings.uplinkflushms = UPLINK_FLUSH_MSEC;
+  settings.uplinkflushbytes = UPLINK_FLUSH_BYTES;
+  settings.outboxmax = OUTBOX_MAX*1048576LL;
+  settings.uplinklevel = 1;
 
   while (fgets(mainbuf, MAIN_BUF_SIZE, fp)) {
     if (mainbuf[0] == '#') continue;
@@ -72,6 +82,7 @@ void read_config(char *config) {
 
     if (newinput->type & INPUT_CAT) {
       if (newinput->time) newinput->subtype = TYPE_TIME;
+      else if (newinput->distinct && newinput->namex) newinput->subtype = TYPE_DISTINCT;
       else if (newinput->valuex && newinput->namex) newinput->subtype = TYPE_NAMEVALPOS;
       else if (newinput->valuex) {
         if (!newinput->line) newinput->subtype = TYPE_VALPOS;
@@ -93,11 +104,12 @@ void read_config(char *config) {
     }
     else if (newinput->type & INPUT_TAIL) {
       if (newinput->time) newinput->subtype = TYPE_TIME;
+      else if (newinput->distinct && newinput->namex) newinput->subtype = TYPE_DISTINCT;
       else if (newinput->valuex && newinput->namex) newinput->subtype = TYPE_NAMEVALPOS;
       else if (newinput->valuex) newinput->subtype = TYPE_VALPOS;
       else if (newinput->namex) newinput->subtype = TYPE_NAMECOUNT;
       else newinput->subtype = TYPE_COUNT;
-      if (newinput->subtype & (TYPE_COUNT|TYPE_NAMECOUNT)) {
+      if (newinput->subtype & (TYPE_COUNT|TYPE_NAMECOUNT|TYPE_DISTINCT)) {
         if (newinput->interval < MIN_INTERVAL) {
           if (newinput->interval) newinput->interval = MIN_INTERVAL;
           else newinput->interval = DEF_INTERVAL;
@@ -113,6 +125,7 @@ void read_config(char *config) {
     }
     else if (newinput->type & INPUT_CMD) {
       if (newinput->time) newinput->subtype = TYPE_TIME;
+      else if (newinput->distinct && newinput->namex) newinput->subtype = TYPE_DISTINCT;
       else if (newinput->valuex && newinput->namex) newinput->subtype = TYPE_NAMEVALPOS;
       else if (newinput->valuex) {
         if (!newinput->line) newinput->subtype = TYPE_VALPOS;
@@ -132,8 +145,9 @@ void read_config(char *config) {
       if (newinput->regex) printf(" with REGEX match \"%s\"", newinput->regex);
       printf("\n");
     }
-    else if (newinput->type & INPUT_PIPE) {
+    else if (newinput->type & (INPUT_PIPE|INPUT_FIFO)) {
       if (newinput->time) newinput->subtype = TYPE_TIME;
+      else if (newinput->distinct && newinput->namex) newinput->subtype = TYPE_DISTINCT;
       else if (newinput->valuex && newinput->namex) newinput->subtype = TYPE_NAMEVALPOS;
       else if (newinput->valuex) newinput->subtype = TYPE_VALPOS;
       else if (newinput->namex) newinput->subtype = TYPE_NAMECOUNT;
@@ -142,7 +156,7 @@ void read_config(char *config) {
         if (newinput->interval) newinput->interval = MIN_INTERVAL;
         else newinput->interval = DEF_INTERVAL;
       }
-      printf("Input %s is type PIPE subtype %s (%d sec interval)", newinput->name, subtype[newinput->subtype/2], newinput->interval);
+      printf("Input %s is type %s subtype %s (%d sec interval)", newinput->name, type[newinput->type/2], subtype[newinput->subtype/2], newinput->interval);
       if (!newinput->time) {
         if (newinput->delta) printf(" with mode DELTA");
         if (newinput->consol) printf(" with consolidation function %s", consol[newinput->consol/2]);
@@ -150,7 +164,7 @@ void read_config(char *config) {
       if (newinput->regex) printf(" with REGEX match \"%s\"", newinput->regex);
       printf("\n");
     }
-    else if (newinput->type & INPUT_LISTEN) {
+    else if (newinput->type & (INPUT_LISTEN|INPUT_CONNECT)) {
       if (newinput->valuex && newinput->namex) newinput->subtype = TYPE_NAMEVALPOS;
       else if (newinput->valuex) newinput->subtype = TYPE_VALPOS;
       else if (newinput->subtype);
@@ -159,12 +173,26 @@ void read_config(char *config) {
         if (newinput->interval) newinput->interval = MIN_INTERVAL;
         else newinput->interval = DEF_INTERVAL;
       }
-      printf("Input %s is type LISTEN subtype %s (%d sec interval)", newinput->name, subtype[newinput->subtype/2], newinput->interval);
+      printf("Input %s is type %s subtype %s (%d sec interval)", newinput->name, type[newinput->type/2], subtype[newinput->subtype/2], newinput->interval);
       if (newinput->delta) printf(" with mode DELTA");
       if (newinput->consol) printf(" with consolidation function %s", consol[newinput->consol/2]);
       if (newinput->regex) printf(" with REGEX match \"%s\"", newinput->regex);
       printf("\n");
     }
+    else if (newinput->type & INPUT_STATSD) {
+      newinput->subtype = TYPE_NAMEVALPOS; // A child per metric name
+      if (newinput->interval < MIN_INTERVAL) {
+        if (newinput->interval) newinput->interval = MIN_INTERVAL;
+        else newinput->interval = DEF_INTERVAL;
+      }
+      printf("Input %s is type STATSD (%d sec interval)", newinput->name, newinput->interval);
+      if (newinput->consol) printf(" with consolidation function %s for timers", consol[newinput->consol/2]);
+      printf("\n");
+      if (newinput->histogram || newinput->distinct || newinput->regex) {
+        fprintf(stderr, "Input %s type STATSD cannot use HISTOGRAM, DISTINCT or REGEX options\n", newinput->name);
+        exit(-1);
+      }
+    }
 
     // Check for incompatible mode specifications
     if (newinput->consol) {
@@ -172,7 +200,7 @@ void read_config(char *config) {
         fprintf(stderr, "Input %s type %s without specified interval cannot use consolidation function\n", newinput->name, type[newinput->type/2]);
         exit(-1);
       }
-      if (newinput->subtype & (TYPE_COUNT|TYPE_LINEVALPOS|TYPE_NAMECOUNT)) {
+      if (newinput->subtype & (TYPE_COUNT|TYPE_LINEVALPOS|TYPE_NAMECOUNT|TYPE_DISTINCT)) {
         fprintf(stderr, "Input %s subtype %s cannot use consolidation function\n", newinput->name, subtype[newinput->subtype/2]);
         exit(-1);
       }
@@ -183,8 +211,34 @@ void read_config(char *config) {
       if (newinput->namex) fprintf(stderr, "Input %s: mode TIME overrides NAMEX option\n", newinput->name);
       if (newinput->delta) fprintf(stderr, "Input %s: mode TIME overrides mode DELTA\n", newinput->name);
       if (newinput->consol) fprintf(stderr, "Input %s: mode TIME overrides consolidation function\n", newinput->name);
+      if (newinput->distinct) fprintf(stderr, "Input %s: mode TIME overrides mode DISTINCT\n", newinput->name);
+    }
+    if (newinput->distinct) {
+      if (!newinput->namex) {
+        fprintf(stderr, "Input %s: mode DISTINCT requires NAMEX option\n", newinput->name);
+        exit(-1);
+      }
+      if (newinput->valuex) fprintf(stderr, "Input %s: mode DISTINCT overrides VALUEX option\n", newinput->name);
+    }
+    if (newinput->histogram) {
+      if (!(newinput->subtype & (TYPE_VALPOS|TYPE_NAMEVALPOS))) {
+        fprintf(stderr, "Input %s subtype %s cannot use HISTOGRAM option\n", newinput->name, subtype[newinput->subtype/2]);
+        exit(-1);
+      }
+      if ((newinput->type & (INPUT_TAIL|INPUT_PIPE)) && !newinput->interval) {
+        fprintf(stderr, "Input %s type %s without specified interval cannot use HISTOGRAM option\n", newinput->name, type[newinput->type/2]);
+        exit(-1);
+      }
+      if (newinput->consol) {
+        fprintf(stderr, "Input %s: HISTOGRAM option overrides consolidation function\n", newinput->name);
+        newinput->consol = 0;
+      }
     }
     if (newinput->subtype & TYPE_AGGREGATE) {
+      if (!(newinput->type & INPUT_LISTEN)) {
+        fprintf(stderr, "Input %s: mode AGGREGATE requires type LISTEN\n", newinput->name);
+        exit(-1);
+      }
       if (newinput->line) fprintf(stderr, "Input %s: mode AGGREGATE overrides LINE option\n", newinput->name);
       if (newinput->valuex) fprintf(stderr, "Input %s: mode AGGREGATE overrides VALUEX option\n", newinput->name);
       if (newinput->namex) fprintf(stderr, "Input %s: mode AGGREGATE overrides NAMEX option\n", newinput->name);
@@ -212,9 +266,14 @@ void process_setting(input_t *input, char *name, char *value) {
       else fprintf(stderr, "Invalid parameter in LOGSIZE setting: %s\n", value);
       return;
     }
-    else if (!strcasecmp("uplink", name) && value) {
-      cp = strtok(value, " ");
-      set(&settings.uplinkhost, cp);
+    else if (!strcasecmp("uplink", name) && value) { // May be given several times; series are spread over the uplinks
+      uplink_t *up = &settings.uplinks[settings.nuplinks];
+      char *host = strtok(value, " ");
+
+      if (settings.nuplinks == UPLINKS_MAX) {
+        fprintf(stderr, "Too many UPLINK settings (at most %d); ignoring %s\n", UPLINKS_MAX, host);
+        return;
+      }
       cp = strtok(NULL, " ");
       if (!cp) {
         fprintf(stderr, "Insufficient parameters in UPLINK setting\n");
@@ -225,19 +284,96 @@ void process_setting(input_t *input, char *name, char *value) {
         fprintf(stderr, "Invalid port specified in UPLINK setting: %s\n", cp);
         return;
       }
-      settings.uplinkport = c;
+      up->id = settings.nuplinks++;
+      set(&up->host, host);
+      up->port = c;
       cp = strtok(NULL, " ");
       if (cp) {
         set(&settings.uplinkprefix, cp);
-        printf("Configured uplink %s:%d\n", settings.uplinkhost, settings.uplinkport);
+        printf("Configured uplink %s:%d with prefix \"%s\"\n", up->host, up->port, settings.uplinkprefix);
       }
-      else printf("Configured uplink %s:%d with prefix \"%s\"\n", settings.uplinkhost, settings.uplinkport, settings.uplinkprefix);
+      else printf("Configured uplink %s:%d\n", up->host, up->port);
+      return;
+    }
+    else if (!strcasecmp("uplink-flush", name) && value) {
+      int msec, bytes;
+      char *unit;
+
+      errno = 0;
+      msec = strtol(strtok(value, " "), &unit, 10);
+      if (!strcmp(unit, "s")) msec *= 1000;
+      else if (*unit && strcmp(unit, "ms")) msec = -1;
+      if (errno || (msec < 0)) {
+        fprintf(stderr, "Invalid flush time in uplink-flush setting '%s'\n", value);
+        return;
+      }
+      settings.uplinkflushms = msec;
+      if ((value = strtok(NULL, " "))) {
+        bytes = strtol(value, &unit, 10);
+        if ((bytes <= 0) || (bytes > UPLINK_BUF_SIZE/2) || *unit) {
+          fprintf(stderr, "Invalid batch size in uplink-flush setting '%s' (1 to %d bytes)\n", value, UPLINK_BUF_SIZE/2);
+          return;
+        }
+        settings.uplinkflushbytes = bytes;
+      }
+      if (settings.verbose) printf("Flushing uplink data every %d ms or %d bytes\n", settings.uplinkflushms, settings.uplinkflushbytes);
+      return;
+    }
+    else if (!strcasecmp("uplink-outbox", name) && value) {
+      int n;
+      char *unit;
+
+      set(&settings.outboxdir, strtok(value, " "));
+      while ((value = strtok(NULL, " "))) {
+        if (!strcasecmp(value, "seq")) {
+          settings.uplinkseq = 1;
+          continue;
+        }
+        n = strtol(value, &unit, 10);
+        if ((n < 4) || (*unit && strcasecmp(unit, "M"))) {
+          fprintf(stderr, "Invalid size in uplink-outbox setting '%s' (at least 4 MB)\n", value);
+          set(&settings.outboxdir, NULL);
+          return;
+        }
+        settings.outboxmax = n*1048576LL;
+      }
+      if (settings.verbose) printf("Keeping up to %lld MB for the uplink in outbox %s%s\n", settings.outboxmax/1048576, settings.outboxdir,
+        settings.uplinkseq?" with sequence numbers":"");
+      return;
+    }
+    else if (!strcasecmp("uplink-format", name) && value) {
+      char *level;
+
+      value = strtok(value, " ");
+      if (!strcasecmp(value, "text")) settings.uplinkbinary = 0;
+      else if (!strcasecmp(value, "binary")) settings.uplinkbinary = 1;
+      else {
+        fprintf(stderr, "Invalid uplink-format setting '%s' (text or binary)\n", value);
+        return;
+      }
+      if ((level = strtok(NULL, " "))) {
+        c = strtol(level, &cp, 10);
+        if ((c < 0) || (c > 9) || *cp) fprintf(stderr, "Invalid compression level in uplink-format setting '%s' (0 to 9)\n", level);
+        else settings.uplinklevel = c;
+      }
+      if (settings.verbose && settings.uplinkbinary) printf("Using the binary uplink protocol with compression level %d\n", settings.uplinklevel);
+      return;
+    }
+    else if (!strcasecmp("uplink-tcp", name) && value) {
+      if (!strcasecmp(value, "nodelay")) settings.uplinktcp = UPLINK_TCP_NODELAY;
+      else if (!strcasecmp(value, "cork")) settings.uplinktcp = UPLINK_TCP_CORK;
+      else if (!strcasecmp(value, "default")) settings.uplinktcp = UPLINK_TCP_DEFAULT;
+      else fprintf(stderr, "Invalid uplink-tcp setting '%s' (nodelay, cork or default)\n", value);
       return;
     }
     else if (!strcasecmp("sqlite", name) && value) {
       set(&settings.sqlitefile, value);
       return;
     }
+    else if (!strcasecmp("tsdb", name) && value) {
+      set(&settings.tsdbdir, value);
+      return;
+    }
     else if (!strcasecmp("sqlite-prune", name) && value) {
       int n;
       char *unit;
@@ -265,11 +401,117 @@ void process_setting(input_t *input, char *name, char *value) {
       else if (settings.verbose) printf("Pruning of sqlite data is disabled\n");
       return;
     }
+    else if (!strcasecmp("sqlite-batch", name) && value) {
+      int rows, msec;
+      char *unit;
+
+      errno = 0;
+      rows = strtol(strtok(value, " "), &unit, 10);
+      if (errno || (rows <= 0) || *unit) {
+        fprintf(stderr, "Invalid number of rows in sqlite-batch setting '%s'\n", value);
+        return;
+      }
+      settings.sqlitebatch = rows;
+      if ((value = strtok(NULL, " "))) {
+        msec = strtol(value, &unit, 10);
+        if (!strcmp(unit, "s")) msec *= 1000;
+        else if (*unit && strcmp(unit, "ms")) msec = -1;
+        if (msec < 0) {
+          fprintf(stderr, "Invalid commit interval in sqlite-batch setting '%s'\n", value);
+          return;
+        }
+        settings.sqlitecommit = msec;
+      }
+      if (settings.verbose) printf("Committing sqlite data every %d rows or %d ms\n", settings.sqlitebatch, settings.sqlitecommit);
+      return;
+    }
+    else if (!strcasecmp("subscribe", name) && value) {
+      set(&settings.subscribepath, value);
+      if (settings.verbose) printf("Serving live updates on unix socket %s\n", settings.subscribepath);
+      return;
+    }
+    else if (!strcasecmp("metrics", name) && value) {
+      int port;
+      char *end;
+
+      settings.metricsaddr = INADDR_ANY;
+      if (strchr(value, ':')) {
+        if (value[0] != '*') settings.metricsaddr = inet_addr(strtok(value, ":"));
+        else strtok(value, ":");
+        if (settings.metricsaddr == INADDR_NONE) {
+          fprintf(stderr, "Invalid address in metrics setting '%s'\n", value);
+          exit(-1);
+        }
+        value = strtok(NULL, "\0");
+      }
+      port = strtol(value, &end, 10);
+      if ((end == value) || *end || (port < 1) || (port > 65535)) {
+        fprintf(stderr, "Invalid port in metrics setting '%s'\n", value);
+        exit(-1);
+      }
+      settings.metricsport = port;
+      if (settings.verbose) printf("Serving /metrics over HTTP on port %d\n", settings.metricsport);
+      return;
+    }
+    else if (!strcasecmp("journal", name) && value) {
+      int n;
+      char *unit;
+
+      set(&settings.journalfile, strtok(value, " "));
+      if ((value = strtok(NULL, " "))) {
+        n = strtol(value, &unit, 10);
+        if ((n <= 0) || (n > 2048) || (*unit && strcasecmp(unit, "M"))) {
+          fprintf(stderr, "Invalid size in journal setting '%s'\n", value);
+          set(&settings.journalfile, NULL);
+          return;
+        }
+        settings.journalsize = n*1048576U; // Unsigned, as 2048M doesn't fit in an int
+      }
+      if (settings.verbose) printf("Journaling samples to %s (%u MB)\n", settings.journalfile, settings.journalsize/1048576);
+      return;
+    }
+    else if (!strcasecmp("db-queue", name) && value) {
+      int n;
+      char *policy, *unit;
+
+      errno = 0;
+      n = strtol(strtok(value, " "), &unit, 10);
+      if (errno || (n <= 0) || *unit) {
+        fprintf(stderr, "Invalid queue size in db-queue setting '%s'\n", value);
+        return;
+      }
+      settings.dbqueuesize = n;
+      if (!(policy = strtok(NULL, " ")) || !strcasecmp(policy, "spill")) {
+        settings.dboverflow = OVERFLOW_SPILL;
+        if ((value = strtok(NULL, " "))) {
+          n = strtol(value, &unit, 10);
+          if ((n <= 0) || (*unit && strcasecmp(unit, "M"))) {
+            fprintf(stderr, "Invalid spool size in db-queue setting '%s'\n", value);
+            return;
+          }
+          settings.spoolmax = n*1048576LL;
+        }
+      }
+      else if (!strcasecmp(policy, "drop")) settings.dboverflow = OVERFLOW_DROP;
+      else if (!strcasecmp(policy, "block")) settings.dboverflow = OVERFLOW_BLOCK;
+      else {
+        fprintf(stderr, "Invalid overflow policy in db-queue setting '%s'\n", policy);
+        return;
+      }
+      if (settings.verbose) printf("Queueing %d updates for the db writer, then %s\n", settings.dbqueuesize,
+        settings.dboverflow == OVERFLOW_SPILL?"spilling to disk":(settings.dboverflow == OVERFLOW_DROP?"dropping":"blocking"));
+      return;
+    }
     else if (!strcasecmp("summaries", name) && value) {
       int n, i = 0;
       char *sum, *unit;
 
       for (sum = strtok(value, " "); sum; sum = strtok(NULL, " ")) {
+        if (!strcasecmp(sum, "win")) { // In-memory statistics over each input's sliding window
+          settings.summaries[i++] = 0;
+          if (i == SUMMARIES_MAX) break;
+          continue;
+        }
         errno = 0;
         n = strtol(sum, &unit, 10);
         if (errno || n <= 0) {
@@ -397,19 +639,44 @@ void process_setting(input_t *input, char *name, char *value) {
     else fprintf(stderr, "PIPE requested but type already set for %s\n", input->name);
     return;
   }
-  else if (!strcasecmp("listen", name) && value) {
+  else if (!strcasecmp("fifo", name) && value) {
     if (!input->type) {
-      if (settings.verbose) printf("Requested LISTEN on %s\n", value);
-      input->type = INPUT_LISTEN;
+      if (settings.verbose) printf("Requested FIFO of %s\n", value);
+      input->type = INPUT_FIFO;
+      input->fifo = (input_fifo *)malloc(sizeof(input_fifo));
+      if (!input->fifo) {
+        fprintf(stderr, "Failed to allocate memory for input\n");
+        exit(-1);
+      }
+      memset(input->fifo, 0, sizeof(input_fifo));
+      set(&input->fifo->filename, value);
+    }
+    else fprintf(stderr, "FIFO requested but type already set for %s\n", input->name);
+    return;
+  }
+  else if ((!strcasecmp("listen", name) || !strcasecmp("connect", name) || !strcasecmp("statsd", name)) && value) {
+    int connect = !strcasecmp("connect", name), statsd = !strcasecmp("statsd", name);
+
+    if (!input->type) {
+      if (settings.verbose) printf("Requested %s on %s\n", connect?"CONNECT":statsd?"STATSD":"LISTEN", value);
+      input->type = connect?INPUT_CONNECT:statsd?INPUT_STATSD:INPUT_LISTEN;
       input->sock = (input_sock *)malloc(sizeof(input_sock));
       if (!input->sock) {
         fprintf(stderr, "Failed to allocate memory for input\n");
         exit(-1);
       }
       memset(input->sock, 0, sizeof(input_sock));
+      if (connect && (value[0] == '/')) { // Unix socket
+        set(&input->sock->path, value);
+        return;
+      }
+      if (connect) input->sock->addr = inet_addr("127.0.0.1");
       if (strchr(value, ':')) {
-        if (value[0] == '*') input->sock->addr = INADDR_ANY;
-        else input->sock->addr = inet_addr(strtok(value, ":"));
+        if (value[0] != '*') input->sock->addr = inet_addr(strtok(value, ":"));
+        else {
+          input->sock->addr = INADDR_ANY;
+          strtok(value, ":");
+        }
         if (input->sock->addr == INADDR_NONE) {
           fprintf(stderr, "Invalid address specification for input %s: %s\n", input->name, value);
           exit(-1);
@@ -424,9 +691,9 @@ void process_setting(input_t *input, char *name, char *value) {
         }
         input->sock->port = c;
       }
-      else fprintf(stderr, "Invalid port speficiation for input %s: %d\n", input->name, value);
+      else fprintf(stderr, "Invalid port specification for input %s: %s\n", input->name, value);
     }
-    else fprintf(stderr, "LISTEN requested but type already set for %s\n", input->name);
+    else fprintf(stderr, "%s requested but type already set for %s\n", connect?"CONNECT":statsd?"STATSD":"LISTEN", input->name);
     return;
   }
 
@@ -479,6 +746,25 @@ void process_setting(input_t *input, char *name, char *value) {
     else fprintf(stderr, "Invalid parameter in INTERVAL setting: %s\n", value);
     return;
   }
+  else if (!strcasecmp("history", name) && value) {
+    c = strtol(value, &cp, 10);
+    if ((cp != value) && (c >= 0)) {
+      if (c > VALUE_HIST_MAX) fprintf(stderr, "HISTORY setting for input %s limited to %d values\n", input->name, c = VALUE_HIST_MAX);
+      input->histsize = c;
+    }
+    else fprintf(stderr, "Invalid parameter in HISTORY setting for input %s: %s\n", input->name, value);
+    return;
+  }
+  else if (!strcasecmp("histogram", name) && value) {
+    if (!(input->histogram = parse_histogram(value))) fprintf(stderr, "Invalid parameter in HISTOGRAM setting for input %s\n", input->name);
+    return;
+  }
+  else if (!strcasecmp("window", name) && value) {
+    c = strtol(value, &cp, 10);
+    if ((cp != value) && (c >= 0)) input->window = c;
+    else fprintf(stderr, "Invalid parameter in WINDOW setting for input %s: %s\n", input->name, value);
+    return;
+  }
   else if (!strcasecmp("regex", name) && value) {
     set(&input->regex, value);
     return;
@@ -504,9 +790,16 @@ void process_setting(input_t *input, char *name, char *value) {
     else if (!strcasecmp("max", value)) input->consol = CONSOL_MAX;
     else if (!strcasecmp("sum", value)) input->consol = CONSOL_SUM;
     else if (!strcasecmp("avg", value)) input->consol = CONSOL_AVG;
+    else if (((*value == 'p') || (*value == 'P')) && ((input->quantile = strtod(value+1, &cp)/100) > 0) && (input->quantile <= 1) && !*cp) input->consol = CONSOL_QUANTILE;
     else fprintf(stderr, "Invalid parameter in CONSOL setting for input %s: %s\n", input->name, value);
     return;
   }
+  else if (!strcasecmp("distinct", name)) {
+    if (!value || !*value) input->distinct = 1;
+    else if (!strcasecmp("export", value)) input->distinct = 2;
+    else fprintf(stderr, "Invalid parameter in DISTINCT setting for input %s: %s\n", input->name, value);
+    return;
+  }
   else if (!strcasecmp("time", name)) {
     input->time = 1;
     return;
@@ -607,10 +900,54 @@ input_t *add_input(char *name, input_t *parent) {
   }
   else inputs = newinput;
   newinput->parent = parent;
-  newinput->vallast = newinput->valhist+VALUE_HIST_SIZE-1;
+  newinput->histsize = parent?parent->histsize:VALUE_HIST_SIZE;
+  newinput->window = parent?parent->window:STATS_WINDOW;
   return newinput;
 }
 
+// Bucket bounds are given as "linear <start> <width> <count>", "exp <start> <factor> <count>"
+// or as an ascending list of upper bounds; a final bucket for everything above is always added
+histogram *parse_histogram(char *value) {
+  int i, n = 0;
+  float bounds[HISTOGRAM_MAX_BOUNDS], start, step;
+  char *tok, *cp;
+  histogram *hist;
+
+  if (!(tok = strtok(value, " "))) return NULL;
+  if (!strcasecmp(tok, "linear") || !strcasecmp(tok, "exp")) {
+    int exp = !strcasecmp(tok, "exp");
+
+    if (!(tok = strtok(NULL, " "))) return NULL;
+    start = strtod(tok, &cp);
+    if (*cp) return NULL;
+    if (!(tok = strtok(NULL, " "))) return NULL;
+    step = strtod(tok, &cp);
+    if (*cp || (step <= (exp?1:0))) return NULL;
+    if (!(tok = strtok(NULL, " "))) return NULL;
+    n = strtol(tok, &cp, 10);
+    if (*cp || (n <= 0) || (n > HISTOGRAM_MAX_BOUNDS) || (exp && (start <= 0))) return NULL;
+    for (i = 0; i < n; i++) bounds[i] = exp?(i?bounds[i-1]*step:start):start+i*step;
+  }
+  else {
+    for (; tok; tok = strtok(NULL, " ")) {
+      if (n == HISTOGRAM_MAX_BOUNDS) return NULL;
+      bounds[n] = strtod(tok, &cp);
+      if ((cp == tok) || *cp || (n && (bounds[n] <= bounds[n-1]))) return NULL;
+      n++;
+    }
+  }
+
+  if (!(hist = (histogram *)malloc(sizeof(histogram)))) return NULL;
+  hist->nbounds = n;
+  for (hist->size = 1; hist->size <= n; hist->size *= 2);
+  if (!(hist->bounds = (float *)malloc(hist->size*sizeof(float)))) {
+    free(hist);
+    return NULL;
+  }
+  for (i = 0; i < hist->size; i++) hist->bounds[i] = i<n?bounds[i]:INFINITY;
+  return hist;
+}
+
 char *itoa(int digits) {
    static char buf[11];
    char *ptr = buf;
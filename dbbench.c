@@ -0,0 +1,246 @@
+#define _GNU_SOURCE // Needed for getopt() and strtoull() with -std=c99
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <float.h> // FLT_MIN and FLT_MAX constants
+#include <math.h> // INFINITY in config.c
+#include <limits.h> // INT_MIN and INT_MAX constants
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h> // inet_addr() in config.c
+#include <sys/ioctl.h> // struct winsize in main.h
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pcre.h>
+#include <sqlite3.h>
+#include "main.h"
+#include "history.c"
+#include "stats.c"
+#include "sketch.c"
+#include "config.c"
+#include "tsdb.c" // The storage engine of the daemon itself
+
+// Storage benchmark: writes samples into a database with the data table of anystat and the same
+// prepared insert as its writer thread, committing every <batch> rows, and reports the rows/s.
+// Run it with -b 1 -r for the old behaviour of one commit per row in a rollback journal, and with
+// the defaults for batched transactions on a WAL database with synchronous=NORMAL.
+// With -s it then times the queries the monitor runs at startup: the newest id and the latest
+// values of every series. Use -n 0 to only time these on an existing file, and -l for the legacy
+// layout without indexes to compare. Drop the page cache in between for cold cache numbers.
+// With -t the same samples go to a tsdb directory instead, flushed every <batch> rows, after
+// registering the series in its series file. Samples are 10 seconds apart and have 2 decimals;
+// both modes report the bytes on disk per sample.
+
+long long db_size(sqlite3 *);
+
+int nkeys = 100, batch = 5000, nlatest = 100, rollback = 0, legacy = 0, startup = 0;
+unsigned long long nrows = 1000000;
+
+long long mstime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+void exec(sqlite3 *db, char *query) {
+  char *err;
+
+  if (sqlite3_exec(db, query, NULL, NULL, &err) != SQLITE_OK) {
+    fprintf(stderr, "Sqlite error during %s: %s\n", query, err);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-n rows] [-k series] [-b rows per commit] [-r] [-l] [-s [-v values per series]] file\n"
+                  "       %s -t [-n rows] [-k series] [-b rows per flush] directory\n", name, name);
+  exit(EXIT_FAILURE);
+}
+
+void bench_insert(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  unsigned long long i;
+  long long start, ts = time(NULL)*1000LL-(long long)(nrows/nkeys)*10000;
+  int ms;
+
+  if (rollback) exec(db, "PRAGMA synchronous=FULL");
+  else {
+    exec(db, "PRAGMA journal_mode=WAL");
+    exec(db, "PRAGMA synchronous=NORMAL");
+  }
+  if (legacy) exec(db, "CREATE TABLE IF NOT EXISTS `data` (`input` integer, `ts` integer, `value` real)");
+  else {
+    exec(db, "CREATE TABLE IF NOT EXISTS `data` (`id` integer PRIMARY KEY, `input` integer NOT NULL, `ts` integer NOT NULL, `value` real)");
+    exec(db, "CREATE INDEX IF NOT EXISTS `data_input` ON `data` (`input`, `ts`)");
+    exec(db, "CREATE INDEX IF NOT EXISTS `data_ts` ON `data` (`ts`)");
+  }
+  sqlite3_prepare_v2(db, "INSERT INTO `data` (`input`, `ts`, `value`) VALUES (?001, ?002, ?003)", -1, &stmt, NULL);
+  if (!stmt) {
+    fprintf(stderr, "Failed to prepare query for update insert: %s\n", sqlite3_errmsg(db));
+    exit(EXIT_FAILURE);
+  }
+
+  start = mstime();
+  for (i = 0; i < nrows; i++) {
+    if (!(i%batch)) exec(db, "BEGIN");
+    sqlite3_bind_int(stmt, 1, i%nkeys+1);
+    sqlite3_bind_int64(stmt, 2, ts+(long long)(i/nkeys)*10000);
+    sqlite3_bind_double(stmt, 3, (double)(i/nkeys%100000)/100);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      fprintf(stderr, "Error while writing update to Sqlite database: %s\n", sqlite3_errmsg(db));
+      exit(EXIT_FAILURE);
+    }
+    sqlite3_reset(stmt);
+    if (!((i+1)%batch) || (i+1 == nrows)) exec(db, "COMMIT");
+  }
+  sqlite3_finalize(stmt);
+  ms = mstime()-start;
+  printf("Inserted %llu rows for %d series in %d ms with %d rows per commit%s: %.0f rows/s\n",
+         nrows, nkeys, ms, batch, rollback?" (rollback journal)":" (WAL)", ms?nrows*1000.0/ms:0);
+  if (!rollback) exec(db, "PRAGMA wal_checkpoint(TRUNCATE)");
+  printf("Database size %.1f bytes/row\n", (double)db_size(db)/nrows);
+}
+
+long long db_size(sqlite3 *db) { // Returns the size of the database in bytes
+  sqlite3_stmt *stmt;
+  long long size = 1;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    sqlite3_prepare_v2(db, i?"PRAGMA page_size":"PRAGMA page_count", -1, &stmt, NULL);
+    if (stmt && (sqlite3_step(stmt) == SQLITE_ROW)) size *= sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  return size;
+}
+
+void bench_tsdb(char *dir) {
+  char key[20], path[PATH_MAX];
+  unsigned long long i, size = 0;
+  long long start, ts = time(NULL)*1000LL-(long long)(nrows/nkeys)*10000;
+  int *ids, ms;
+  struct dirent *de;
+  struct stat st;
+  DIR *dp;
+
+  settings.tsdbdir = dir;
+  if ((mkdir(dir, 0755) && (errno != EEXIST)) || tsdb_upgrade()) {
+    fprintf(stderr, "Failed to set up tsdb directory %s\n", dir);
+    exit(EXIT_FAILURE);
+  }
+  if (!(ids = (int *)malloc(nkeys*sizeof(int)))) {
+    fprintf(stderr, "Failed to allocate memory for %d series\n", nkeys);
+    exit(EXIT_FAILURE);
+  }
+  start = mstime();
+  for (i = 0; i < nkeys; i++) {
+    sprintf(key, "key%llu", i);
+    if ((ids[i] = tsdb_lookup("dbbench", key)) <= 0) exit(EXIT_FAILURE);
+  }
+  printf("Registered %d series in %lld ms\n", nkeys, mstime()-start);
+
+  start = mstime();
+  for (i = 0; i < nrows; i++) {
+    tsdb_append(ids[i%nkeys], ts+(long long)(i/nkeys)*10000, (double)(i/nkeys%100000)/100);
+    if ((!((i+1)%batch) || (i+1 == nrows)) && tsdb_flush()) exit(EXIT_FAILURE);
+  }
+  ms = mstime()-start;
+  printf("Appended %llu samples for %d series in %d ms with %d samples per flush: %.0f samples/s\n",
+         nrows, nkeys, ms, batch, ms?nrows*1000.0/ms:0);
+  if ((dp = opendir(dir))) {
+    while ((de = readdir(dp))) {
+      snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+      if (!stat(path, &st) && S_ISREG(st.st_mode)) size += st.st_size;
+    }
+    closedir(dp);
+  }
+  printf("Directory size %.1f bytes/sample\n", (double)size/nrows);
+}
+
+void bench_startup(sqlite3 *db) { // The same queries as monitor.c, or the ones it used before version 1 with -l
+  sqlite3_stmt *stmt;
+  char query[150];
+  long long start, maxid = 0;
+  unsigned long long rows = 0;
+  int i;
+
+  start = mstime();
+  sqlite3_prepare_v2(db, "SELECT MAX(rowid) FROM data", -1, &stmt, NULL);
+  if (!stmt || (sqlite3_step(stmt) != SQLITE_ROW)) {
+    fprintf(stderr, "Failed to read last data id: %s\n", sqlite3_errmsg(db));
+    exit(EXIT_FAILURE);
+  }
+  maxid = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  if (legacy) snprintf(query, sizeof(query), "SELECT * FROM (SELECT ts, value FROM data WHERE input = ? AND rowid <= ? ORDER BY ts DESC LIMIT %d) ORDER BY ts", nlatest);
+  else snprintf(query, sizeof(query), "SELECT * FROM (SELECT ts, value FROM data WHERE input = ? AND id <= ? ORDER BY ts DESC LIMIT %d) ORDER BY ts", nlatest);
+  for (i = 1; i <= nkeys; i++) {
+    sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+    if (!stmt) {
+      fprintf(stderr, "Failed to prepare query for latest data: %s\n", sqlite3_errmsg(db));
+      exit(EXIT_FAILURE);
+    }
+    sqlite3_bind_int(stmt, 1, i);
+    sqlite3_bind_int64(stmt, 2, maxid);
+    while (sqlite3_step(stmt) == SQLITE_ROW) rows++;
+    sqlite3_finalize(stmt);
+  }
+  printf("Read the latest %d values of %d series (%llu rows) in %lld ms\n", nlatest, nkeys, rows, mstime()-start);
+}
+
+int main(int argc, char *argv[]) {
+  sqlite3 *db;
+  int opt, tsdb = 0;
+
+  while ((opt = getopt(argc, argv, "b:k:ln:rstv:")) != -1) {
+    switch (opt) {
+      case 'b':
+        batch = atoi(optarg);
+        break;
+      case 'k':
+        nkeys = atoi(optarg);
+        break;
+      case 'l':
+        legacy = 1;
+        break;
+      case 'n':
+        nrows = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        rollback = 1;
+        break;
+      case 's':
+        startup = 1;
+        break;
+      case 't':
+        tsdb = 1;
+        break;
+      case 'v':
+        nlatest = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if ((argc-optind != 1) || (nkeys < 1) || (batch < 1) || (nlatest < 1) || (!nrows && !startup) || (tsdb && (startup || !nrows))) usage(argv[0]);
+  if (tsdb) {
+    bench_tsdb(argv[optind]);
+    return EXIT_SUCCESS;
+  }
+  if (sqlite3_open(argv[optind], &db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open sqlite database %s: %s\n", argv[optind], sqlite3_errmsg(db));
+    exit(EXIT_FAILURE);
+  }
+  if (nrows) bench_insert(db);
+  if (startup) bench_startup(db);
+  sqlite3_close(db);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+void hist_add(input_t *, double);
+void hist_iter_init(hist_iter *, input_t *);
+int hist_iter_next(hist_iter *, float *);
+void hist_absolute(value_hist *, double);
+unsigned short hist_pack(float);
+float hist_unpack(unsigned short);
+unsigned short hist_pack_delta(double);
+double hist_unpack_delta(unsigned short);
+
+// The value history is a ring buffer of 16-bit values. Gauges are stored as truncated floats (the
+// upper half of an IEEE754 single, also known as bfloat16), which keeps the full float range at
+// roughly 3 significant digits of precision, plenty for plotting. That would flatten a large counter,
+// so as long as a series never decreases, its values are stored as increments on the previous one
+// instead, and read back by summing them from the exact last value in input->vallast: increments
+// that are whole numbers below 32768 are stored exactly (flagged with the top bit, which is the sign
+// of the bfloat16 used for others). The first time a series decreases, the ring is converted to plain
+// bfloat16 values for good.
+
+void hist_add(input_t *input, double fl) {
+  value_hist *hist = &input->valhist;
+  double prev = input->vallast;
+
+  input->vallast = fl;
+  if (!input->histsize) return;
+  if (!hist->buf) { // Allocate on first use, so inputs that never report cost nothing
+    if (!(hist->buf = (unsigned short *)calloc(input->histsize, sizeof(unsigned short)))) {
+      fprintf(stderr, "Failed to allocate %d history values for input %s\n", input->histsize, input->name);
+      input->histsize = 0;
+      return;
+    }
+    hist->size = input->histsize;
+    hist->delta = 1;
+  }
+  if (hist->delta && hist->len && !(fl >= prev && isfinite(fl))) hist_absolute(hist, prev); // Also for NaN and infinity
+  if (!hist->delta) hist->buf[hist->pos] = hist_pack(fl);
+  else hist->buf[hist->pos] = hist->len?hist_pack_delta(fl-prev):0; // The first one is never read
+  if (++hist->pos == hist->size) hist->pos = 0;
+  if (hist->len < hist->size) hist->len++;
+}
+
+// Iterate from the newest value to the oldest
+void hist_iter_init(hist_iter *it, input_t *input) {
+  it->hist = &input->valhist;
+  it->pos = it->hist->pos;
+  it->left = it->hist->len;
+  it->cur = input->vallast;
+}
+
+int hist_iter_next(hist_iter *it, float *fl) {
+  if (!it->left) return 0;
+  if (it->pos == 0) it->pos = it->hist->size;
+  if (it->hist->delta) {
+    *fl = it->cur;
+    it->cur -= hist_unpack_delta(it->hist->buf[--it->pos]);
+  }
+  else *fl = hist_unpack(it->hist->buf[--it->pos]);
+  it->left--;
+  return 1;
+}
+
+unsigned short hist_pack(float fl) {
+  unsigned int bits;
+
+  memcpy(&bits, &fl, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) return 0x7fc0; // NaN
+  bits += 0x7fff + ((bits >> 16) & 1); // Round to nearest even
+  return bits >> 16;
+}
+
+float hist_unpack(unsigned short half) {
+  unsigned int bits = (unsigned int)half << 16;
+  float fl;
+
+  memcpy(&fl, &bits, sizeof(fl));
+  return fl;
+}
+
+void hist_absolute(value_hist *hist, double last) { // Converts a ring of increments to bfloat16 values in place
+  unsigned int pos = hist->pos, left = hist->len;
+  unsigned short packed;
+
+  while (left--) {
+    if (pos == 0) pos = hist->size;
+    packed = hist->buf[--pos];
+    hist->buf[pos] = hist_pack(last);
+    last -= hist_unpack_delta(packed);
+  }
+  hist->delta = 0;
+}
+
+unsigned short hist_pack_delta(double delta) { // delta is never negative
+  if ((delta < 32768) && (delta == (int)delta)) return 0x8000|(int)delta;
+  return hist_pack(delta);
+}
+
+double hist_unpack_delta(unsigned short packed) {
+  if (packed & 0x8000) return packed & 0x7fff;
+  return hist_unpack(packed);
+}
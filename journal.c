@@ -0,0 +1,151 @@
+int journal_open(void);
+long long journal_append(input_t *, long long, double);
+void journal_write(long long, const void *, int);
+void journal_read(long long, void *, int);
+void journal_ack(int, long long);
+int journal_replay(void);
+
+// Crash-safe journal of recent samples: a memory-mapped circular file that process() appends every
+// sample to before it goes to the writer and uplink queues. The consumers move their cursor in the
+// header forward once their samples are committed to the database or written to the uplink, and a
+// restarted daemon replays whatever lies between each cursor and the head. Positions are logical
+// byte offsets that only ever increase; the space behind the slowest cursor is reused. Since the
+// file is shared memory, an append is a copy into the page cache, and samples survive a crash or
+// kill of the daemon (though not of the machine, as nothing is synced).
+
+static journal_hdr *journal = NULL;
+static char *journal_data;
+static int journal_full = 0;
+
+int journal_open(void) {
+  int fd, created = 0;
+  struct stat st;
+  size_t len = JOURNAL_HDR_SIZE+settings.journalsize;
+
+  if ((fd = open(settings.journalfile, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1) {
+    error_log("Failed to open journal '%s': %s\n", settings.journalfile, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st)) st.st_size = 0;
+  if (st.st_size != len) { // New, or resized in the config; replaying an old one isn't possible then
+    if (st.st_size) error_log("Journal '%s' has a different size; starting a new one\n", settings.journalfile);
+    if (ftruncate(fd, 0) || ftruncate(fd, len)) {
+      error_log("Failed to size journal '%s': %s\n", settings.journalfile, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    created = 1;
+  }
+  journal = (journal_hdr *)mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (journal == MAP_FAILED) {
+    error_log("Failed to map journal '%s': %s\n", settings.journalfile, strerror(errno));
+    journal = NULL;
+    return -1;
+  }
+  journal_data = (char *)journal+JOURNAL_HDR_SIZE;
+  if (created || (journal->magic != JOURNAL_MAGIC) || (journal->size != settings.journalsize)) {
+    memset(journal, 0, sizeof(journal_hdr));
+    journal->magic = JOURNAL_MAGIC;
+    journal->size = settings.journalsize;
+  }
+  // A consumer that isn't configured (any more) doesn't hold on to space
+  if (!settings.sqlitehandle && !settings.tsdbdir) journal->dbacked = journal->head;
+  if (!settings.nuplinks) journal->upacked = journal->head;
+  if (journal->dbacked > journal->head) journal->dbacked = journal->head;
+  if (journal->upacked > journal->head) journal->upacked = journal->head;
+  return 0;
+}
+
+// Returns the position after the record, which the consumers pass to journal_ack(), or 0 if the
+// sample couldn't be journaled because the slowest consumer is a whole journal behind
+long long journal_append(input_t *input, long long ts, double fl) {
+  journal_rec rec;
+  long long head, tail, dbacked, upacked;
+  int len, plen = input->parent?strlen(input->parent->name):0, nlen = strlen(input->name);
+  char pad[8] = "";
+
+  if (!journal) return 0;
+  len = (sizeof(journal_rec)+plen+nlen+2+7)&~7;
+  if (len > JOURNAL_REC_MAX) return 0;
+  head = journal->head;
+  dbacked = __atomic_load_n(&journal->dbacked, __ATOMIC_ACQUIRE);
+  upacked = __atomic_load_n(&journal->upacked, __ATOMIC_ACQUIRE);
+  tail = dbacked<upacked?dbacked:upacked;
+  if (head+len-tail > journal->size) {
+    if (!journal_full++) error_log("Journal '%s' is full; samples are not journaled until the consumers catch up\n", settings.journalfile);
+    settings.journalskipped++;
+    return 0;
+  }
+  rec.len = len;
+  rec.plen = plen;
+  rec.ts = ts;
+  rec.val = fl;
+  journal_write(head, &rec, sizeof(journal_rec));
+  journal_write(head+sizeof(journal_rec), input->parent?input->parent->name:"", plen+1);
+  journal_write(head+sizeof(journal_rec)+plen+1, input->name, nlen+1);
+  journal_write(head+sizeof(journal_rec)+plen+nlen+2, pad, len-sizeof(journal_rec)-plen-nlen-2);
+  __atomic_store_n(&journal->head, head+len, __ATOMIC_RELEASE);
+  journal_full = 0;
+  return head+len;
+}
+
+void journal_write(long long pos, const void *src, int len) { // Copies in up to two parts when wrapping around
+  unsigned int off = pos%journal->size, first = journal->size-off<len?journal->size-off:len;
+
+  memcpy(journal_data+off, src, first);
+  if (len > first) memcpy(journal_data, (const char *)src+first, len-first);
+}
+
+void journal_read(long long pos, void *dst, int len) {
+  unsigned int off = pos%journal->size, first = journal->size-off<len?journal->size-off:len;
+
+  memcpy(dst, journal_data+off, first);
+  if (len > first) memcpy((char *)dst+first, journal_data, len-first);
+}
+
+void journal_ack(int consumer, long long pos) { // Called by a consumer with its last written position
+  long long *cursor, cur;
+
+  if (!journal || !pos) return;
+  cursor = consumer==JOURNAL_UPLINK?&journal->upacked:&journal->dbacked;
+  cur = __atomic_load_n(cursor, __ATOMIC_RELAXED);
+  while ((pos > cur) && !__atomic_compare_exchange_n(cursor, &cur, pos, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)); // The uplinks' writers ack concurrently
+}
+
+// Requeues the samples that were journaled but not acknowledged by a consumer before the last exit.
+// Runs once the writer threads are started, so a full writer queue spills or waits as usual.
+int journal_replay(void) {
+  char buf[JOURNAL_REC_MAX], *parent, *name;
+  journal_rec *rec = (journal_rec *)buf;
+  input_t *input;
+  long long pos, tail = journal->dbacked<journal->upacked?journal->dbacked:journal->upacked;
+  int id, db = 0, up = 0, lost = 0;
+
+  for (pos = tail; pos < journal->head; pos += rec->len) {
+    journal_read(pos, rec, sizeof(journal_rec));
+    if ((rec->len < sizeof(journal_rec)+2) || (rec->len > JOURNAL_REC_MAX) || (pos+rec->len > journal->head)) {
+      error_log("Corrupt record in journal '%s'; skipping the rest\n", settings.journalfile);
+      break;
+    }
+    journal_read(pos, buf, rec->len);
+    parent = buf+sizeof(journal_rec);
+    name = parent+rec->plen+1;
+    for (input = inputs; input && (input->parent || strcmp(input->name, *parent?parent:name)); input = input->next);
+    if (input && *parent) input = get_child(input, name);
+    if (!input) continue; // Removed from the config
+    if ((pos >= journal->dbacked) && (settings.sqlitehandle || settings.tsdbdir) && ((id = __atomic_load_n(&input->sqlid, __ATOMIC_RELAXED)) >= 0)) {
+      struct update upd = { input, id, rec->ts, rec->val, pos+rec->len };
+      db_queue(&upd);
+      db++;
+    }
+    if ((pos >= journal->upacked) && settings.nuplinks) {
+      struct uplink_rec urec = { input, rec->ts, rec->val, NULL, pos+rec->len };
+      if (lost || uplink_queue(&urec, 0)) lost++; // The sender may not be connected; don't wait for it
+      else up++;
+    }
+  }
+  if (lost) error_log("Uplink queue full during journal replay; %d samples were not resent\n", lost);
+  if ((db || up) && settings.verbose) printf("Replayed %d samples to the db writer and %d to the uplink from journal %s\n", db, up, settings.journalfile);
+  return 0;
+}
@@ -0,0 +1,475 @@
+void do_listen(void);
+void listen_accept(listen_conn *);
+void listen_read(listen_conn *);
+int listen_grow(listen_conn *);
+int listen_parse(listen_conn *);
+void listen_line(listen_conn *, char *, int);
+int listen_frame(listen_conn *, const char *, int, int);
+void listen_sample(listen_conn *, input_t *, double, const char *, int);
+int listen_dup(listen_conn *, unsigned long long);
+input_t *listen_child(input_t *, char *);
+listen_sender *listen_sender_get(const char *, int);
+void listen_close(listen_conn *, const char *);
+
+// Ingestion server for LISTEN inputs: the listening sockets and every connection accepted on them
+// are registered edge-triggered with one epoll instance, which the main loop waits on along with the
+// other inputs. Each connection has its own buffer, which only grows for senders that fill it, and
+// is read up to LISTEN_READ_MAX bytes per turn; connections with data left are kept on a ready list
+// so one busy sender can't starve the rest. AGGREGATE inputs take the uplink output of other
+// anystats, as text lines or binary frames, and feed each series into the child named after it;
+// other subtypes parse the lines like a PIPE input would. Samples are timestamped on arrival, like
+// those of every other input.
+
+static listen_conn *listen_ready = NULL;
+static listen_sender *listen_senders = NULL;
+static input_t **listen_hash = NULL; // Children of AGGREGATE inputs, open addressing on the name
+static unsigned int listen_hashsize = 0, listen_nchildren = 0;
+static int listen_spare = -1; // Closed to accept and drop a connection when out of descriptors
+static z_stream listen_zs;
+static int listen_zinit = 0;
+
+void open_sockets(void) {
+  input_t *input;
+  listen_conn *conn;
+  struct sockaddr_in sa;
+  struct epoll_event ev;
+  struct rlimit rl;
+  int fd, on = 1;
+
+  for (input = inputs; input; input = input->next) {
+    if (input->type & INPUT_CONNECT) input->update = now; // Connected from the main loop
+    if ((input->type & INPUT_STATSD) && statsd_open(input)) exit(-1);
+    if (!(input->type & INPUT_LISTEN)) continue;
+    if (!epfd) {
+      if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        error_log("Failed to create epoll instance for LISTEN inputs: %s\n", strerror(errno));
+        exit(-1);
+      }
+      if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur < rl.rlim_max)) { // Room for thousands of connections
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+      }
+      listen_spare = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(input->sock->port);
+    sa.sin_addr.s_addr = input->sock->addr;
+    if (((fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1)
+     || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+     || bind(fd, (struct sockaddr *)&sa, sizeof(sa))
+     || listen(fd, LISTEN_BACKLOG)) {
+      error_log("Input %s: failed to listen on %s:%d: %s\n", input->name, inet_ntoa(sa.sin_addr), input->sock->port, strerror(errno));
+      exit(-1);
+    }
+    if (!(conn = (listen_conn *)calloc(1, sizeof(listen_conn)))) {
+      error_log("Failed to allocate memory for input %s\n", input->name);
+      exit(-1);
+    }
+    conn->fd = input->sock->fd = fd;
+    conn->listener = 1;
+    conn->input = input;
+    ev.events = EPOLLIN|EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      error_log("Input %s: failed to add listening socket to epoll: %s\n", input->name, strerror(errno));
+      exit(-1);
+    }
+    input->update = now;
+    if (settings.verbose) printf("Input %s listening on %s:%d\n", input->name, inet_ntoa(sa.sin_addr), input->sock->port);
+  }
+}
+
+// Called from the main loop when the epoll instance is readable or connections are on the ready list
+void do_listen(void) {
+  struct epoll_event events[LISTEN_EVENTS];
+  listen_conn *conn, *ready;
+  int i, n;
+
+  while ((n = epoll_wait(epfd, events, LISTEN_EVENTS, 0)) > 0) {
+    for (i = 0; i < n; i++) {
+      conn = (listen_conn *)events[i].data.ptr;
+      if (conn->listener) listen_accept(conn);
+      else if (!conn->ready) {
+        conn->ready = 1;
+        conn->nextready = listen_ready;
+        listen_ready = conn;
+      }
+    }
+    if (n < LISTEN_EVENTS) break;
+  }
+
+  ready = listen_ready; // Connections that use up their budget go on a new list for the next turn
+  listen_ready = NULL;
+  while ((conn = ready)) {
+    ready = conn->nextready;
+    conn->ready = 0;
+    listen_read(conn);
+  }
+}
+
+void listen_accept(listen_conn *listener) {
+  struct sockaddr_in sa;
+  socklen_t salen;
+  struct epoll_event ev;
+  listen_conn *conn;
+  int fd;
+
+  while (1) {
+    salen = sizeof(sa);
+    if ((fd = accept4(listener->fd, (struct sockaddr *)&sa, &salen, SOCK_NONBLOCK|SOCK_CLOEXEC)) == -1) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+      if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+      if (((errno == EMFILE) || (errno == ENFILE)) && (listen_spare != -1)) {
+        // Drop the connection rather than leave it queued, as an edge-triggered listener isn't reported again
+        error_log("Input %s: out of file descriptors; refused a connection\n", listener->input->name);
+        close(listen_spare);
+        if ((fd = accept(listener->fd, NULL, NULL)) != -1) close(fd);
+        listen_spare = open("/dev/null", O_RDONLY|O_CLOEXEC);
+        continue;
+      }
+      error_log("Input %s: failed to accept connection: %s\n", listener->input->name, strerror(errno));
+      return;
+    }
+    if (!(conn = (listen_conn *)calloc(1, sizeof(listen_conn))) || !(conn->buf = (char *)malloc(LISTEN_BUF_SIZE+1))) {
+      error_log("Failed to allocate memory for connection on input %s\n", listener->input->name);
+      free(conn);
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->input = listener->input;
+    conn->addr = sa.sin_addr;
+    conn->size = LISTEN_BUF_SIZE;
+    conn->binary = (conn->input->subtype & TYPE_AGGREGATE)?-1:0;
+    ev.events = EPOLLIN|EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      error_log("Input %s: failed to add connection to epoll: %s\n", conn->input->name, strerror(errno));
+      free(conn->buf);
+      free(conn);
+      close(fd);
+      continue;
+    }
+    settings.listenconns++;
+    if (settings.verbose) printf("Input %s accepted connection from %s (%lu open)\n", conn->input->name, inet_ntoa(sa.sin_addr), settings.listenconns);
+  }
+}
+
+void listen_read(listen_conn *conn) {
+  int n, room, total = 0;
+
+  while (total < LISTEN_READ_MAX) {
+    if (conn->len == conn->size) { // Holds only part of a line or frame
+      if (conn->size >= LISTEN_BUF_MAX) {
+        listen_close(conn, "sent a line or frame that is too long");
+        return;
+      }
+      if (listen_grow(conn)) return;
+    }
+    room = conn->size-conn->len;
+    if ((n = read(conn->fd, conn->buf+conn->len, room)) > 0) {
+      conn->len += n;
+      total += n;
+      if (listen_parse(conn)) return;
+      if ((n == room) && (conn->size < LISTEN_READ_MAX) && listen_grow(conn)) return; // Fewer reads for a busy sender
+    }
+    else if (!n) {
+      if (conn->len && !conn->binary) { // Last line without a newline
+        conn->buf[conn->len] = '\0';
+        if (conn->input->subtype & TYPE_AGGREGATE) listen_line(conn, conn->buf, conn->len);
+        else parse_line(conn->input, conn->buf);
+      }
+      listen_close(conn, NULL);
+      return;
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+    else if (errno != EINTR) {
+      listen_close(conn, strerror(errno));
+      return;
+    }
+  }
+  conn->ready = 1;
+  conn->nextready = listen_ready;
+  listen_ready = conn;
+}
+
+int listen_grow(listen_conn *conn) { // Returns -1 if the connection was closed
+  char *buf;
+
+  if (!(buf = (char *)realloc(conn->buf, conn->size*2+1))) {
+    listen_close(conn, "could not be given a larger buffer");
+    return -1;
+  }
+  conn->buf = buf;
+  conn->size *= 2;
+  return 0;
+}
+
+// Handles the complete lines or frames in the buffer and moves the rest to its start; returns -1 if
+// the connection was closed
+int listen_parse(listen_conn *conn) {
+  char *line, *end;
+  int pos = 0, mlen = strlen(PROTO_MAGIC);
+  unsigned int zlen, rawlen;
+  unsigned char *hdr;
+
+  if (conn->binary == -1) {
+    if (memcmp(conn->buf, PROTO_MAGIC, conn->len<mlen?conn->len:mlen)) conn->binary = 0;
+    else if (conn->len < mlen) return 0; // Wait for the rest of the magic
+    else {
+      conn->binary = 1;
+      pos = mlen;
+    }
+  }
+
+  if (conn->binary) {
+    while (conn->len-pos >= 8) {
+      hdr = (unsigned char *)conn->buf+pos;
+      zlen = hdr[0]<<24|hdr[1]<<16|hdr[2]<<8|hdr[3];
+      rawlen = hdr[4]<<24|hdr[5]<<16|hdr[6]<<8|hdr[7];
+      if ((zlen > LISTEN_BUF_MAX-8) || (rawlen > 2*UPLINK_BUF_SIZE)) {
+        listen_close(conn, "sent a frame that is too long");
+        return -1;
+      }
+      if (conn->len-pos < zlen+8) break;
+      if (listen_frame(conn, conn->buf+pos+8, zlen, rawlen)) return -1;
+      pos += zlen+8;
+    }
+  }
+  else {
+    for (line = conn->buf; (end = memchr(line, '\n', conn->buf+conn->len-line)); line = end+1) {
+      *end = '\0';
+      if (conn->input->subtype & TYPE_AGGREGATE) listen_line(conn, line, end-line);
+      else parse_line(conn->input, line);
+    }
+    pos = line-conn->buf;
+  }
+
+  if (pos) {
+    memmove(conn->buf, conn->buf+pos, conn->len-pos);
+    conn->len -= pos;
+  }
+  return 0;
+}
+
+// Handles a line in the uplink text format: "<series> <value> <timestamp> [<sequence number>]",
+// where the value may be an encoded distinct sketch, or the greeting "@anystat <name>"
+void listen_line(listen_conn *conn, char *line, int len) {
+  char *val, *ts, *seq;
+  input_t *child;
+
+  if (!strncmp(line, "@anystat ", 9)) {
+    conn->sender = listen_sender_get(line+9, len-9);
+    return;
+  }
+  if (!(val = memchr(line, ' ', len)) || !(ts = strchr(val+1, ' '))) {
+    if (settings.verbose) printf("Input %s: invalid line from %s: %s\n", conn->input->name, inet_ntoa(conn->addr), line);
+    return;
+  }
+  if ((seq = strchr(ts+1, ' ')) && listen_dup(conn, strtoull(seq+1, NULL, 10))) return;
+  *val = '\0';
+  if (!(child = listen_child(conn->input, line))) return;
+  if (!strncmp(val+1, "hll:", 4)) listen_sample(conn, child, 0, val+5, ts-val-5);
+  else listen_sample(conn, child, strtod(val+1, NULL), NULL, 0);
+}
+
+// Decompresses and handles a frame of the binary protocol, see proto.c; returns -1 if the connection
+// was closed because the frame was invalid
+int listen_frame(listen_conn *conn, const char *frame, int zlen, int rawlen) {
+  static char raw[2*UPLINK_BUF_SIZE+1];
+  char *p, *end, *reason = NULL, c;
+  unsigned long long seq, id, n, len;
+  input_t **series;
+  int r, type;
+
+  if (!listen_zinit) {
+    memset(&listen_zs, 0, sizeof(listen_zs));
+    if (inflateInit(&listen_zs) != Z_OK) {
+      listen_close(conn, "sent a frame that couldn't be decompressed");
+      return -1;
+    }
+    listen_zinit = 1;
+  }
+  else inflateReset(&listen_zs);
+  listen_zs.next_in = (unsigned char *)frame;
+  listen_zs.avail_in = zlen;
+  listen_zs.next_out = (unsigned char *)raw;
+  listen_zs.avail_out = rawlen;
+  if ((inflate(&listen_zs, Z_FINISH) != Z_STREAM_END) || listen_zs.avail_out) {
+    listen_close(conn, "sent a corrupt frame");
+    return -1;
+  }
+
+  p = raw;
+  end = raw+rawlen;
+  if (!(r = proto_getvarint(p, end-p, &n))) reason = "sent a frame without a header"; // Base timestamp, not used
+  else if (p += r, !(r = proto_getvarint(p, end-p, &seq))) reason = "sent a frame without a header";
+  else p += r;
+  while (!reason && (p < end)) {
+    type = *p++;
+    if (!(r = proto_getvarint(p, end-p, &id))) {
+      reason = "sent a message that was cut off";
+      break;
+    }
+    p += r;
+    if ((type == PROTO_DEFINE) || (type == PROTO_HELLO)) {
+      if (type == PROTO_HELLO) len = id; // A greeting only holds the name
+      else if (!(r = proto_getvarint(p, end-p, &len))) {
+        reason = "sent a message that was cut off";
+        break;
+      }
+      else p += r;
+      if (len > end-p) {
+        reason = "sent a message that was cut off";
+        break;
+      }
+      if (type == PROTO_HELLO) conn->sender = listen_sender_get(p, len);
+      else if (!id || (id > 1<<24)) reason = "defined an invalid series number";
+      else {
+        if (id >= conn->nseries) {
+          if (!(series = (input_t **)realloc(conn->series, (id+1024)*sizeof(input_t *)))) {
+            reason = "could not be given memory for more series";
+            break;
+          }
+          memset(series+conn->nseries, 0, (id+1024-conn->nseries)*sizeof(input_t *));
+          conn->series = series;
+          conn->nseries = id+1024;
+        }
+        c = p[len]; // The name is followed by the next message, or by the spare byte of raw
+        p[len] = '\0';
+        conn->series[id] = listen_child(conn->input, p);
+        p[len] = c;
+      }
+      p += len;
+    }
+    else if (type == PROTO_SEQ) seq = id-1;
+    else if ((type == PROTO_DOUBLE) || (type == PROTO_INT) || (type == PROTO_SKETCH)) {
+      if ((id >= conn->nseries) || !conn->series[id]) {
+        reason = "sent a sample of an undefined series";
+        break;
+      }
+      if (!(r = proto_getvarint(p, end-p, &n))) { // Timestamp delta, not used
+        reason = "sent a message that was cut off";
+        break;
+      }
+      p += r;
+      if (type == PROTO_DOUBLE) {
+        double fl;
+        if (end-p < sizeof(double)) {
+          reason = "sent a message that was cut off";
+          break;
+        }
+        memcpy(&fl, p, sizeof(double));
+        p += sizeof(double);
+        if (!listen_dup(conn, ++seq)) listen_sample(conn, conn->series[id], fl, NULL, 0);
+      }
+      else if (!(r = proto_getvarint(p, end-p, &n))) reason = "sent a message that was cut off";
+      else if (p += r, type == PROTO_INT) {
+        if (!listen_dup(conn, ++seq)) listen_sample(conn, conn->series[id], (double)(long long)((n>>1)^-(n&1)), NULL, 0);
+      }
+      else if (n > end-p) reason = "sent a message that was cut off";
+      else {
+        if (!listen_dup(conn, ++seq)) listen_sample(conn, conn->series[id], 0, p, n);
+        p += n;
+      }
+    }
+    else reason = "sent a message of an unknown type";
+  }
+  if (reason) {
+    listen_close(conn, reason);
+    return -1;
+  }
+  return 0;
+}
+
+void listen_sample(listen_conn *conn, input_t *child, double fl, const char *sketch, int len) {
+  char buf[HLL_REGISTERS+10];
+  hll tmp;
+
+  settings.listensamples++;
+  if (!sketch) {
+    if (!child->hll) process(child, fl); // Else it's the sender's own estimate of a series merged here
+    return;
+  }
+  if (len >= sizeof(buf)) len = sizeof(buf)-1; // Rejected by hll_decode()
+  memcpy(buf, sketch, len);
+  buf[len] = '\0';
+  if (hll_decode(&tmp, buf)) {
+    if (settings.verbose) printf("Input %s: invalid distinct sketch for %s from %s\n", conn->input->name, child->name, inet_ntoa(conn->addr));
+    return;
+  }
+  if (!child->hll && !(child->hll = (hll *)calloc(1, sizeof(hll)))) {
+    error_log("Failed to allocate memory for distinct counter on input %s\n", child->name);
+    return;
+  }
+  hll_merge(child->hll, &tmp); // Reported once per interval of the input
+  child->distinct = 2; // And passed on as a sketch, if this anystat has an uplink too
+}
+
+int listen_dup(listen_conn *conn, unsigned long long seq) { // Returns 1 if the sender delivered this sample before
+  if (!conn->sender || !seq) return 0;
+  if (seq == 1) conn->sender->seq = 0; // Numbering starts over after the sender's outbox was removed
+  if (seq <= conn->sender->seq) {
+    settings.listendups++;
+    return 1;
+  }
+  conn->sender->seq = seq;
+  return 0;
+}
+
+// Finds or adds the child of an AGGREGATE or STATSD input, through a hash table in front of get_child() since
+// these inputs may have many thousands of children
+input_t *listen_child(input_t *input, char *name) {
+  unsigned int i, j, mask;
+  input_t *child, **hash;
+
+  if (listen_nchildren*2 >= listen_hashsize) { // Grow the table, keeping it at most half full
+    unsigned int size = listen_hashsize?listen_hashsize*2:1024;
+    if (!(hash = (input_t **)calloc(size, sizeof(input_t *)))) return get_child(input, name);
+    for (j = 0; j < listen_hashsize; j++) {
+      if (!listen_hash[j]) continue;
+      for (i = hash_str(listen_hash[j]->name)&(size-1); hash[i]; i = (i+1)&(size-1));
+      hash[i] = listen_hash[j];
+    }
+    free(listen_hash);
+    listen_hash = hash;
+    listen_hashsize = size;
+  }
+  mask = listen_hashsize-1;
+  for (i = hash_str(name)&mask; (child = listen_hash[i]); i = (i+1)&mask) {
+    if ((child->parent == input) && !strcmp(child->name, name)) return child;
+  }
+  if (!(child = get_child(input, name))) return NULL;
+  listen_hash[i] = child;
+  listen_nchildren++;
+  return child;
+}
+
+listen_sender *listen_sender_get(const char *name, int len) {
+  listen_sender *sender;
+
+  for (sender = listen_senders; sender; sender = sender->next) {
+    if ((strlen(sender->name) == len) && !strncmp(sender->name, name, len)) return sender;
+  }
+  if (!(sender = (listen_sender *)calloc(1, sizeof(listen_sender))) || !(sender->name = strndup(name, len))) {
+    error_log("Failed to allocate memory for uplink sender\n");
+    free(sender);
+    return NULL;
+  }
+  sender->next = listen_senders;
+  listen_senders = sender;
+  if (settings.verbose) printf("New uplink sender %s\n", sender->name);
+  return sender;
+}
+
+void listen_close(listen_conn *conn, const char *reason) {
+  if (reason) error_log("Input %s: connection from %s %s; closing it\n", conn->input->name, inet_ntoa(conn->addr), reason);
+  close(conn->fd);
+  settings.listenconns--;
+  if (settings.verbose) printf("Input %s closed connection from %s (%lu open, %llu samples received, %llu duplicates skipped)\n",
+                               conn->input->name, inet_ntoa(conn->addr), settings.listenconns, settings.listensamples, settings.listendups);
+  free(conn->buf);
+  free(conn->series);
+  free(conn);
+}
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE // Needed for getopt() and strtoull() with -std=c99
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+
+// Load generator for LISTEN inputs of type AGGREGATE: opens many connections to anystat and sends
+// lines in the uplink text format over all of them as fast as they are taken. Each connection is
+// then shut down for writing, and anystat closes it once it has read everything, so the reported
+// rate covers samples that were parsed and processed, not just buffered in the kernel.
+// With -u it sends statsd counters to a STATSD input instead: datagrams of -m "<name>:1|c" lines,
+// LOADGEN_UDP_BATCH at a time with sendmmsg(). UDP has no flow control, so compare the number sent
+// with what anystat reports for the series to see how many were dropped. For example, against the
+// statsd input of anystat.conf ("statsd *:8125", interval 10) with a metrics endpoint configured:
+//   loadgen -u -n 20000 -m 10 -k 50 127.0.0.1 8125
+// sends 200000 counts, so each of the 50 children reads 4000 on /metrics when the run fits in one interval.
+
+#define LOADGEN_BLOCK 65536 // Bytes of lines formatted at once per connection
+#define LOADGEN_UDP_BATCH 64 // Datagrams sent per sendmmsg() call
+#define LOADGEN_DGRAM_MAX 1400 // Max size of a datagram, to stay below the MTU
+
+typedef struct conn {
+  int fd;
+  int id;
+  char buf[LOADGEN_BLOCK];
+  int len;
+  int sent;
+  unsigned long long lines; // Formatted so far
+  unsigned long long seq;
+  int state; // 0 = connecting, 1 = sending, 2 = waiting for anystat to close, 3 = done
+} conn;
+
+int nconns = 100, nkeys = 10, useseq = 0, udp = 0, nmetrics = 1;
+unsigned long long nlines = 100000;
+
+long long mstime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+void fill(conn *c) { // Formats the next block of lines for a connection
+  time_t now = time(NULL);
+  int n;
+
+  c->len = c->sent = 0;
+  if (useseq && !c->lines && !c->seq) c->len = sprintf(c->buf, "@anystat loadgen%d\n", c->id);
+  while ((c->lines < nlines) && (c->len < LOADGEN_BLOCK-100)) {
+    n = c->lines%nkeys;
+    if (useseq) c->len += sprintf(c->buf+c->len, "gen%d.key%d %llu %ld.000 %llu\n", c->id, n, c->lines/nkeys, (long)now, ++c->seq);
+    else c->len += sprintf(c->buf+c->len, "gen%d.key%d %llu %ld.000\n", c->id, n, c->lines/nkeys, (long)now);
+    c->lines++;
+  }
+}
+
+void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-c connections] [-n samples per connection] [-k series per connection] [-s] address port\n"
+                  "       %s -u [-n datagrams] [-m metrics per datagram] [-k series] address port\n", name, name);
+  exit(EXIT_FAILURE);
+}
+
+void send_statsd(struct sockaddr_in *sa) { // Sends nlines datagrams as fast as the socket takes them
+  static char bufs[LOADGEN_UDP_BATCH][LOADGEN_DGRAM_MAX];
+  struct iovec iovs[LOADGEN_UDP_BATCH];
+  struct mmsghdr msgs[LOADGEN_UDP_BATCH];
+  unsigned long long sent = 0, metric = 0, metrics = 0, first;
+  long long start;
+  int fd, i, j, n, len, cnt[LOADGEN_UDP_BATCH];
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    fprintf(stderr, "Failed to create UDP socket: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  memset(msgs, 0, sizeof(msgs));
+  start = mstime();
+  while (sent < nlines) {
+    n = nlines-sent<LOADGEN_UDP_BATCH?nlines-sent:LOADGEN_UDP_BATCH;
+    first = metric;
+    for (i = 0; i < n; i++) {
+      for (len = j = 0; (j < nmetrics) && (len < LOADGEN_DGRAM_MAX-40); j++) {
+        len += sprintf(bufs[i]+len, "%sgen.key%llu:1|c", j?"\n":"", metric++%nkeys);
+      }
+      cnt[i] = j;
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = len;
+      msgs[i].msg_hdr.msg_name = sa;
+      msgs[i].msg_hdr.msg_namelen = sizeof(*sa);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if ((n = sendmmsg(fd, msgs, n, 0)) == -1) {
+      if ((errno != ENOBUFS) && (errno != EAGAIN)) {
+        fprintf(stderr, "Send failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      n = 0;
+    }
+    for (metric = first, i = 0; i < n; i++) metric += cnt[i]; // Unsent datagrams are formatted again
+    metrics += metric-first;
+    sent += n;
+  }
+  n = mstime()-start;
+  printf("Sent %llu datagrams with %llu metrics over %d series in %d ms: %.0f datagrams/s, %.0f metrics/s\n",
+         sent, metrics, nkeys, n, n?sent*1000.0/n:0, n?metrics*1000.0/n:0);
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_in sa;
+  struct pollfd *pfds;
+  struct rlimit rl;
+  conn *conns;
+  long long start, connected = 0, sent = 0;
+  int i, n, left, opt;
+  char dummy[256];
+
+  while ((opt = getopt(argc, argv, "c:k:m:n:su")) != -1) {
+    switch (opt) {
+      case 'c':
+        nconns = atoi(optarg);
+        break;
+      case 'k':
+        nkeys = atoi(optarg);
+        break;
+      case 'n':
+        nlines = strtoull(optarg, NULL, 10);
+        break;
+      case 'm':
+        nmetrics = atoi(optarg);
+        break;
+      case 's':
+        useseq = 1;
+        break;
+      case 'u':
+        udp = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if ((argc-optind != 2) || (nconns < 1) || (nkeys < 1) || (nmetrics < 1)) usage(argv[0]);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = inet_addr(argv[optind]);
+  sa.sin_port = htons(atoi(argv[optind+1]));
+  if (udp) {
+    send_statsd(&sa);
+    return EXIT_SUCCESS;
+  }
+
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur < rl.rlim_max)) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (!(conns = (conn *)calloc(nconns, sizeof(conn))) || !(pfds = (struct pollfd *)calloc(nconns, sizeof(struct pollfd)))) {
+    fprintf(stderr, "Failed to allocate memory for %d connections\n", nconns);
+    exit(EXIT_FAILURE);
+  }
+
+  start = mstime();
+  for (i = 0; i < nconns; i++) {
+    conns[i].id = i;
+    if (((conns[i].fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0)) == -1)
+     || (connect(conns[i].fd, (struct sockaddr *)&sa, sizeof(sa)) && (errno != EINPROGRESS))) {
+      fprintf(stderr, "Failed to connect connection %d: %s\n", i, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    pfds[i].fd = conns[i].fd;
+    pfds[i].events = POLLOUT;
+  }
+
+  for (left = nconns; left; ) {
+    if (poll(pfds, nconns, 60000) <= 0) { // The kernel resends SYNs dropped at a full backlog; a refused one is fatal below
+      fprintf(stderr, "No progress in 60 seconds; %d connections left\n", left);
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nconns; i++) {
+      conn *c = &conns[i];
+
+      if (!pfds[i].revents) continue;
+      if (c->state == 0) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+          fprintf(stderr, "Failed to connect connection %d: %s\n", i, strerror(err));
+          exit(EXIT_FAILURE);
+        }
+        c->state = 1;
+        fill(c);
+        if (++connected == nconns) printf("Connected %d connections in %lld ms\n", nconns, mstime()-start);
+      }
+      if (c->state == 1) {
+        while (c->sent < c->len) {
+          if ((n = write(c->fd, c->buf+c->sent, c->len-c->sent)) > 0) c->sent += n;
+          else break;
+        }
+        if ((c->sent < c->len) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+          fprintf(stderr, "Write failed on connection %d: %s\n", i, strerror(errno));
+          exit(EXIT_FAILURE);
+        }
+        if (c->sent == c->len) {
+          if (c->lines < nlines) fill(c);
+          else {
+            sent += c->lines;
+            shutdown(c->fd, SHUT_WR);
+            c->state = 2;
+            pfds[i].events = POLLIN;
+          }
+        }
+      }
+      else if (c->state == 2) {
+        if ((n = read(c->fd, dummy, sizeof(dummy))) <= 0) {
+          if ((n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) continue;
+          close(c->fd);
+          c->state = 3;
+          pfds[i].fd = -1;
+          left--;
+        }
+      }
+    }
+  }
+
+  n = mstime()-start;
+  printf("Sent %llu samples over %d connections in %d ms: %.0f samples/s\n", sent, nconns, n, n?sent*1000.0/n:0);
+  return EXIT_SUCCESS;
+}
@@ -18,6 +18,8 @@
 #include <sys/inotify.h>
 #include <sys/socket.h>
 #include <netinet/ip.h> // INADDR_ANY and INADDR_NONE macro's
+#include <netinet/tcp.h> // TCP_NODELAY and TCP_CORK
+#include <sys/un.h> // Unix sockets for CONNECT inputs
 #include <arpa/inet.h> // inet_addr()
 #include <sys/ioctl.h>
 #include <sys/time.h>
@@ -27,22 +29,39 @@
 #include <dirent.h> // scandir(), versionsort()
 #include <locale.h> // setlocale()
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h> // setrlimit()
+#include <sys/mman.h>
 #include <syslog.h>
+#include <fnmatch.h> // Subscription patterns
+#include <zlib.h>
 #include <sqlite3.h> // sqlite support (probably make this an IFDEF in the future to avoid always having this dependency)
 
 #include "main.h"
+#include "history.c"
+#include "stats.c"
+#include "sketch.c"
 #include "config.c"
+#include "tsdb.c"
+#include "ring.c"
 
 void do_cat(input_t *);
 void do_tail(input_t *);
 void do_tail_fp(input_t *, FILE *, int);
 void do_namepos(input_t *, char *, char *);
+input_t *get_child(input_t *, char *);
+int register_input(input_t *);
 void do_pipe(input_t *);
 int parse_line(input_t *, char *);
 void parse_value(input_t *, char *);
-void consolidate(input_t *, float);
-void process(input_t *, float);
+void consolidate(input_t *, double);
+void process(input_t *, double);
 void report_consol(input_t *);
+void report_distinct(input_t *);
+void report_histograms(input_t *);
+void report_histogram(input_t *);
 void display(input_t *);
 void start_watches(void);
 void start_pipes(void);
@@ -50,12 +69,43 @@ void start_pipe(input_t *);
 void start_tails(void);
 void start_cmd(input_t *);
 void open_fifos(void);
+void open_fifo(input_t *);
 void open_sockets(void);
+void start_connect(input_t *);
+void connect_fail(input_t *, const char *, int);
+int read_lines(input_t *, int);
+int statsd_open(input_t *);
+void do_statsd(input_t *);
+void report_statsd(input_t *);
 void set(char **, char *);
-void write_log(input_t *, float);
-void prune_db();
+void write_log(input_t *, double);
+int prune_db(int, long long);
+int rollup_add(struct update *);
+int rollup_flush();
+int rollup_write(int, int);
+int db_commit(int, int *, long long, long long);
 void *write_db();
-void *write_sock();
+void *write_tsdb();
+int db_exec(char *);
+int db_int(char *, int);
+int db_schema();
+void db_commit_stats(int, long long);
+int db_queue_init(void);
+void db_queue(struct update *);
+int db_unspool(struct update *, int);
+void db_queue_stats(void);
+long long mstime(void);
+long long epochms(void);
+void *write_sock(void *);
+int uplink_len(struct uplink_rec *);
+int uplink_format(struct uplink_rec *, char *);
+char *uplink_key(input_t *);
+int uplink_fail(uplink_t *, const char *, int, int *, unsigned int *);
+void uplink_connected(uplink_t *);
+void uplink_stats(uplink_t *, int);
+uplink_t *uplink_route(input_t *);
+int uplink_queue(struct uplink_rec *, int);
+void uplink_ack(uplink_t *, long long);
 void send_alert(int, char *);
 char *gettok(char *, int, char);
 char *itodur(int);
@@ -63,13 +113,23 @@ char *itoa(int);
 void sig_winch(int);
 void error_log(const char*, ...);
 void do_exit(int);
-int uplink_connect(void);
+int uplink_connect(uplink_t *);
+void poll_reset(void);
+void poll_add(int, short);
+int poll_wait(int);
+int poll_ready(int, short);
+
+#include "journal.c" // Uses the functions above
+#include "outbox.c"
+#include "proto.c"
+#include "listen.c"
+#include "statsd.c"
+#include "subscribe.c"
+#include "metrics.c"
 
 int main(int argc, char *argv[]) {
-  struct timeval tv;
   input_t *input;
-  int maxfd, maxsleep, c, pid;
-  fd_set readfds;
+  int maxsleep, c, pid;
   struct stat statbuf;
   struct inotify_event ievent;
 
@@ -153,16 +213,36 @@ int main(int argc, char *argv[]) {
     set(&settings.logdir, NULL);
   }
 
-  if (settings.sqlitefile) {
+  if (settings.tsdbdir) { // Inputs get their series id on their first sample
+    if (mkdir(settings.tsdbdir, 0755) && (errno != EEXIST)) {
+      error_log("Failed to create tsdb directory '%s': %s\n", settings.tsdbdir, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    if (tsdb_upgrade()) return EXIT_FAILURE;
+    if (settings.sqlitefile && settings.verbose) printf("Storing data in tsdb directory %s instead of SQLite database %s\n", settings.tsdbdir, settings.sqlitefile);
+    if (db_queue_init()) return EXIT_FAILURE;
+    pthread_create(&settings.sqlitethread, NULL, write_tsdb, NULL);
+    pthread_setname_np(settings.sqlitethread, "tsdb_writer");
+    settings.sqlitehandle = NULL;
+  }
+  else if (settings.sqlitefile) {
     int id;
     const unsigned char *name, *sub;
     sqlite3_stmt *stmt;
 
+    if (sqlite3_libversion_number() < DB_SQLITE_MIN) {
+      error_log("Sqlite library version %s is too old; anystat needs %d.%d or later\n", sqlite3_libversion(), DB_SQLITE_MIN/1000000, DB_SQLITE_MIN/1000%1000);
+      exit(EXIT_FAILURE);
+    }
     if ((c = sqlite3_open(settings.sqlitefile, &settings.sqlitehandle))) {
       error_log("Failed to open sqlite database '%s': %s\n", settings.sqlitefile, sqlite3_errmsg(settings.sqlitehandle));
       exit(EXIT_FAILURE);
     }
     if (settings.verbose) printf("Opened SQLite database %s\n", settings.sqlitefile);
+    // WAL lets the writer thread commit without blocking readers such as the monitor; with
+    // synchronous=NORMAL a commit no longer waits for an fsync (the WAL is synced at checkpoints)
+    if (db_exec("PRAGMA journal_mode=WAL") || db_exec("PRAGMA synchronous=NORMAL")) exit(EXIT_FAILURE);
+    if (db_schema()) exit(EXIT_FAILURE);
     sqlite3_prepare_v2(settings.sqlitehandle, "SELECT `id`, `name`, `sub` FROM inputs", 39, &stmt, NULL);
     if (!stmt) {
       error_log("Failed to prepare query for inputs on SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
@@ -184,43 +264,45 @@ int main(int argc, char *argv[]) {
       error_log("Error while reading inputs from SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       return EXIT_FAILURE;
     }
+    sqlite3_finalize(stmt);
     for (input = inputs; input; input = input->next) {
-      if (!input->sqlid) {
-        char *err, query[100];
-        if (input->parent) sprintf(query, "INSERT INTO `inputs` (`name`, `sub`) VALUES ('%s', '%s')", input->parent->name, input->name);
-        else sprintf(query, "INSERT INTO `inputs` (`name`) VALUES ('%s')", input->name);
-        if (sqlite3_exec(settings.sqlitehandle, query, NULL, NULL, &err) != SQLITE_OK) {
-          error_log("Sqlite error: %s\n", err);
-          sqlite3_free(err);
-        }
-        else {
-          input->sqlid = sqlite3_last_insert_rowid(settings.sqlitehandle);
-          if (settings.verbose) printf("Added new input %s to SQLite db with id %d\n", input->name, input->sqlid);
-        }
-      }
-    }
-    if (pipe(settings.sqlitepipe)) {
-      perror("Error creating db writer pipe: ");
-      return EXIT_FAILURE;
+      if (!input->sqlid) register_input(input); // Writer thread isn't running yet
     }
+    if (db_queue_init()) return EXIT_FAILURE;
     pthread_create(&settings.sqlitethread, NULL, write_db, NULL);
     pthread_setname_np(settings.sqlitethread, "sqlite_writer");
   }
   else settings.sqlitehandle = NULL;
 
-  if (settings.uplinkhost && settings.uplinkport) {
-    if (pipe(settings.uplinkpipe)) {
-      perror("Error creating socket writer pipe: ");
+  if (settings.nuplinks) {
+    if (settings.outboxdir && (settings.nuplinks > 1)) { // Samples for an uplink that is down go to the next one instead
+      fprintf(stderr, "The uplink-outbox setting can only be used with a single uplink\n");
       return EXIT_FAILURE;
     }
-    pthread_create(&settings.uplinkthread, NULL, write_sock, NULL);
-    pthread_setname_np(settings.uplinkthread, "socket_writer");
+    if (settings.outboxdir && outbox_open()) return EXIT_FAILURE;
+    for (c = 0; c < settings.nuplinks; c++) {
+      uplink_t *up = &settings.uplinks[c];
+      snprintf(mainbuf, MAIN_BUF_SIZE, "%s:%d", up->host, up->port);
+      up->seed = hash_str(mainbuf);
+      if (ring_init(&up->ring, UPLINK_RING_SIZE, sizeof(struct uplink_rec))) {
+        perror("Error creating socket writer queue: ");
+        return EXIT_FAILURE;
+      }
+      pthread_create(&up->thread, NULL, write_sock, up);
+      pthread_setname_np(up->thread, "socket_writer");
+    }
+  }
+  if (settings.journalfile && (settings.sqlitehandle || settings.tsdbdir || settings.nuplinks)) {
+    if (journal_open()) return EXIT_FAILURE;
+    journal_replay();
   }
 
   start_tails();
   start_pipes();
   open_fifos();
   open_sockets();
+  if (settings.subscribepath) sub_open();
+  if (settings.metricsport) metrics_open();
 
   fflush(stdout);
 
@@ -243,15 +325,24 @@ int main(int argc, char *argv[]) {
 
     for (input = inputs; input; input = input->next) {
       if (input->parent) continue;
+      if ((input->type & INPUT_CONNECT) && !input->sock->fd) { // Connection is kept open; its lines are read below
+        if ((c = input->sock->retry-now) <= 0) start_connect(input);
+        else if (c < maxsleep) maxsleep = c;
+      }
       if (input->type & INPUT_CAT) {
         if ((c = now-input->interval-input->update) >= 0) do_cat(input);
         else if (-c < maxsleep) maxsleep = -c;
       }
-      else if ((input->type & INPUT_TAIL) && ((input->subtype & (TYPE_COUNT|TYPE_NAMECOUNT)) || input->consol)) {
+      else if ((input->type & INPUT_TAIL) && ((input->subtype & (TYPE_COUNT|TYPE_NAMECOUNT|TYPE_DISTINCT)) || input->consol || input->histogram)) {
         if ((c = now-input->interval-input->update) >= 0) {
           do_tail(input);
+          if (input->histogram) {
+            input->update = now;
+            report_histograms(input);
+          }
           if (input->consol) {
             input->update = now;
+            if ((input->subtype & TYPE_VALPOS) && !(input->consol & CONSOL_FIRST)) report_consol(input);
             while (input->next && input->next->parent) {
               input = input->next;
               report_consol(input);
@@ -264,11 +355,16 @@ int main(int argc, char *argv[]) {
         if ((c = now-input->interval-input->update) >= 0) start_cmd(input);
         else if (-c < maxsleep) maxsleep = -c;
       }
-      else if ((input->type & INPUT_PIPE) && ((input->subtype & (TYPE_COUNT|TYPE_NAMECOUNT)) || input->consol)) { // One-shot pipe cmd
+      else if ((input->type & (INPUT_PIPE|INPUT_FIFO|INPUT_LISTEN|INPUT_CONNECT)) && ((input->subtype & (TYPE_COUNT|TYPE_NAMECOUNT|TYPE_DISTINCT|TYPE_AGGREGATE)) || input->consol || input->histogram)) { // One-shot pipe cmd or socket input
         if ((c = now-input->interval-input->update) >= 0) {
           do_pipe(input);
+          if (input->histogram) {
+            input->update = now;
+            report_histograms(input);
+          }
           if (input->consol) {
             input->update = now;
+            if ((input->subtype & TYPE_VALPOS) && !(input->consol & CONSOL_FIRST)) report_consol(input);
             while (input->next && input->next->parent) {
               input = input->next;
               report_consol(input);
@@ -277,6 +373,10 @@ int main(int argc, char *argv[]) {
         }
         else if (-c < maxsleep) maxsleep = -c;
       }
+      else if (input->type & INPUT_STATSD) {
+        if ((c = now-input->interval-input->update) >= 0) report_statsd(input);
+        else if (-c < maxsleep) maxsleep = -c;
+      }
       else if (input->type & INPUT_PIPE) { // Continuous pipe cmd
         if (!input->pipe->pid) { // Cmd not running
           if ((c = now-input->interval-input->start) >= 0) start_pipe(input);
@@ -285,41 +385,36 @@ int main(int argc, char *argv[]) {
       }
     }
 
-    maxfd = STDIN_FILENO;
-    FD_ZERO(&readfds);
-//    FD_SET(STDIN_FILENO, &readfds);
-    FD_SET(inot, &readfds);
-    if (inot > maxfd) maxfd = inot;
+    poll_reset();
+    poll_add(inot, POLLIN);
     for (input = inputs; input; input = input->next) {
-      if ((input->type & INPUT_CMD) && input->cmd->fds[0]) {
-        FD_SET(input->cmd->fds[0], &readfds);
-        if (input->cmd->fds[0] > maxfd) maxfd = input->cmd->fds[0];
-      }
-      else if ((input->type & INPUT_PIPE) && input->pipe->fds[0]) {
-        FD_SET(input->pipe->fds[0], &readfds);
-        if (input->pipe->fds[0] > maxfd) maxfd = input->pipe->fds[0];
-      }
+      if ((input->type & INPUT_CMD) && input->cmd->fds[0]) poll_add(input->cmd->fds[0], POLLIN);
+      else if ((input->type & INPUT_PIPE) && input->pipe->fds[0]) poll_add(input->pipe->fds[0], POLLIN);
+      else if ((input->type & INPUT_FIFO) && input->fifo->fd) poll_add(input->fifo->fd, POLLIN);
+      else if ((input->type & INPUT_CONNECT) && input->sock->fd) poll_add(input->sock->fd, input->sock->connecting?POLLOUT:POLLIN);
+      else if ((input->type & INPUT_STATSD) && input->sock->fd) poll_add(input->sock->fd, POLLIN);
     }
 
 //    printf("Sleeping up to %d seconds\n", maxsleep);
 
-    tv.tv_sec = maxsleep;
-    tv.tv_usec = 0;
+    if (epfd) poll_add(epfd, POLLIN);
+    sub_poll();
+    metrics_poll();
 
-    c = select(maxfd+1, &readfds, NULL, NULL, &tv);
+    c = poll_wait(listen_ready?0:maxsleep*1000); // Connections with data left don't wait
 
     now = time(NULL);
 
     if (c == -1) {
       if (errno == EINTR) {
-        if (settings.verbose) printf("select() interrupted\n");
+        if (settings.verbose) printf("poll() interrupted\n");
         sleep(1);
         continue;
       }
       exit(-5);
     }
     else if (c > 0) {
-      if (FD_ISSET(inot, &readfds)) {
+      if (poll_ready(inot, POLLIN)) {
         while ((c = read(inot, &ievent, sizeof(ievent))) > 0) {
           for (input = inputs; input; input = input->next) {
             if ((input->type & INPUT_TAIL) && (input->tail->watch == ievent.wd)) {
@@ -365,7 +460,7 @@ int main(int argc, char *argv[]) {
         char *start, *end, *tok, *line;
         int done = 0, offset = 0, r, matches[30];
 
-        if ((input->type & INPUT_CMD) && input->cmd->fds[0] && FD_ISSET(input->cmd->fds[0], &readfds)) {
+        if ((input->type & INPUT_CMD) && input->cmd->fds[0] && poll_ready(input->cmd->fds[0], POLLIN)) {
           if (input->buffer) {
             strcpy(mainbuf, input->buffer);
             offset = strlen(mainbuf);
@@ -391,6 +486,7 @@ int main(int argc, char *argv[]) {
 
             if (offset) parse_line(input, start);
             if (input->subtype & TYPE_COUNT) process(input, input->count);
+            else if (input->subtype & TYPE_DISTINCT) report_distinct(input);
             else if (input->subtype & TYPE_NAMECOUNT) {
               input_t *sub;
               process(input, input->count);
@@ -405,7 +501,9 @@ int main(int argc, char *argv[]) {
               process(input, tv.tv_sec - input->tv.tv_sec + (tv.tv_usec - input->tv.tv_usec)/1000000.0);
               memset(&input->tv, 0, sizeof(struct timeval));
             }
+            else if (input->histogram) report_histograms(input);
             else if (input->consol) {
+              if ((input->subtype & TYPE_VALPOS) && !(input->consol & CONSOL_FIRST)) report_consol(input);
               while (input->next && input->next->parent) {
                 input = input->next;
                 report_consol(input);
@@ -428,49 +526,56 @@ int main(int argc, char *argv[]) {
           }
         }
         else if (input->type & INPUT_PIPE) {
-          if (input->pipe->fds[0] && FD_ISSET(input->pipe->fds[0], &readfds)) {
-            if (input->buffer) {
-              strcpy(mainbuf, input->buffer);
-              offset = strlen(mainbuf);
-              free(input->buffer);
-              input->buffer = NULL;
-            }
-            else *mainbuf = '\0';
-
-            while ((c = read(input->pipe->fds[0], mainbuf+offset, MAIN_BUF_SIZE-offset)) > 0) {
-              mainbuf[c+offset] = '\0';
-              start = mainbuf;
-
-              while (!done && (end = strchr(start, '\n'))) {
-                *end = '\0';
-                done = parse_line(input, start);
-                start = end+1;
-              }
-              offset = strlen(start);
-            }
-
-            if (c) {
-              if (errno == EAGAIN) { // Nothing left to read currently
-                if (offset) { // Something not newline-terminated was left in the buffer
-                  input->buffer = (char *)malloc(strlen(start)+1);
-                  strcpy(input->buffer, start);
-                }
-              }
-              else {
-                perror("read()");
-                exit(-6);
-              }
-            }
-            else {
+          if (input->pipe->fds[0] && poll_ready(input->pipe->fds[0], POLLIN)) {
+            if (!(c = read_lines(input, input->pipe->fds[0]))) {
               error_log("Input %s closed pipe unexpectedly\n", input->name);
               close(input->pipe->fds[0]);
               input->pipe->fds[0] = 0;
             }
+            else if ((c == -1) && (errno != EAGAIN)) {
+              perror("read()");
+              exit(-6);
+            }
           }
         }
+        else if ((input->type & INPUT_FIFO) && input->fifo->fd && poll_ready(input->fifo->fd, POLLIN)) {
+          if (!(c = read_lines(input, input->fifo->fd))) { // Only if the write side couldn't be held open
+            if (input->buffer) parse_line(input, input->buffer);
+            free(input->buffer);
+            input->buffer = NULL;
+            close(input->fifo->fd);
+            input->fifo->fd = 0;
+            open_fifo(input);
+          }
+          else if ((c == -1) && (errno != EAGAIN)) error_log("Input %s: failed to read from FIFO %s: %s\n", input->name, input->fifo->filename, strerror(errno));
+        }
+        else if ((input->type & INPUT_CONNECT) && input->sock->fd) {
+          if (input->sock->connecting && poll_ready(input->sock->fd, POLLOUT)) {
+            socklen_t errlen = sizeof(r);
+            if (getsockopt(input->sock->fd, SOL_SOCKET, SO_ERROR, &r, &errlen)) r = errno;
+            if (r) connect_fail(input, "connect failed", r);
+            else {
+              input->sock->connecting = 0;
+              if (settings.verbose) printf("Input %s connected\n", input->name);
+            }
+          }
+          else if (poll_ready(input->sock->fd, POLLIN)) {
+            if ((c = read_lines(input, input->sock->fd)) > 0) input->sock->backoff = 0;
+            else if (!c) {
+              if (input->buffer) parse_line(input, input->buffer); // Last line without a newline
+              connect_fail(input, "connection closed", 0);
+            }
+            else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) connect_fail(input, "read failed", errno);
+          }
+        }
+        else if ((input->type & INPUT_STATSD) && input->sock->fd && poll_ready(input->sock->fd, POLLIN)) do_statsd(input);
       }
     }
-    else { }  // printf("select() timeout\n");
+    else { }  // printf("poll() timeout\n");
+    if (epfd && (listen_ready || poll_ready(epfd, POLLIN))) do_listen();
+    do_subscribe();
+    do_metrics();
+    if (settings.subclients) sub_flush(); // Sends what this turn produced
   }
 }
 
@@ -486,7 +591,7 @@ void do_cat(input_t *input) {
     return;
   }
 
-  if (input->subtype & TYPE_NAMEVALPOS) input->update = now;  // type NAMEVALPOS doesn't set the parent update-time
+  if ((input->subtype & TYPE_NAMEVALPOS) || input->histogram) input->update = now;  // type NAMEVALPOS and histograms don't set the parent update-time
 
   while (!done && fgets(mainbuf, MAIN_BUF_SIZE, fp)) done = parse_line(input, mainbuf);
   if (input->skip) {
@@ -498,6 +603,7 @@ void do_cat(input_t *input) {
   }
 
   if (input->subtype & TYPE_COUNT) process(input, input->count);
+  else if (input->subtype & TYPE_DISTINCT) report_distinct(input);
   else if (input->subtype & TYPE_NAMECOUNT) {
     process(input, input->count);
     for (sub = input->next; sub && sub->parent; sub = sub->next) {
@@ -508,6 +614,7 @@ void do_cat(input_t *input) {
   }
 
   if (input->consol && !(input->consol & CONSOL_FIRST)) report_consol(input);
+  if (input->histogram) report_histograms(input);
 
   if (input->line && feof(fp)) {
     error_log("Not enough lines in file %s (line %d requested, only %d found)\n", input->cat->filename, input->line, input->count);
@@ -587,6 +694,7 @@ void do_tail(input_t *input) {
   }
 
   if (input->subtype & TYPE_COUNT) process(input, input->count);
+  else if (input->subtype & TYPE_DISTINCT) report_distinct(input);
   else if (input->subtype & TYPE_NAMECOUNT) {
     process(input, input->count);
     for (input = input->next; input && input->parent; input = input->next) process(input, input->count);
@@ -624,6 +732,14 @@ void do_tail_fp(input_t *input, FILE *fp, int use_buffer) {
 }
 
 void do_namepos(input_t *input, char *name, char *value) {
+  input_t *child;
+
+  if (!(child = get_child(input, name))) return;
+  if (value) parse_value(child, value); // subtype is TYPE_NAMEVALPOS
+  else child->count++;  // subtype is TYPE_NAMECOUNT
+}
+
+input_t *get_child(input_t *input, char *name) {
   int r;
   input_t *child, *newchild;
 
@@ -634,18 +750,21 @@ void do_namepos(input_t *input, char *name, char *value) {
     newchild = (input_t *)malloc(sizeof(input_t));
     if (!newchild) {
       error_log("Failed to allocate memory for new child %s found on input %s\n", name, input->name);
-      return;
+      return NULL;
     }
     memset(newchild, 0, sizeof(input_t));
     set(&newchild->name, name);
     newchild->next = child->next;
     child->next = newchild;
     newchild->parent = input;
-    newchild->vallast = newchild->valhist+VALUE_HIST_SIZE-1;
+    newchild->histsize = input->histsize;
+    newchild->window = input->window;
     if (input->delta) newchild->delta = input->delta;
     if (input->consol) newchild->consol = input->consol;
+    if (input->quantile) newchild->quantile = input->quantile;
     if (input->rate) newchild->rate = input->rate;
     if (input->alert_after) newchild->alert_after = input->alert_after;
+    if (input->histogram) newchild->histogram = input->histogram;
     if (input->scale_min) {
       newchild->scale_min = (float *)malloc(sizeof(float));
       *newchild->scale_min = *input->scale_min;
@@ -675,41 +794,74 @@ void do_namepos(input_t *input, char *name, char *value) {
       *newchild->crit_below = *input->crit_below;
     }
 
-    if (settings.sqlitehandle) {
-      int c;
-      char *err, query[100];
-      sqlite3_stmt *stmt;
+    if (settings.verbose) printf("Input %s: created new child %s\n", input->name, child->next->name);
+  }
+  return child->next;
+}
 
-      if (newchild->parent) c = sprintf(query, "SELECT `id` FROM `inputs` WHERE `name` = '%s' AND `sub` = '%s'", newchild->parent->name, newchild->name);
-      else c = sprintf(query, "SELECT `id` FROM `inputs` WHERE `name` = '%s' AND `sub` IS NULL", newchild->name);
-      sqlite3_prepare_v2(settings.sqlitehandle, query, -1, &stmt, NULL);
-      if (stmt && (sqlite3_step(stmt) == SQLITE_ROW)) newchild->sqlid = sqlite3_column_int(stmt, 0);
-      else {
-        sqlite3_finalize(stmt);
+// Looks up or adds the id of an input; only called from the writer thread (or before it starts),
+// so the main thread never waits on the database. New children are queued with id 0 until then.
+// The main thread reads input->sqlid when it queues samples, so it is only accessed atomically.
+int register_input(input_t *input) {
+  static sqlite3_stmt *select = NULL, *insert = NULL;
+  sqlite3_stmt *stmt;
+  int r, id = __atomic_load_n(&input->sqlid, __ATOMIC_RELAXED);
+
+  if (id) return id; // Registered through an earlier queued sample
+  if (settings.tsdbdir) {
+    if (input->parent) id = tsdb_lookup(input->parent->name, input->name);
+    else id = tsdb_lookup(input->name, NULL);
+    if (settings.verbose && (id > 0)) printf("Input %s has tsdb series id %d\n", input->name, id);
+    __atomic_store_n(&input->sqlid, id, __ATOMIC_RELAXED);
+    return id;
+  }
+  if (!select) sqlite3_prepare_v2(settings.sqlitehandle, "SELECT `id` FROM `inputs` WHERE `name` = ?001 AND `sub` IS ?002", -1, &select, NULL);
+  if (!insert) sqlite3_prepare_v2(settings.sqlitehandle, "INSERT INTO `inputs` (`name`, `sub`) VALUES (?001, ?002) RETURNING `id`", -1, &insert, NULL);
+  if (!select || !insert) {
+    error_log("Failed to prepare query for input registration: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+    __atomic_store_n(&input->sqlid, -1, __ATOMIC_RELAXED); // Don't retry on every sample
+    return -1;
+  }
 
-        if (newchild->parent) sprintf(query, "INSERT INTO `inputs` (`name`, `sub`) VALUES ('%s', '%s')", newchild->parent->name, newchild->name);
-        else sprintf(query, "INSERT INTO `inputs` (`name`) VALUES ('%s')", newchild->name);
-        if (sqlite3_exec(settings.sqlitehandle, query, NULL, NULL, &err) != SQLITE_OK) {
-          error_log("Sqlite error: %s\n", err);
-          sqlite3_free(err);
-        }
-        else {
-          newchild->sqlid = sqlite3_last_insert_rowid(settings.sqlitehandle);
-          if (settings.verbose) printf("Added new input %s to SQLite db with id %d\n", newchild->name, newchild->sqlid);
-        }
-      }
+  for (stmt = select; stmt; stmt = (stmt == select?insert:NULL)) {
+    if ((sqlite3_bind_text(stmt, 1, input->parent?input->parent->name:input->name, -1, SQLITE_STATIC) != SQLITE_OK)
+     || (sqlite3_bind_text(stmt, 2, input->parent?input->name:NULL, -1, SQLITE_STATIC) != SQLITE_OK)) {
+      error_log("Failed to bind params on input registration query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      id = -1;
+      break;
     }
-    if (settings.verbose) printf("Input %s: created new child %s\n", input->name, child->next->name);
+    while ((r = sqlite3_step(stmt)) == SQLITE_BUSY) sleep(1);
+    if (r == SQLITE_ROW) id = sqlite3_column_int(stmt, 0);
+    else if (r != SQLITE_DONE) {
+      error_log("Error while registering input %s in Sqlite database: %s\n", input->name, sqlite3_errmsg(settings.sqlitehandle));
+      id = -1;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (id) break;
   }
-  if (value) parse_value(child->next, value); // subtype is TYPE_NAMEVALPOS
-  else child->next->count++;  // subtype is TYPE_NAMECOUNT
+  if (settings.verbose && (id > 0) && (stmt == insert)) printf("Added new input %s to SQLite db with id %d\n", input->name, id);
+  __atomic_store_n(&input->sqlid, id, __ATOMIC_RELAXED);
+  return id;
 }
 
 void do_pipe(input_t *input) {
+  input_t *sub;
+
   if (input->subtype & TYPE_COUNT) process(input, input->count);
+  else if (input->subtype & TYPE_DISTINCT) report_distinct(input);
   else if (input->subtype & TYPE_NAMECOUNT) {
     process(input, input->count);
-    for (input = input->next; input && input->parent; input = input->next) process(input, input->count);
+    for (sub = input->next; sub && sub->parent; sub = sub->next) {
+      process(sub, sub->count);
+      sub->count = 0;
+    }
+  }
+  else if (input->subtype & TYPE_AGGREGATE) { // Values go to the children as they arrive; merged sketches once per interval
+    input->update = now;
+    for (sub = input->next; sub && sub->parent; sub = sub->next) {
+      if (sub->hll) report_distinct(sub);
+    }
   }
   input->count = 0;
 }
@@ -750,7 +902,7 @@ int parse_line(input_t *input, char *line) {
     }
     parse_value(input, tok);
   }
-  else if (input->subtype & (TYPE_NAMECOUNT|TYPE_NAMEVALPOS)) {
+  else if (input->subtype & (TYPE_NAMECOUNT|TYPE_NAMEVALPOS|TYPE_DISTINCT)) {
     char *name = NULL;
 
     if (input->pcre) {
@@ -789,7 +941,11 @@ int parse_line(input_t *input, char *line) {
       }
       else tok = NULL;
     }
-    do_namepos(input, name, tok);
+    if (input->subtype & TYPE_DISTINCT) {
+      if (!input->hll && !(input->hll = (hll *)calloc(1, sizeof(hll)))) error_log("Failed to allocate memory for distinct counter on input %s\n", input->name);
+      else hll_add(input->hll, name);
+    }
+    else do_namepos(input, name, tok);
     free(name);
   }
   if (input->line) return 1;
@@ -798,7 +954,7 @@ int parse_line(input_t *input, char *line) {
 
 void parse_value(input_t *input, char *buf) {
   char *comment;
-  float fl;
+  double fl;
 
   fl = strtod(buf, &comment);
 
@@ -806,11 +962,18 @@ void parse_value(input_t *input, char *buf) {
     if (errno == ERANGE) error_log("[%s] Input conversion result for out of range for storage data type: [%s]\n", input->name, buf);
     else error_log("[%s] No valid data found on input: [%s]\n", input->name, buf);
   }
+  else if (input->histogram) {
+    if (!input->histcnt && !(input->histcnt = (unsigned int *)calloc(input->histogram->nbounds+1, sizeof(unsigned int)))) {
+      error_log("Failed to allocate memory for histogram on input %s\n", input->name);
+      return;
+    }
+    input->histcnt[histogram_bucket(input->histogram, fl)]++;
+  }
   else if (input->consol) consolidate(input, fl);
   else process(input, fl);
 }
 
-void consolidate(input_t *input, float fl) {
+void consolidate(input_t *input, double fl) {
   input->consolcnt++;
 
   if ((input->consol & CONSOL_FIRST) && (input->consolcnt == 1)) {
@@ -827,15 +990,24 @@ void consolidate(input_t *input, float fl) {
     else if (input->consolsum < fl) input->consolsum = fl;
   }
   else if (input->consol & (CONSOL_SUM|CONSOL_AVG)) input->consolsum += fl;
+  else if (input->consol & CONSOL_QUANTILE) {
+    if (!input->dds && !(input->dds = (ddsketch *)calloc(1, sizeof(ddsketch)))) {
+      error_log("Failed to allocate memory for quantile sketch on input %s\n", input->name);
+      return;
+    }
+    dds_add(input->dds, fl);
+  }
 
 //  printf("Recording consol value %f for %s\n", fl, input->name);
 }
 
-void process(input_t *input, float fl) {
-  float tmpfl;
+void process(input_t *input, double fl) {
+  double tmpfl;
+  long long jpos;
+  int id;
   char msgbuf[100];
 
-  if ((input->update == now) && (*input->vallast == fl)) return;
+  if ((input->update == now) && (input->vallast == fl)) return;
 
   if (input->delta) {
     tmpfl = fl;
@@ -855,74 +1027,66 @@ void process(input_t *input, float fl) {
     }
   }
 
-  input->valsum += fl;
   input->valcnt++;
-  if (input->valcnt > 1) {
+  stats_add(&input->stats, input->window, fl);
+  if ((input->valcnt > 1) && (now > input->update)) {
     input->updlast = now-input->update;
-    input->updsum += input->updlast;
-    input->roclast = fabsf(fl-*input->vallast)/input->updlast;
-    input->rocsum += input->roclast;
-    input->amplast = fabsf(fl-input->valsum/input->valcnt);
-    input->ampsum += input->amplast;
-    if (fl < input->valmin) input->valmin = fl;
-    if (fl > input->valmax) input->valmax = fl;
-  }
-  else {
-    input->valmin = fl;
-    input->valmax = fl;
+    input->roclast = fabs(fl-input->vallast)/input->updlast;
+    input->amplast = fabs(fl-input->stats.mean);
+    if (input->updavg) {
+      input->updavg = stats_ewma(&input->stats, input->updavg, input->updlast);
+      input->rocavg = stats_ewma(&input->stats, input->rocavg, input->roclast);
+      input->ampavg = stats_ewma(&input->stats, input->ampavg, input->amplast);
+    }
+    else {
+      input->updavg = input->updlast;
+      input->rocavg = input->roclast;
+      input->ampavg = input->amplast;
+    }
   }
 
   input->update = now;
-  if (input->vallast-input->valhist == VALUE_HIST_SIZE-1) input->vallast = input->valhist;
-  else input->vallast++;
-  *input->vallast = fl;
+  input->lastts = epochms();
+  hist_add(input, fl);
 
   if (settings.logdir) write_log(input, fl);
-  if (settings.sqlitehandle && input->sqlid) {
-    struct update upd = { input->sqlid, now, fl };
-    if (write(settings.sqlitepipe[1], &upd, sizeof(struct update)) != sizeof(struct update)) error_log("Failed to write to Sqlite writer pipe: %s\n", strerror(errno));
+  jpos = journal_append(input, input->lastts, fl);
+  if ((settings.sqlitehandle || settings.tsdbdir) && ((id = __atomic_load_n(&input->sqlid, __ATOMIC_RELAXED)) >= 0)) { // New children are registered by the writer
+    struct update upd = { input, id, input->lastts, fl, jpos };
+    db_queue(&upd);
   }
-  if (settings.uplinkhost && settings.uplinkport) {
-    int c;
-    char buf[501] = "";
-    if (settings.uplinkprefix) {
-      strcat(buf, settings.uplinkprefix);
-      strcat(buf, ".");
-    }
-    if (input->parent) {
-      strcat(buf, input->parent->name);
-      strcat(buf, ".");
-    }
-    sprintf(buf+strlen(buf), "%s %f %d\n", input->name, fl, now);
-    c = strlen(buf);
-    if (write(settings.uplinkpipe[1], buf, c) != c) error_log("Failed to write to socket writer pipe: %s\n", strerror(errno));
+  if (settings.nuplinks) { // Formatted by the socket writer thread
+    struct uplink_rec rec = { input, input->lastts, fl, NULL, jpos };
+    uplink_queue(&rec, 1);
   }
+  if (settings.subclients) sub_emit(input, input->lastts, fl);
+  if (settings.metricsfd) metrics_update(input);
 
   display(input);
 
   if (input->alert_after) {
-    if (((input->crit_above && (*input->vallast > *input->crit_above)) || (input->crit_below && (*input->vallast < *input->crit_below))) && (++input->alert_hold >= input->alert_after)) {
+    if (((input->crit_above && (input->vallast > *input->crit_above)) || (input->crit_below && (input->vallast < *input->crit_below))) && (++input->alert_hold >= input->alert_after)) {
       if (!input->parent) {
-        if (input->alert_after > 1) snprintf(msgbuf, 100, "Critical on input %s after %d samples: %f\n", input->name, *input->vallast, input->alert_after);
-        else snprintf(msgbuf, 100, "Critical on input %s: %f\n", input->name, *input->vallast);
+        if (input->alert_after > 1) snprintf(msgbuf, 100, "Critical on input %s after %d samples: %f\n", input->name, input->vallast, input->alert_after);
+        else snprintf(msgbuf, 100, "Critical on input %s: %f\n", input->name, input->vallast);
       }
       else {
-        if (input->alert_after > 1) snprintf(msgbuf, 100, "Critical on input %s/%s after %d samples: %f\n", input->parent->name, input->name, *input->vallast, input->alert_after);
-        else snprintf(msgbuf, 100, "Critical on input %s/%s: %f\n", input->parent->name, input->name, *input->vallast);
+        if (input->alert_after > 1) snprintf(msgbuf, 100, "Critical on input %s/%s after %d samples: %f\n", input->parent->name, input->name, input->vallast, input->alert_after);
+        else snprintf(msgbuf, 100, "Critical on input %s/%s: %f\n", input->parent->name, input->name, input->vallast);
       }
       if (settings.alertrepeat && (input->alert_crit+settings.alertrepeat < now)) {
         send_alert(ALERT_CRIT, msgbuf);
         input->alert_crit = now;
       }
     }
-    else if (((input->warn_above && (*input->vallast > *input->warn_above)) || (input->warn_below && (*input->vallast < *input->warn_below))) && (++input->alert_hold >= input->alert_after)) {
+    else if (((input->warn_above && (input->vallast > *input->warn_above)) || (input->warn_below && (input->vallast < *input->warn_below))) && (++input->alert_hold >= input->alert_after)) {
       if (!input->parent) {
-        if (input->alert_after > 1) snprintf(msgbuf, 100, "Warning on input %s after %d samples: %f\n", input->name, *input->vallast, input->alert_after);
-        else snprintf(msgbuf, 100, "Warning on input %s: %f\n", input->name, *input->vallast);
+        if (input->alert_after > 1) snprintf(msgbuf, 100, "Warning on input %s after %d samples: %f\n", input->name, input->vallast, input->alert_after);
+        else snprintf(msgbuf, 100, "Warning on input %s: %f\n", input->name, input->vallast);
       }
       else {
-        if (input->alert_after > 1) snprintf(msgbuf, 100, "Warning on input %s/%s after %d samples: %f\n", input->parent->name, input->name, *input->vallast, input->alert_after);
-        else snprintf(msgbuf, 100, "Warning on input %s/%s: %f\n", input->parent->name, input->name, *input->vallast);
+        if (input->alert_after > 1) snprintf(msgbuf, 100, "Warning on input %s/%s after %d samples: %f\n", input->parent->name, input->name, input->vallast, input->alert_after);
+        else snprintf(msgbuf, 100, "Warning on input %s/%s: %f\n", input->parent->name, input->name, input->vallast);
       }
       if (settings.alertrepeat && (input->alert_warn+settings.alertrepeat < now)) {
         send_alert(ALERT_WARN, msgbuf);
@@ -933,80 +1097,494 @@ void process(input_t *input, float fl) {
   }
 }
 
-void *write_sock() {
-  int last, done, r, todo = 0;
-  char buf[1401] = "";
-
-  if (settings.verbose) printf("Started socket writer thread\n");
+// Event-driven socket writer, one thread per uplink: samples are formatted into a buffer that is sent
+// to the uplink as one frame once it holds uplinkflushbytes or its oldest sample has waited
+// uplinkflushms. The socket is non-blocking and polled together with the queue, so a slow or
+// unreachable uplink only makes the buffer (and then the queue) fill up. Failed connections are
+// retried after an exponentially growing delay with jitter, so many anystats that lost the same uplink
+// don't all reconnect at the same moment. With an outbox, samples that don't fit the buffer go to disk
+// instead, and so do all later ones until the outbox has been sent, to keep them in order. The outbox
+// is always in the text format; in binary mode the buffer holds encoded messages, which are
+// compressed when a frame is started.
+void *write_sock(void *arg) {
+  uplink_t *up = (uplink_t *)arg;
+  int len = 0, olen = 0, nrecs = 0, irec = 0, connecting = 0, outboxing = 0, outread = 0, frameout = 0;
+  int wlen = 0, wsent = 0, framelen = 0, greet = -1, backoff = 0, err = 0, ready, timeout, r;
+  long long now, first = 0, framefirst = 0, retry = 0, deadline, jpos = 0, framejpos = 0, ojpos = 0, stored = 0, laststats;
+  unsigned int seed = time(NULL)^getpid();
+  char buf[UPLINK_BUF_SIZE+1], obuf[UPLINK_BUF_SIZE+1], zbuf[2*UPLINK_BUF_SIZE], scratch[256], *wbuf = buf, *lost = NULL;
+  struct uplink_rec recs[UPLINK_READ_BATCH];
+  struct pollfd pfd = { -1, 0, 0 };
+
+  if (settings.verbose) printf("Started socket writer thread for uplink %s:%d\n", up->host, up->port);
   signal(SIGINT, SIG_DFL);
   signal(SIGTERM, SIG_DFL);
-  last = time(NULL);
+  laststats = mstime();
+  if (settings.outboxdir) outboxing = !outbox_empty();
 
   while (1) {
-    if ((r = read(settings.uplinkpipe[0], buf+todo, 1400-todo)) <= 0) break;
-    todo += r;
-    r = time(NULL);
-    if ((r-last < 60) && (todo < 1300)) continue;
-    last = r;
-    done = 0;
-    while (1) {
-      while (!settings.uplinksock) {
-        if (uplink_connect() == -1) sleep(60);
-      }
-      if ((r = write(settings.uplinksock, buf+done, todo-done)) <= 0) {
-        error_log("Write error to uplink socket: %s\n", strerror(errno));
-        close(settings.uplinksock);
-        settings.uplinksock = 0;
+    now = mstime();
+    if (connecting && pfd.revents) {
+      socklen_t errlen = sizeof(err);
+      if (getsockopt(up->sock, SOL_SOCKET, SO_ERROR, &err, &errlen)) err = errno;
+      if (err) lost = "connect failed";
+      else {
+        uplink_connected(up);
+        if (settings.uplinkbinary) greet = 0;
+      }
+      connecting = 0;
+    }
+    else if (up->sock && (pfd.revents & (POLLIN|POLLERR|POLLHUP))) { // Anything the uplink sends is ignored
+      if (!(r = read(up->sock, scratch, sizeof(scratch)))) {
+        lost = "closed the connection";
+        err = 0;
+      }
+      else if ((r == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        lost = "read failed";
+        err = errno;
+      }
+    }
+
+    while (1) { // Format queued samples while they fit
+      if (irec == nrecs) {
+        irec = 0;
+        if (!(nrecs = ring_pop(&up->ring, recs, UPLINK_READ_BATCH))) break;
+      }
+      if (outboxing) {
+        if (olen+uplink_len(&recs[irec]) > UPLINK_BUF_SIZE) {
+          if (!outbox_write(obuf, olen)) stored = ojpos;
+          olen = 0;
+        }
+        olen += uplink_format(&recs[irec], obuf+olen);
+        if (recs[irec].jpos) ojpos = recs[irec].jpos;
+      }
+      else {
+        if (len+(settings.uplinkbinary?proto_len(&recs[irec]):uplink_len(&recs[irec])) > UPLINK_BUF_SIZE) {
+          if (!settings.outboxdir) break; // Full; wait for the socket
+          outboxing = 1;
+          continue;
+        }
+        if (len == framelen) first = now;
+        len += settings.uplinkbinary?proto_encode(up, &recs[irec], buf+len):uplink_format(&recs[irec], buf+len);
+        if (recs[irec].jpos) jpos = recs[irec].jpos;
+      }
+      free(recs[irec].sketch);
+      irec++;
+    }
+    if (olen) { // Store the rest before waiting
+      if (!outbox_write(obuf, olen)) stored = ojpos;
+      olen = 0;
+      if (!len) uplink_ack(up, stored);
+    }
+
+    if (!up->sock && !lost && (now >= retry)) {
+      if ((r = uplink_connect(up)) == -1) {
+        lost = "connect failed";
+        err = errno;
+      }
+      else if (r) {
+        uplink_connected(up);
+        if (settings.uplinkbinary) greet = 0;
+      }
+      else connecting = 1;
+    }
+    ready = up->sock && !connecting && !lost;
+    if (ready && outboxing && !len && !wlen) { // Send the outbox in buffer sized parts, without waiting to flush
+      if (!settings.uplinkbinary) len = r = outbox_read(buf, UPLINK_BUF_SIZE);
+      else while (((r = (UPLINK_BUF_SIZE-len)/3) >= UPLINK_BUF_SIZE/16) && (r = outbox_read(obuf, r))) {
+        len += proto_encode_lines(obuf, r, buf+len);
+        outread = 1;
+      }
+      if (r || len) outread = 1;
+      else outboxing = 0; // All sent; samples go straight to the buffer again
+      first = now-settings.uplinkflushms;
+    }
+    if (ready && !wlen) { // Start a frame
+      if (greet != -1) {
+        wbuf = zbuf;
+        if ((wlen = proto_greeting(&greet, zbuf, sizeof(zbuf))) == -1) {
+          error_log("Failed to compress the uplink greeting\n");
+          wlen = 0;
+        }
+      }
+      else if (len && ((len >= settings.uplinkflushbytes) || (now-first >= settings.uplinkflushms))) {
+        if (!settings.uplinkbinary) wlen = len, wbuf = buf;
+        else if ((wlen = proto_frame(buf, len, wbuf = zbuf, sizeof(zbuf))) == -1) {
+          error_log("Failed to compress an uplink frame; dropped %d bytes of samples\n", len);
+          wlen = len = 0;
+        }
+        framelen = len;
+        framefirst = first;
+        framejpos = jpos;
+        frameout = outread;
+        outread = 0;
+      }
+      wsent = 0;
+    }
+    if (ready && (wsent < wlen)) {
+      if ((r = write(up->sock, wbuf+wsent, wlen-wsent)) > 0) {
+        wsent += r;
+        up->bytes += r;
+        backoff = 0;
+      }
+      else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        lost = "write failed";
+        err = errno;
+      }
+    }
+    if (lost) {
+      retry = now+uplink_fail(up, lost, err, &backoff, &seed);
+      if (settings.uplinkbinary) { // Encoded again after the greeting on the next connection
+        outread |= frameout;
+        wlen = wsent = framelen = frameout = 0;
+        greet = -1;
+      }
+      else while (wsent && (wbuf[wsent-1] != '\n')) wsent--; // Resend the line that was cut off in full
+      connecting = 0;
+      lost = NULL;
+    }
+    else if (wlen && (wsent == wlen)) {
+      if (settings.uplinktcp == UPLINK_TCP_CORK) { // Push out the last partial packet
+        r = 0;
+        setsockopt(up->sock, IPPROTO_TCP, TCP_CORK, &r, sizeof(r));
+        r = 1;
+        setsockopt(up->sock, IPPROTO_TCP, TCP_CORK, &r, sizeof(r));
+      }
+      if (framelen) {
+        memmove(buf, buf+framelen, len-framelen);
+        len -= framelen;
+        if (settings.uplinkbinary) proto_sent();
+        up->flushes++;
+        up->flushlat += now-framefirst;
+        if (now-framefirst > up->flushmax) up->flushmax = now-framefirst;
+        if (frameout) outbox_commit();
+        uplink_ack(up, framejpos);
+        if (!len) uplink_ack(up, stored);
+      }
+      wlen = wsent = framelen = frameout = 0;
+    }
+    if (settings.verbose && (now-laststats >= UPLINK_STATS_INTERVAL*1000)) {
+      uplink_stats(up, len);
+      laststats = now;
+    }
+
+    deadline = 0;
+    pfd.fd = up->sock?up->sock:-1;
+    pfd.events = 0;
+    if (up->sock) {
+      pfd.events = POLLIN; // Only to notice the uplink closing the connection
+      if (connecting || (wsent < wlen)) pfd.events |= POLLOUT;
+      else if (len) deadline = first+settings.uplinkflushms;
+      else if (outboxing) deadline = now; // Next part of the outbox
+    }
+    else deadline = retry;
+    if (settings.verbose && (!deadline || (laststats+UPLINK_STATS_INTERVAL*1000 < deadline))) deadline = laststats+UPLINK_STATS_INTERVAL*1000;
+    timeout = deadline?(deadline>now?deadline-now:0):-1;
+    if (irec < nrecs) { // No room for more samples
+      if (poll(&pfd, 1, timeout) <= 0) pfd.revents = 0;
+    }
+    else ring_poll(&up->ring, &pfd, 1, timeout);
+  }
+}
+
+// Closes the uplink socket and returns the msecs to wait before reconnecting; until then, the uplink
+// is marked down so new samples go to the next one
+int uplink_fail(uplink_t *up, const char *reason, int err, int *backoff, unsigned int *seed) {
+  int delay;
+
+  if (up->sock) {
+    close(up->sock);
+    up->sock = 0;
+  }
+  __atomic_store_n(&up->down, 1, __ATOMIC_RELAXED);
+  if (!*backoff) *backoff = UPLINK_BACKOFF_MIN;
+  else if ((*backoff *= 2) > UPLINK_BACKOFF_MAX) *backoff = UPLINK_BACKOFF_MAX;
+  delay = *backoff/2+rand_r(seed)%(*backoff/2+1);
+  if (*backoff == UPLINK_BACKOFF_MIN) error_log("Uplink %s:%d %s%s%s; retrying in %d ms\n", up->host, up->port,
+    reason, err?": ":"", err?strerror(err):"", delay);
+  else if (settings.verbose) printf("Uplink %s:%d %s%s%s; retrying in %d ms\n", up->host, up->port,
+    reason, err?": ":"", err?strerror(err):"", delay);
+  return delay;
+}
+
+void uplink_connected(uplink_t *up) {
+  int one = 1;
+
+  if (settings.uplinktcp == UPLINK_TCP_NODELAY) setsockopt(up->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  else if (settings.uplinktcp == UPLINK_TCP_CORK) setsockopt(up->sock, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+  up->connects++;
+  __atomic_store_n(&up->down, 0, __ATOMIC_RELAXED);
+  if (settings.verbose) printf("Connected to uplink %s:%d\n", up->host, up->port);
+  if (settings.uplinkseq && !settings.uplinkbinary) { // Tells the aggregator whose sequence numbers follow; fits any fresh socket buffer
+    char buf[HOST_NAME_MAX+20] = "@anystat ";
+    if (settings.uplinkprefix) strncat(buf, settings.uplinkprefix, HOST_NAME_MAX);
+    else if (gethostname(buf+9, HOST_NAME_MAX)) strcat(buf, "anystat");
+    strcat(buf, "\n");
+    if (write(up->sock, buf, strlen(buf)) != strlen(buf)) error_log("Failed to identify to uplink: %s\n", strerror(errno));
+  }
+}
+
+void uplink_stats(uplink_t *up, int buffered) {
+  int unsent = 0;
+
+  if (up->sock && ioctl(up->sock, TIOCOUTQ, &unsent)) unsent = 0;
+  printf("Uplink %s:%d queue: %llu samples queued, %d bytes buffered, %d bytes unsent in socket; %lu flushes (avg %.1f ms, max %.0f ms latency), %llu bytes sent, %lu connects, %lu waits for room\n",
+    up->host, up->port, up->ring.head-up->ring.tail, buffered, unsent, up->flushes,
+    up->flushes?up->flushlat/up->flushes:0, up->flushmax, up->bytes, up->connects, up->ring.full);
+  if (settings.nuplinks > 1) printf("Uplinks: %llu samples failed over to another uplink\n", settings.uplinkfailovers);
+  if (settings.outboxdir) printf("Uplink outbox: %lld bytes in files, %llu bytes spilled, %llu bytes dropped\n",
+    settings.outboxsize, settings.outboxspilled, settings.outboxdropped);
+}
+
+// Picks the uplink for a series by rendezvous hashing: each uplink scores the series name, and the
+// highest score wins. Adding or removing an uplink only moves the series that it wins or won, and
+// when the winner is down, the series goes to the uplink with the next highest score, so the samples
+// of a lost uplink spread evenly over the rest instead of all landing on one.
+uplink_t *uplink_route(input_t *input) {
+  uplink_t *up, *own, *best = NULL;
+  unsigned long long h, score, max = 0, bestmax = 0;
+  int i;
+
+  if (settings.nuplinks == 1) return &settings.uplinks[0];
+  if (input->uplinkshard && !__atomic_load_n(&settings.uplinks[input->uplinkshard-1].down, __ATOMIC_RELAXED)) return &settings.uplinks[input->uplinkshard-1];
+  h = hash_str(uplink_key(input)); // Built here, before any socket writer reads it
+  for (own = NULL, i = 0; i < settings.nuplinks; i++) {
+    up = &settings.uplinks[i];
+    score = hash_mix(h^up->seed);
+    if (!own || (score > max)) {
+      own = up;
+      max = score;
+    }
+    if (!__atomic_load_n(&up->down, __ATOMIC_RELAXED) && (!best || (score > bestmax))) {
+      best = up;
+      bestmax = score;
+    }
+  }
+  if (!input->uplinkshard) input->uplinkshard = own->id+1;
+  own = &settings.uplinks[input->uplinkshard-1];
+  if ((best == own) || !best) return own; // If all are down, it waits for its own
+  settings.uplinkfailovers++;
+  return best;
+}
+
+// Queues a sample for the uplink of its series; returns -1 if that queue is full and wait isn't set
+int uplink_queue(struct uplink_rec *rec, int wait) {
+  uplink_t *up = uplink_route(rec->input);
+
+  if (rec->jpos) __atomic_store_n(&up->queued, rec->jpos, __ATOMIC_RELEASE); // Before the writer can see the sample
+  if (!wait) return ring_push(&up->ring, rec);
+  ring_put(&up->ring, rec);
+  return 0;
+}
+
+// Called by a socket writer with the journal position of the last sample it wrote. The journal's
+// uplink cursor can only move up to where every uplink has written all samples it was given: the
+// oldest position acknowledged by an uplink that still holds samples, or if none do, the newest.
+void uplink_ack(uplink_t *up, long long pos) {
+  long long acked, queued, oldest = -1, newest = 0;
+  int i;
+
+  if (!pos) return;
+  if (pos > up->acked) __atomic_store_n(&up->acked, pos, __ATOMIC_RELEASE);
+  for (i = 0; i < settings.nuplinks; i++) {
+    queued = __atomic_load_n(&settings.uplinks[i].queued, __ATOMIC_ACQUIRE);
+    acked = __atomic_load_n(&settings.uplinks[i].acked, __ATOMIC_ACQUIRE);
+    if (acked < queued) {
+      if ((oldest == -1) || (acked < oldest)) oldest = acked;
+    }
+    else if (acked > newest) newest = acked;
+  }
+  journal_ack(JOURNAL_UPLINK, oldest == -1?newest:oldest);
+}
+
+int uplink_len(struct uplink_rec *rec) { // Upper bound of the formatted length
+  int len = 70+strlen(uplink_key(rec->input));
+
+  if (rec->sketch) len += strlen(rec->sketch);
+  if (settings.uplinkseq) len += 21;
+  return len;
+}
+
+int uplink_format(struct uplink_rec *rec, char *buf) {
+  char *key = uplink_key(rec->input);
+  int len = strlen(key);
+
+  memcpy(buf, key, len);
+  if (rec->sketch) len += sprintf(buf+len, " hll:%s %lld.%03lld", rec->sketch, rec->ts/1000, rec->ts%1000);
+  else len += sprintf(buf+len, " %.16g %lld.%03lld", rec->val, rec->ts/1000, rec->ts%1000);
+  if (settings.uplinkseq) len += sprintf(buf+len, " %llu", outbox_seq()); // Fourth field, after the timestamp
+  buf[len++] = '\n';
+  return len;
+}
+
+char *uplink_key(input_t *input) { // Full series name, built once per input
+  char *prefix = settings.uplinkprefix, *parent = input->parent?input->parent->name:NULL;
+
+  if (input->uplinkkey) return input->uplinkkey;
+  if (!(input->uplinkkey = (char *)malloc((prefix?strlen(prefix)+1:0)+(parent?strlen(parent)+1:0)+strlen(input->name)+1))) return input->name;
+  sprintf(input->uplinkkey, "%s%s%s%s%s", prefix?prefix:"", prefix?".":"", parent?parent:"", parent?".":"", input->name);
+  return input->uplinkkey;
+}
+
+// Prunes in steps that are short enough to share a commit with regular inserts: first at most
+// DB_PRUNE_BATCH raw rows older than cutoff per call, then likewise rollup buckets that ended before
+// cutoff, and finally up to DB_VACUUM_PAGES free pages are returned to the filesystem per call.
+// Returns the step to continue with on the next call, or 0 when done.
+int prune_db(int step, long long cutoff) {
+  static int pruned = 0;
+  static sqlite3_stmt *stmt[2] = { NULL, NULL };
+  static char *query[2] = {
+    "DELETE FROM `data` WHERE `id` IN (SELECT `id` FROM `data` WHERE `ts` < ?001 LIMIT ?002) RETURNING 1",
+    "DELETE FROM `rollup` WHERE (`input`, `span`, `ts`) IN (SELECT `input`, `span`, `ts` FROM `rollup` WHERE `ts` < ?001 AND `ts`+`span`*1000 <= ?001 LIMIT ?002) RETURNING 1"
+  };
+  char pragma[50];
+  int r, n;
+
+  if (step <= 2) {
+    if (!stmt[step-1]) {
+      sqlite3_prepare_v2(settings.sqlitehandle, query[step-1], -1, &stmt[step-1], NULL);
+      if (!stmt[step-1]) {
+        error_log("Failed to prepare query for data prune: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+        return 0;
+      }
+    }
+    if (sqlite3_bind_int64(stmt[step-1], 1, cutoff) != SQLITE_OK) {
+      error_log("Failed to bind param 1 on data prune query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return 0;
+    }
+    if (sqlite3_bind_int(stmt[step-1], 2, DB_PRUNE_BATCH) != SQLITE_OK) {
+      error_log("Failed to bind param 2 on data prune query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return 0;
+    }
+    // Rows are counted through RETURNING, as sqlite3_changes() could reflect an insert from the main thread
+    for (n = 0; (r = sqlite3_step(stmt[step-1])) != SQLITE_DONE; ) {
+      if (r == SQLITE_ROW) n++;
+      else if (r == SQLITE_BUSY) {
+        error_log("Database is locked; delaying data prune\n");
         sleep(1);
       }
-      else done += r;
-      if (done == todo) break;
+      else {
+        error_log("Error during data prune on sqlite database: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+        sqlite3_reset(stmt[step-1]);
+        return 0;
+      }
     }
-    todo = 0;
+    sqlite3_reset(stmt[step-1]);
+    pruned += n;
+    if (n == DB_PRUNE_BATCH) return step;
+    if (settings.verbose) printf("Pruned %d %s older than %s from sqlite db\n", pruned, step==1?"rows":"rollup buckets", itodur(settings.sqliteprune));
+    pruned = 0;
+    return step+1;
+  }
+  if (!db_int("PRAGMA freelist_count", 0)) return 0;
+  sprintf(pragma, "PRAGMA incremental_vacuum(%d)", DB_VACUUM_PAGES);
+  if (db_exec(pragma)) return 0;
+  return step;
+}
+
+// Rollups keep count, sum, min and max per bucket of each span in rollups[]. The writer accumulates
+// the current bucket of every input in memory and adds it to the table with an upsert when the
+// bucket changes or the transaction is committed, so there are far fewer writes than raw rows.
+int rollup_add(struct update *upd) {
+  static int size = 0;
+  struct rollup *acc;
+  long long ts;
+  int i, n;
+
+  if (upd->id >= size) {
+    n = upd->id+64;
+    if (!(acc = (struct rollup *)realloc(rollupacc, n*ROLLUPS*sizeof(struct rollup)))) {
+      error_log("Failed to allocate rollup accumulators for %d inputs\n", n);
+      return -1;
+    }
+    memset(acc+size*ROLLUPS, 0, (n-size)*ROLLUPS*sizeof(struct rollup));
+    rollupacc = acc;
+    rollupids = size = n;
+  }
+  for (i = 0; i < ROLLUPS; i++) {
+    acc = &rollupacc[upd->id*ROLLUPS+i];
+    ts = upd->ts-upd->ts%(rollups[i]*1000LL);
+    if (acc->cnt && (acc->ts != ts) && rollup_write(upd->id, i)) return -1;
+    if (!acc->cnt) {
+      acc->ts = ts;
+      acc->min = acc->max = upd->val;
+    }
+    else if (upd->val < acc->min) acc->min = upd->val;
+    else if (upd->val > acc->max) acc->max = upd->val;
+    acc->sum += upd->val;
+    acc->cnt++;
   }
-  error_log("Failed to read from uplink pipe: %s\n", strerror(errno));
+  return 0;
 }
 
-void prune_db() {
+int rollup_flush() {
+  int id, i;
+
+  for (id = 0; id < rollupids; id++) {
+    for (i = 0; i < ROLLUPS; i++) {
+      if (rollupacc[id*ROLLUPS+i].cnt && rollup_write(id, i)) return -1;
+    }
+  }
+  return 0;
+}
+
+int rollup_write(int id, int span) {
+  static sqlite3_stmt *stmt = NULL;
+  struct rollup *acc = &rollupacc[id*ROLLUPS+span];
   int r;
-  char *err;
-  sqlite3_stmt *stmt;
 
-  sqlite3_prepare_v2(settings.sqlitehandle, "DELETE FROM data WHERE ts < ?", -1, &stmt, NULL);
   if (!stmt) {
-    error_log("Failed to prepare query for data prune: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-    return;
+    sqlite3_prepare_v2(settings.sqlitehandle, "INSERT INTO `rollup` VALUES (?001, ?002, ?003, ?004, ?005, ?006, ?007) ON CONFLICT DO UPDATE SET "
+      "`cnt` = `cnt`+excluded.`cnt`, `sum` = `sum`+excluded.`sum`, `min` = MIN(`min`, excluded.`min`), `max` = MAX(`max`, excluded.`max`)", -1, &stmt, NULL);
+    if (!stmt) {
+      error_log("Failed to prepare query for rollup upsert: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return -1;
+    }
   }
-  if (sqlite3_bind_int(stmt, 1, time(NULL)-settings.sqliteprune) != SQLITE_OK) {
-    error_log("Failed to bind param 1 on data prune query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-    return;
+  if ((sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) || (sqlite3_bind_int(stmt, 2, rollups[span]) != SQLITE_OK)
+   || (sqlite3_bind_int64(stmt, 3, acc->ts) != SQLITE_OK) || (sqlite3_bind_int(stmt, 4, acc->cnt) != SQLITE_OK)
+   || (sqlite3_bind_double(stmt, 5, acc->sum) != SQLITE_OK) || (sqlite3_bind_double(stmt, 6, acc->min) != SQLITE_OK)
+   || (sqlite3_bind_double(stmt, 7, acc->max) != SQLITE_OK)) {
+    error_log("Failed to bind params on rollup upsert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+    return -1;
   }
   while ((r = sqlite3_step(stmt)) == SQLITE_BUSY) {
-    error_log("Database is locked; delaying data prune\n");
+    error_log("Database is locked; delaying rollup for %d\n", id);
     sleep(1);
   }
-  if (r != SQLITE_DONE) {
-    error_log("Error during data prune on sqlite database: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-    return;
-  }
   sqlite3_reset(stmt);
-  if (settings.verbose) printf("Pruned %d rows older than %s from sqlite db\n", sqlite3_changes(settings.sqlitehandle), itodur(settings.sqliteprune));
-  if (sqlite3_exec(settings.sqlitehandle, "VACUUM", NULL, NULL, &err) != SQLITE_OK) {
-    error_log("Failed to VACUUM sqlite database after pruning: %s\n", err);
-    sqlite3_free(err);
+  if (r != SQLITE_DONE) {
+    error_log("Error while writing rollup to Sqlite database: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+    return -1;
   }
+  acc->cnt = 0;
+  acc->sum = 0;
+  return 0;
+}
+
+// Ends the current transaction, taking one prune step along with it if a prune round is running
+int db_commit(int rows, int *pruning, long long cutoff, long long jpos) {
+  long long start;
+
+  if (rollup_flush()) return -1;
+  if (*pruning) *pruning = prune_db(*pruning, cutoff);
+  start = mstime();
+  if (db_exec("COMMIT")) return -1;
+  journal_ack(JOURNAL_DB, jpos);
+  if (rows) db_commit_stats(rows, start);
+  return 0;
 }
 
 void *write_db() {
-  int r, lastprune;
-  char *err, query[100];
-  struct update upd;
+  int r, n, pending = 0, pruning = 0, lastprune;
+  long long deadline = 0, cutoff = 0, jpos = 0;
+  struct update buf[DB_READ_BATCH], *upd;
   sqlite3_stmt *stmt;
 
   if (settings.verbose) printf("Started sqlite writer thread\n");
   signal(SIGINT, SIG_DFL);
   signal(SIGTERM, SIG_DFL);
-  lastprune = time(NULL);
+  lastprune = 0; // First round right after startup
 
   sqlite3_prepare_v2(settings.sqlitehandle, "INSERT INTO `data` (`input`, `ts`, `value`) VALUES (?001, ?002, ?003)", -1, &stmt, NULL);
   if (!stmt) {
@@ -1014,59 +1592,399 @@ void *write_db() {
     return NULL;
   }
 
-  while (read(settings.sqlitepipe[0], &upd, sizeof(struct update)) == sizeof(struct update)) {
-    if (sqlite3_bind_int(stmt, 1, upd.id) != SQLITE_OK) {
-      error_log("Failed to bind param 1 on update insert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-      return NULL;
+  // Updates are grouped into one transaction until either sqlitebatch rows have been written
+  // or sqlitecommit msecs have passed since the first one, instead of one commit (and fsync) per row.
+  // Pruning is done in small steps, one with every commit and in their own transactions when idle.
+  while (1) {
+    if (!pruning && settings.sqliteprune && (time(NULL)-lastprune >= DB_PRUNE_INTERVAL)) {
+      lastprune = time(NULL);
+      cutoff = (lastprune-settings.sqliteprune)*1000LL;
+      pruning = 1;
     }
-    if (sqlite3_bind_int(stmt, 2, upd.ts) != SQLITE_OK) {
-      error_log("Failed to bind param 2 on update insert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-      return NULL;
+    if (ring_wait(&settings.dbring, settings.spooling?0:pending?(int)(deadline>mstime()?deadline-mstime():0):(pruning?0:-1)) || settings.spooling) {
+      if (!(n = ring_pop(&settings.dbring, buf, DB_READ_BATCH))) n = db_unspool(buf, DB_READ_BATCH); // Queued updates are older
+      for (upd = buf; upd < buf+n; upd++) {
+        if (upd->jpos) jpos = upd->jpos;
+        if (!upd->id && ((upd->id = register_input(upd->input)) < 0)) continue;
+        if (!pending) {
+          if (db_exec("BEGIN")) return NULL;
+          deadline = mstime()+settings.sqlitecommit;
+        }
+        if (sqlite3_bind_int(stmt, 1, upd->id) != SQLITE_OK) {
+          error_log("Failed to bind param 1 on update insert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+          return NULL;
+        }
+        if (sqlite3_bind_int64(stmt, 2, upd->ts) != SQLITE_OK) {
+          error_log("Failed to bind param 2 on update insert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+          return NULL;
+        }
+        if (sqlite3_bind_double(stmt, 3, upd->val) != SQLITE_OK) {
+          error_log("Failed to bind param 3 on update insert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+          return NULL;
+        }
+        while ((r = sqlite3_step(stmt)) == SQLITE_BUSY) {
+          error_log("Database is locked; delaying update %lld for %d\n", upd->ts, upd->id);
+          sleep(1);
+        }
+        if (r != SQLITE_DONE) {
+          error_log("Error while writing update to Sqlite database: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+          return NULL;
+        }
+        sqlite3_reset(stmt);
+        if (rollup_add(upd)) return NULL;
+        if (++pending < settings.sqlitebatch) continue;
+        if (db_commit(pending, &pruning, cutoff, jpos)) return NULL;
+        pending = 0;
+      }
     }
-    if (sqlite3_bind_double(stmt, 3, upd.val) != SQLITE_OK) {
-      error_log("Failed to bind param 3 on update insert query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-      return NULL;
+    if (pending && (mstime() >= deadline)) {
+      if (db_commit(pending, &pruning, cutoff, jpos)) return NULL;
+      pending = 0;
     }
-    while ((r = sqlite3_step(stmt)) == SQLITE_BUSY) {
-      error_log("Database is locked; delaying update %d for %d\n", upd.ts, upd.id);
-      sleep(1);
+    else if (!pending && pruning) {
+      if (db_exec("BEGIN")) return NULL;
+      if (db_commit(0, &pruning, cutoff, 0)) return NULL;
     }
-    if (r != SQLITE_DONE) {
-      error_log("Error while writing update to Sqlite database: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-      return NULL;
+  }
+}
+
+void *write_tsdb() {
+  int n, pending = 0, lastprune = 0;
+  long long deadline = 0, start, jpos = 0;
+  struct update buf[DB_READ_BATCH], *upd;
+
+  if (settings.verbose) printf("Started tsdb writer thread\n");
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  // Samples are encoded in memory and the open chunks written out every sqlitecommit msecs,
+  // the same bound on data loss as for the sqlite transactions
+  while (1) {
+    if (ring_wait(&settings.dbring, settings.spooling?0:pending?(int)(deadline>mstime()?deadline-mstime():0):(settings.sqliteprune?DB_PRUNE_INTERVAL*1000:-1)) || settings.spooling) {
+      if (!(n = ring_pop(&settings.dbring, buf, DB_READ_BATCH))) n = db_unspool(buf, DB_READ_BATCH); // Queued updates are older
+      for (upd = buf; upd < buf+n; upd++) {
+        if (upd->jpos) jpos = upd->jpos;
+        if (!upd->id && ((upd->id = register_input(upd->input)) < 0)) continue;
+        if (!pending++) deadline = mstime()+settings.sqlitecommit;
+        tsdb_append(upd->id, upd->ts, upd->val);
+      }
     }
-    sqlite3_reset(stmt);
-    if (time(NULL)-lastprune > DB_PRUNE_INTERVAL) { // Every 6 hours
-      prune_db();
+    if (pending && (mstime() >= deadline)) {
+      start = mstime();
+      if (!tsdb_flush()) journal_ack(JOURNAL_DB, jpos);
+      if (settings.verbose) printf("Flushed %d samples to tsdb in %lld ms\n", pending, mstime()-start);
+      db_queue_stats();
+      pending = 0;
+    }
+    if (settings.sqliteprune && (time(NULL)-lastprune >= DB_PRUNE_INTERVAL)) {
       lastprune = time(NULL);
+      tsdb_prune_all((lastprune-settings.sqliteprune)*1000LL);
     }
   }
-  error_log("Sqlite writer failed to read from pipe: %s\n", strerror(errno));
 }
 
-int uplink_connect() {
-  int c;
-  int sock;
+int db_exec(char *query) {
+  int r;
+  char *err;
+
+  while ((r = sqlite3_exec(settings.sqlitehandle, query, NULL, NULL, &err)) == SQLITE_BUSY) {
+    sqlite3_free(err);
+    error_log("Database is locked; delaying %s\n", query);
+    sleep(1);
+  }
+  if (r != SQLITE_OK) {
+    error_log("Sqlite error during %s: %s\n", query, err);
+    sqlite3_free(err);
+    return -1;
+  }
+  return 0;
+}
+
+int db_int(char *query, int def) { // Returns the first column of the first row, or def if there is none
+  int r = def;
+  sqlite3_stmt *stmt;
+
+  sqlite3_prepare_v2(settings.sqlitehandle, query, -1, &stmt, NULL);
+  if (!stmt) return def;
+  if (sqlite3_step(stmt) == SQLITE_ROW) r = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return r;
+}
+
+// Creates the tables on a new database and migrates older ones, one schema version at a time. The steps
+// for versions 1 and 2 create the current layout of their tables, so a new database only takes those.
+int db_schema() {
+  char query[50], backfill[200];
+  char *datatable = "CREATE TABLE `data` (`id` integer PRIMARY KEY, `input` integer NOT NULL, `ts` integer NOT NULL, `value` real)";
+  int version = db_int("SELECT `version` FROM `schema`", 0);
+  int created = !version && !db_int("SELECT COUNT(*) FROM `sqlite_master` WHERE `type` = 'table' AND `name` = 'data'", 0);
+
+  // Incremental auto_vacuum lets pruning release free pages a few at a time instead of with a full
+  // VACUUM; switching an existing database over needs a one-time VACUUM, which can't be in a transaction
+  if (db_int("PRAGMA auto_vacuum", 0) != 2) {
+    if (db_exec("PRAGMA auto_vacuum=INCREMENTAL")) return -1;
+    if (db_int("SELECT COUNT(*) FROM `sqlite_master`", 0)) {
+      if (settings.verbose) printf("Running one-time VACUUM to enable incremental auto_vacuum on sqlite database\n");
+      if (db_exec("VACUUM")) return -1;
+    }
+  }
+
+  if (version == DB_SCHEMA_VERSION) return 0;
+  if (version > DB_SCHEMA_VERSION) {
+    error_log("Sqlite database has schema version %d, which is newer than this version of anystat supports (%d)\n", version, DB_SCHEMA_VERSION);
+    return -1;
+  }
+  if (db_exec("BEGIN")) return -1;
+  if (version < 1) {
+    // Every sample is a row of its own, also when an input has two with the same timestamp; the index on
+    // (input, ts) serves reading the latest values or a time range of one input, the one on ts pruning.
+    // The explicit id keeps the rowids stable across a VACUUM, as the monitor polls for new rows by id.
+    if (db_exec("CREATE TABLE IF NOT EXISTS `inputs` (`id` integer PRIMARY KEY AUTOINCREMENT, `name` text, `sub` text)")) return -1;
+    if (db_exec("CREATE INDEX IF NOT EXISTS `inputs_name` ON `inputs` (`name`, `sub`)")) return -1;
+    if (db_int("SELECT COUNT(*) FROM `sqlite_master` WHERE `type` = 'table' AND `name` = 'data'", 0)) {
+      if (settings.verbose) printf("Migrating sqlite data table to schema version 1\n");
+      if (db_exec("ALTER TABLE `data` RENAME TO `data_old`")) return -1;
+    }
+    if (db_exec(datatable)) return -1;
+    if (db_int("SELECT COUNT(*) FROM `sqlite_master` WHERE `type` = 'table' AND `name` = 'data_old'", 0)) {
+      if (db_exec("INSERT INTO `data` (`input`, `ts`, `value`) SELECT `input`, `ts`, `value` FROM `data_old` WHERE `input` IS NOT NULL AND `ts` IS NOT NULL ORDER BY rowid")) return -1;
+      if (db_exec("DROP TABLE `data_old`")) return -1;
+    }
+    if (db_exec("CREATE INDEX `data_input` ON `data` (`input`, `ts`)")) return -1;
+    if (db_exec("CREATE INDEX `data_ts` ON `data` (`ts`)")) return -1;
+    if (db_exec("CREATE TABLE `schema` (`version` integer NOT NULL)")) return -1;
+    if (db_exec("INSERT INTO `schema` VALUES (0)")) return -1;
+  }
+  if (version < 2) {
+    int i;
+
+    if (db_exec("CREATE TABLE `rollup` (`input` integer NOT NULL, `span` integer NOT NULL, `ts` integer NOT NULL, "
+                "`cnt` integer, `sum` real, `min` real, `max` real, PRIMARY KEY (`input`, `span`, `ts`)) WITHOUT ROWID")) return -1;
+    if (db_exec("CREATE INDEX `rollup_ts` ON `rollup` (`ts`)")) return -1;
+    for (i = 0; !created && (i < ROLLUPS); i++) { // Backfill from existing data
+      sprintf(backfill, "INSERT INTO `rollup` SELECT `input`, %d, `ts`-`ts`%%%d, COUNT(*), SUM(`value`), MIN(`value`), MAX(`value`) "
+                        "FROM `data` GROUP BY `input`, `ts`/%d", rollups[i], rollups[i], rollups[i]);
+      if (db_exec(backfill)) return -1;
+    }
+  }
+  if ((version < 4) && !created) { // Version 3 has timestamps in msec, version 4 a rowid table again instead of one clustered on (input, ts),
+    // which replaced samples with equal timestamps; the data is copied in its stored order rather than updated in place
+    if (version && settings.verbose) printf(version<3?"Migrating sqlite timestamps to milliseconds\n":"Migrating sqlite data table to one row per sample\n");
+    if (db_exec("ALTER TABLE `data` RENAME TO `data_old`")) return -1;
+    if (db_exec(datatable)) return -1;
+    sprintf(backfill, "INSERT INTO `data` (`input`, `ts`, `value`) SELECT `input`, `ts`*%d, `value` FROM `data_old`", version<3?1000:1);
+    if (db_exec(backfill)) return -1;
+    if (db_exec("DROP TABLE `data_old`")) return -1;
+    if (db_exec("CREATE INDEX `data_input` ON `data` (`input`, `ts`)")) return -1;
+    if (db_exec("CREATE INDEX `data_ts` ON `data` (`ts`)")) return -1;
+    if ((version < 3) && db_exec("UPDATE `rollup` SET `ts` = `ts`*1000")) return -1;
+  }
+  sprintf(query, "UPDATE `schema` SET `version` = %d", DB_SCHEMA_VERSION);
+  if (db_exec(query)) return -1;
+  if (db_exec("COMMIT")) return -1;
+  if (settings.verbose) {
+    if (created) printf("Created sqlite database schema version %d\n", DB_SCHEMA_VERSION);
+    else printf("Sqlite database schema upgraded from version %d to %d\n", version, DB_SCHEMA_VERSION);
+  }
+  return 0;
+}
+
+// Updates go to the writer through the in-memory queue. When the writer falls behind (a busy or
+// slow database) and the queue is full, the overflow policy decides: the default appends updates to
+// a spool file that the writer replays once it has emptied the queue, so the main thread never waits
+// on storage. Until the spool is drained, new updates are appended to it as well to keep them in order.
+int db_queue_init(void) {
+  if (ring_init(&settings.dbring, settings.dbqueuesize, sizeof(struct update))) {
+    perror("Error creating db writer queue: ");
+    return -1;
+  }
+  if (settings.dboverflow != OVERFLOW_SPILL) return 0;
+  if (!settings.spoolfile) {
+    settings.spoolfile = (char *)malloc(strlen(settings.tsdbdir?settings.tsdbdir:settings.sqlitefile)+7);
+    if (settings.tsdbdir) sprintf(settings.spoolfile, "%s/spool", settings.tsdbdir);
+    else sprintf(settings.spoolfile, "%s.spool", settings.sqlitefile);
+  }
+  // Spooled updates point to inputs in this process, so an old spool file is of no use
+  if ((settings.spoolfd = open(settings.spoolfile, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600)) == -1) {
+    error_log("Failed to open spool file '%s': %s\n", settings.spoolfile, strerror(errno));
+    return -1;
+  }
+  pthread_mutex_init(&settings.spoollock, NULL);
+  return 0;
+}
+
+void db_queue(struct update *upd) {
+  if (!settings.spooling && !ring_push(&settings.dbring, upd)) {
+    settings.dbqueued++;
+    return;
+  }
+  if (settings.dboverflow == OVERFLOW_BLOCK) {
+    ring_put(&settings.dbring, upd);
+    settings.dbqueued++;
+    return;
+  }
+  if (settings.dboverflow == OVERFLOW_DROP) {
+    settings.dbdropped++;
+    return;
+  }
+  pthread_mutex_lock(&settings.spoollock);
+  if (!settings.spooling && !ring_push(&settings.dbring, upd)) settings.dbqueued++; // Writer caught up meanwhile
+  else if (settings.spoolsize+(long long)sizeof(struct update) > settings.spoolmax) settings.dbdropped++;
+  else if (pwrite(settings.spoolfd, upd, sizeof(struct update), settings.spoolsize) != sizeof(struct update)) {
+    if (!settings.dbdropped++) error_log("Failed to write to spool file '%s': %s\n", settings.spoolfile, strerror(errno));
+  }
+  else {
+    if (!settings.spooling && settings.verbose) printf("Db writer queue is full; spilling updates to %s\n", settings.spoolfile);
+    settings.spoolsize += sizeof(struct update);
+    settings.spooling = 1;
+    settings.dbspilled++;
+  }
+  pthread_mutex_unlock(&settings.spoollock);
+  ring_wake(&settings.dbring);
+}
+
+int db_unspool(struct update *buf, int max) { // Called by the writer once the queue is empty
+  int r = 0;
+
+  pthread_mutex_lock(&settings.spoollock);
+  if (settings.spoolsize-settings.spoolpos < (long long)max*sizeof(struct update)) max = (settings.spoolsize-settings.spoolpos)/sizeof(struct update);
+  if (max && ((r = pread(settings.spoolfd, buf, max*sizeof(struct update), settings.spoolpos)) < 0)) {
+    error_log("Failed to read from spool file '%s': %s\n", settings.spoolfile, strerror(errno));
+    r = settings.spoolsize-settings.spoolpos; // Skip the rest rather than stall
+    settings.dbdropped += r/sizeof(struct update);
+    settings.spoolpos += r;
+    r = 0;
+  }
+  else settings.spoolpos += r-r%sizeof(struct update);
+  if (settings.spoolpos == settings.spoolsize) { // Drained; start over and go back to the queue
+    if (ftruncate(settings.spoolfd, 0)) error_log("Failed to truncate spool file '%s': %s\n", settings.spoolfile, strerror(errno));
+    settings.spoolpos = settings.spoolsize = 0;
+    settings.spooling = 0;
+  }
+  pthread_mutex_unlock(&settings.spoollock);
+  return r/sizeof(struct update);
+}
+
+void db_queue_stats(void) {
+  static unsigned long dropped = 0;
+
+  if (settings.dbdropped != dropped) {
+    error_log("Dropped %lu updates for the db writer (%lu in total)\n", settings.dbdropped-dropped, settings.dbdropped);
+    dropped = settings.dbdropped;
+  }
+  if (settings.verbose && (settings.dbspilled || settings.dbdropped || settings.dbring.full)) printf("Db writer queue: %lu queued, %lu spilled, %lu dropped, %lld bytes spooled, %lu waits for room\n",
+    settings.dbqueued, settings.dbspilled, settings.dbdropped, settings.spoolsize-settings.spoolpos, settings.dbring.full);
+}
+
+void db_commit_stats(int rows, long long start) {
+  double ms = mstime()-start;
+
+  settings.dbcommits++;
+  settings.dbrows += rows;
+  settings.dbcommitms += ms;
+  if (ms > settings.dbcommitmax) settings.dbcommitmax = ms;
+  if (settings.verbose) printf("Committed %d rows to sqlite db in %.0f ms (avg %.1f ms, max %.0f ms over %lu commits)\n",
+    rows, ms, settings.dbcommitms/settings.dbcommits, settings.dbcommitmax, settings.dbcommits);
+  db_queue_stats();
+}
+
+long long epochms(void) { // Wall clock time in msec, for timestamps
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+long long mstime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// The main loop waits with poll() on the descriptors added during each turn, as select() can't take
+// the descriptors above FD_SETSIZE that a raised RLIMIT_NOFILE hands out. What poll() returned is kept
+// by descriptor, so poll_ready() can be asked about one anywhere until the next turn.
+static struct pollfd *pollfds = NULL;
+static int npollfds = 0, maxpollfds = 0;
+static short *pollrevents = NULL;
+static int npollrevents = 0;
+
+void poll_reset(void) {
+  int i;
+
+  for (i = 0; i < npollfds; i++) {
+    if (pollfds[i].fd < npollrevents) pollrevents[pollfds[i].fd] = 0;
+  }
+  npollfds = 0;
+}
+
+void poll_add(int fd, short events) {
+  struct pollfd *pfds;
+  int max;
+
+  if (npollfds == maxpollfds) {
+    max = maxpollfds?maxpollfds*2:64;
+    if (!(pfds = (struct pollfd *)realloc(pollfds, max*sizeof(struct pollfd)))) {
+      error_log("Failed to allocate memory for %d descriptors to poll\n", max);
+      return;
+    }
+    pollfds = pfds;
+    maxpollfds = max;
+  }
+  pollfds[npollfds].fd = fd;
+  pollfds[npollfds].events = events;
+  pollfds[npollfds].revents = 0;
+  npollfds++;
+}
+
+int poll_wait(int timeout) { // Returns what poll() returns
+  short *revents;
+  int i, n, c = poll(pollfds, npollfds, timeout);
+
+  for (i = 0; (c > 0) && (i < npollfds); i++) {
+    if (!pollfds[i].revents) continue;
+    if (pollfds[i].fd >= npollrevents) {
+      for (n = npollrevents?npollrevents*2:1024; n <= pollfds[i].fd; n *= 2);
+      if (!(revents = (short *)realloc(pollrevents, n*sizeof(short)))) {
+        error_log("Failed to allocate memory for %d polled descriptors\n", n);
+        continue; // Still ready on the next turn
+      }
+      memset(revents+npollrevents, 0, (n-npollrevents)*sizeof(short));
+      pollrevents = revents;
+      npollrevents = n;
+    }
+    pollrevents[pollfds[i].fd] = pollfds[i].revents;
+  }
+  return c;
+}
+
+int poll_ready(int fd, short events) { // An error or hangup counts as ready, as a read or write then reports it
+  return (fd >= 0) && (fd < npollrevents) && (pollrevents[fd] & (events|POLLERR|POLLHUP|POLLNVAL));
+}
+
+int uplink_connect(uplink_t *up) { // Returns 1 when connected, 0 when the connection is in progress, -1 on failure
+  int sock, one = 1;
   struct sockaddr_in sa;
   memset(&sa, 0, sizeof(sa));
   sa.sin_family = AF_INET;
-  sa.sin_addr.s_addr = inet_addr(settings.uplinkhost);
-  sa.sin_port = htons((unsigned int)settings.uplinkport);
+  sa.sin_addr.s_addr = inet_addr(up->host);
+  sa.sin_port = htons((unsigned int)up->port);
 
-  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    error_log("Failed to create socket for uplink\n");
-    return -1;
-  }
-  setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, 0, 0);
-  if ((c = connect(sock, (struct sockaddr *) &sa, sizeof(sa))) < 0) {
+  if ((sock = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0) return -1;
+  setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
     if (errno != EINPROGRESS) {
-      error_log("Failed to connect to uplink host %s ([%d] %s) %d\n", settings.uplinkhost, errno, strerror(errno));
+      one = errno;
       close(sock);
+      errno = one;
       return -1;
     }
+    up->sock = sock;
+    return 0;
   }
-  settings.uplinksock = sock;
-  return 0;
+  up->sock = sock;
+  return 1;
 }
 
 void report_consol(input_t *input) {
@@ -1074,64 +1992,98 @@ void report_consol(input_t *input) {
     if (input->consolcnt) process(input, input->consolsum/input->consolcnt);
     else process(input, 0L);
   }
+  else if (input->consol & CONSOL_QUANTILE) {
+    if (input->dds) {
+      process(input, dds_quantile(input->dds, input->quantile));
+      dds_clear(input->dds);
+    }
+    else process(input, 0L);
+  }
   else process(input, input->consolsum);
 
   input->consolcnt = input->consolsum = 0;
 }
 
+void report_histograms(input_t *input) {
+  input_t *child;
+
+  if (input->subtype & TYPE_VALPOS) report_histogram(input);
+  else {
+    for (child = input->next; child && child->parent; child = child->next) {
+      if (child->histcnt) report_histogram(child); // Bucket series created below have no counts of their own
+    }
+  }
+}
+
+// Reports cumulative bucket counts as children named le_<bound> (le_inf holds the total count);
+// for NAMEVALPOS these are siblings of the named child, called <name>:le_<bound>
+void report_histogram(input_t *input) {
+  int i, n = input->histogram->nbounds;
+  unsigned int sum = 0;
+  char name[256];
+  input_t *parent = input->parent?input->parent:input;
+
+  if (!input->histcnt && !(input->histcnt = (unsigned int *)calloc(n+1, sizeof(unsigned int)))) return;
+  if (!input->histchild && !(input->histchild = (input_t **)calloc(n+1, sizeof(input_t *)))) {
+    error_log("Failed to allocate memory for histogram series on input %s\n", input->name);
+    return;
+  }
+  for (i = 0; i <= n; i++) {
+    sum += input->histcnt[i];
+    input->histcnt[i] = 0;
+    if (!input->histchild[i]) {
+      if (i < n) snprintf(name, sizeof(name), "%s%sle_%g", input->parent?input->name:"", input->parent?":":"", input->histogram->bounds[i]);
+      else snprintf(name, sizeof(name), "%s%sle_inf", input->parent?input->name:"", input->parent?":":"");
+      if (!(input->histchild[i] = get_child(parent, name))) continue;
+      input->histchild[i]->histogram = NULL; // A plain series; get_child() copies the parent's setting
+    }
+    process(input->histchild[i], sum);
+  }
+}
+
+void report_distinct(input_t *input) {
+  if (!input->hll) {
+    process(input, 0);
+    return;
+  }
+  // Export the sketch so an aggregating anystat can merge it; sent ahead of the estimate, which the
+  // aggregator then ignores in favour of its merged one
+  if ((input->distinct > 1) && settings.nuplinks) {
+    char buf[HLL_REGISTERS+10];
+    struct uplink_rec rec = { input, epochms(), 0, NULL, 0 };
+
+    if (hll_encode(input->hll, buf, sizeof(buf)) == -1) error_log("Failed to encode distinct sketch for input %s\n", input->name);
+    else if (!(rec.sketch = strdup(buf))) error_log("Failed to allocate distinct sketch for input %s\n", input->name);
+    else uplink_queue(&rec, 1); // The socket writer frees the sketch
+  }
+  process(input, hll_estimate(input->hll));
+  memset(input->hll, 0, sizeof(hll));
+}
+
 void display(input_t *input) {
+  char label[200], *unit = "s";
+  int scale = 1;
+
+  if (input->parent) snprintf(label, sizeof(label), "%s/%s", input->parent->name, input->name);
+  else snprintf(label, sizeof(label), "%s", input->name);
+
   if (settings.verbose) {
-    if (input->parent) {
-      if (input->valcnt > 2) {
-        if (input->rocsum/(input->valcnt-1) < 0.1/60) printf("[%s/%s] Value: %.3g <%.3g> | Amplitude: %.3g <%.3g> | RoC: %.3g/h <%.3g/h> | Cycle: %.3gs <%.3gs>\n",
-          input->parent->name, input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->ampsum/(input->valcnt-1),
-          input->roclast*3600, input->rocsum/(input->valcnt-1)*3600, input->updlast, input->updsum/(input->valcnt-1));
-        else if (input->rocsum/(input->valcnt-1) < 0.1) printf("[%s/%s] Value: %.3g <%.3g> | Amplitude: %.3g <%.3g> | RoC: %.3g/m <%.3g/m> | Cycle: %.3gs <%.3gs>\n",
-          input->parent->name, input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->ampsum/(input->valcnt-1),
-          input->roclast*60, input->rocsum/(input->valcnt-1)*60, input->updlast, input->updsum/(input->valcnt-1));
-        else printf("[%s/%s] Value: %.3g <%.3g> | Amplitude: %.3g <%.3g> | RoC: %.3g/s <%.3g/s> | Cycle: %.3gs <%.3gs>\n",
-          input->parent->name, input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->ampsum/(input->valcnt-1),
-          input->roclast, input->rocsum/(input->valcnt-1), input->updlast, input->updsum/(input->valcnt-1));
-      }
-      else if (input->valcnt > 1) {
-        if (input->roclast < 0.1/60) printf("[%s/%s] Value: %.3g <%.3g> | Amplitude: %.3g | RoC: %.3g/h | Cycle: %.3gs\n",
-          input->parent->name, input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->roclast*3600, input->updlast);
-        else if (input->roclast < 0.1) printf("[%s/%s] Value: %.3g <%.3g> | Amplitude: %.3g | RoC: %.3g/m | Cycle: %.3gs\n",
-          input->parent->name, input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->roclast*60, input->updlast);
-        else printf("[%s/%s] Value: %.3g <%.3g> | Amplitude: %.3g | RoC: %.3g/s | Cycle: %.3gs\n",
-          input->parent->name, input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->roclast, input->updlast);
-      }
-      else printf("[%s/%s] %.3g\n", input->parent->name, input->name, *input->vallast);
+    if (input->updavg) {
+      if (input->rocavg < 0.1/60) {
+        scale = 3600;
+        unit = "h";
+      }
+      else if (input->rocavg < 0.1) {
+        scale = 60;
+        unit = "m";
+      }
+      printf("[%s] Value: %.3g <%.3g \u00B1%.3g> [%.3g..%.3g] | Amplitude: %.3g <%.3g> | RoC: %.3g/%s <%.3g/%s> | Cycle: %.3gs <%.3gs>\n",
+        label, input->vallast, input->stats.ewma, stats_stddev(&input->stats), stats_min(&input->stats), stats_max(&input->stats),
+        input->amplast, input->ampavg, input->roclast*scale, unit, input->rocavg*scale, unit, input->updlast, input->updavg);
     }
-    else {
-        if (input->valcnt > 2) {
-        if (input->rocsum/(input->valcnt-1) < 0.1/60) printf("[%s] Value: %.3g <%.3g> | Amplitude: %.3g <%.3g> | RoC: %.3g/h <%.3g/h> | Cycle: %.3gs <%.3gs>\n",
-          input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->ampsum/(input->valcnt-1),
-          input->roclast*3600, input->rocsum/(input->valcnt-1)*3600, input->updlast, input->updsum/(input->valcnt-1));
-        else if (input->rocsum/(input->valcnt-1) < 0.1) printf("[%s] Value: %.3g <%.3g> | Amplitude: %.3g <%.3g> | RoC: %.3g/m <%.3g/m> | Cycle: %.3gs <%.3gs>\n",
-          input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->ampsum/(input->valcnt-1),
-          input->roclast*60, input->rocsum/(input->valcnt-1)*60, input->updlast, input->updsum/(input->valcnt-1));
-        else printf("[%s] Value: %.3g <%.3g> | Amplitude: %.3g <%.3g> | RoC: %.3g/s <%.3g/s> | Cycle: %.3gs <%.3gs>\n",
-          input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->ampsum/(input->valcnt-1),
-          input->roclast, input->rocsum/(input->valcnt-1), input->updlast, input->updsum/(input->valcnt-1));
-      }
-      else if (input->valcnt > 1) {
-        if (input->roclast < 0.1/60) printf("[%s] Value: %.3g <%.3g> | Amplitude: %.3g | RoC: %.3g/h | Cycle: %.3gs\n",
-          input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->roclast*3600, input->updlast);
-        else if (input->roclast < 0.1) printf("[%s] Value: %.3g <%.3g> | Amplitude: %.3g | RoC: %.3g/m | Cycle: %.3gs\n",
-          input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->roclast*60, input->updlast);
-        else printf("[%s] Value: %.3g <%.3g> | Amplitude: %.3g | RoC: %.3g/s | Cycle: %.3gs\n",
-          input->name, *input->vallast, input->valsum/input->valcnt, input->amplast, input->roclast, input->updlast);
-      }
-      else printf("[%s] %.3g\n", input->name, *input->vallast);
-    }
-  }
-  if (input->parent) {
-    if (input->warn_above && (*input->vallast > *input->warn_above)) printf("[%s/%s] Warning: value above threshold of %f\n", input->parent->name, input->name, *input->warn_above);
-  }
-  else {
-    if (input->warn_above && (*input->vallast > *input->warn_above)) printf("[%s] Warning: value above threshold of %f\n", input->name, *input->warn_above);
+    else printf("[%s] %.3g\n", label, input->vallast);
   }
+  if (input->warn_above && (input->vallast > *input->warn_above)) printf("[%s] Warning: value above threshold of %f\n", label, *input->warn_above);
 }
 
 void start_tails(void) {
@@ -1155,7 +2107,7 @@ void start_tails(void) {
         perror("fcntl()");
         exit(-1);
       }
-      if (input->subtype & (TYPE_COUNT|TYPE_NAMECOUNT)) input->tail->watch = inotify_add_watch(inot, input->tail->filename, IN_DELETE_SELF|IN_MOVE_SELF);
+      if (input->subtype & (TYPE_COUNT|TYPE_NAMECOUNT|TYPE_DISTINCT)) input->tail->watch = inotify_add_watch(inot, input->tail->filename, IN_DELETE_SELF|IN_MOVE_SELF);
       else input->tail->watch = inotify_add_watch(inot, input->tail->filename, IN_MODIFY|IN_DELETE_SELF|IN_MOVE_SELF);
       if (input->tail->watch < 0) {
         perror("inotify_add_watch()");
@@ -1174,6 +2126,91 @@ void start_pipes(void) {
   }
 }
 
+// Reads what is available on a non-blocking descriptor and passes the complete lines to parse_line(),
+// keeping a partial line in input->buffer for the next call. Returns the number of bytes read, 0 at
+// the end of the stream, or -1 with errno set when nothing could be read.
+int read_lines(input_t *input, int fd) {
+  int c, len, offset = 0, total = 0;
+  char *start, *end;
+
+  if (input->buffer) {
+    offset = strlen(input->buffer);
+    memcpy(mainbuf, input->buffer, offset);
+    free(input->buffer);
+    input->buffer = NULL;
+  }
+  while (1) {
+    if (offset == MAIN_BUF_SIZE) { // Line longer than the buffer; passed on in parts
+      mainbuf[offset] = '\0';
+      parse_line(input, mainbuf);
+      offset = 0;
+    }
+    if ((c = read(fd, mainbuf+offset, MAIN_BUF_SIZE-offset)) <= 0) break;
+    total += c;
+    len = offset+c;
+    mainbuf[len] = '\0';
+    for (start = mainbuf; (end = memchr(start, '\n', mainbuf+len-start)); start = end+1) {
+      *end = '\0';
+      parse_line(input, start);
+    }
+    offset = mainbuf+len-start;
+    memmove(mainbuf, start, offset);
+  }
+  if (offset && !(input->buffer = strndup(mainbuf, offset))) error_log("Failed to allocate memory for input %s\n", input->name);
+  return total?total:c;
+}
+
+void start_connect(input_t *input) {
+  struct sockaddr_in sin;
+  struct sockaddr_un sun;
+  int fd, r;
+
+  if (input->sock->path) {
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, input->sock->path, sizeof(sun.sun_path)-1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) != -1) r = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+  }
+  else {
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = input->sock->addr;
+    sin.sin_port = htons(input->sock->port);
+    if ((fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) != -1) r = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+  }
+  if ((fd == -1) || (r && (errno != EINPROGRESS))) { // A full unix socket backlog gives EAGAIN; retried like a refusal
+    r = errno;
+    if (fd != -1) close(fd);
+    connect_fail(input, "connect failed", r);
+    return;
+  }
+  input->sock->fd = fd;
+  input->sock->connecting = r?1:0;
+  if (!r && settings.verbose) printf("Input %s connected\n", input->name);
+}
+
+void connect_fail(input_t *input, const char *reason, int err) {
+  char target[PATH_MAX];
+  struct in_addr addr = { input->sock->addr };
+
+  if (input->sock->fd) {
+    close(input->sock->fd);
+    input->sock->fd = 0;
+  }
+  free(input->buffer); // A partial line doesn't continue on the next connection
+  input->buffer = NULL;
+  input->sock->connecting = 0;
+  if (!input->sock->backoff) input->sock->backoff = CONNECT_BACKOFF_MIN;
+  else if ((input->sock->backoff *= 2) > CONNECT_BACKOFF_MAX) input->sock->backoff = CONNECT_BACKOFF_MAX;
+  input->sock->retry = now+input->sock->backoff;
+  if (input->sock->path) snprintf(target, sizeof(target), "%s", input->sock->path);
+  else snprintf(target, sizeof(target), "%s:%d", inet_ntoa(addr), input->sock->port);
+  if (input->sock->backoff == CONNECT_BACKOFF_MIN) error_log("Input %s: %s %s%s%s; retrying in %d sec\n", input->name, target,
+    reason, err?": ":"", err?strerror(err):"", input->sock->backoff);
+  else if (settings.verbose) printf("Input %s: %s %s%s%s; retrying in %d sec\n", input->name, target,
+    reason, err?": ":"", err?strerror(err):"", input->sock->backoff);
+}
+
 void start_pipe(input_t *input) {
   int c;
   char *argv[4];
@@ -1267,11 +2304,41 @@ void start_cmd(input_t *input) {
   }
 }
 
-void open_fifos(void) { }
+void open_fifos(void) {
+  input_t *input;
 
-void open_sockets(void) { }
+  for (input = inputs; input; input = input->next) {
+    if (input->type & INPUT_FIFO) open_fifo(input);
+  }
+}
+
+// Opens the read side of a FIFO input without blocking, creating the FIFO if it doesn't exist yet, and
+// then holds a write side open too: the read side never sees EOF, so producers can come and go without
+// the descriptor having to be reopened, and writes of up to PIPE_BUF bytes by several of them don't mix
+void open_fifo(input_t *input) {
+  struct stat statbuf;
+
+  if (mkfifo(input->fifo->filename, 0660) && (errno != EEXIST)) {
+    error_log("Input %s: failed to create FIFO %s: %s\n", input->name, input->fifo->filename, strerror(errno));
+    exit(-1);
+  }
+  if (stat(input->fifo->filename, &statbuf) || !S_ISFIFO(statbuf.st_mode)) {
+    error_log("Input %s: %s is not a FIFO\n", input->name, input->fifo->filename);
+    exit(-1);
+  }
+  if ((input->fifo->fd = open(input->fifo->filename, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) == -1) {
+    error_log("Input %s: failed to open FIFO %s: %s\n", input->name, input->fifo->filename, strerror(errno));
+    exit(-1);
+  }
+  if (!input->fifo->wfd && ((input->fifo->wfd = open(input->fifo->filename, O_WRONLY|O_NONBLOCK|O_CLOEXEC)) == -1)) {
+    error_log("Input %s: failed to hold FIFO %s open for writing: %s\n", input->name, input->fifo->filename, strerror(errno));
+    input->fifo->wfd = 0;
+  }
+  if (fcntl(input->fifo->fd, F_SETPIPE_SZ, FIFO_PIPE_SIZE) == -1) error_log("Input %s: failed to enlarge FIFO buffer: %s\n", input->name, strerror(errno));
+  if (settings.verbose) printf("Input %s reading from FIFO %s\n", input->name, input->fifo->filename);
+}
 
-void write_log(input_t *input, float fl) {
+void write_log(input_t *input, double fl) {
   int r, n;
   char *filename = NULL;
   struct stat statbuf;
@@ -1348,7 +2415,7 @@ void write_log(input_t *input, float fl) {
     free(filename);
   }
 
-  fprintf(input->logfp, "%d,%f\n", now, fl);
+  fprintf(input->logfp, "%lld.%03lld,%.16g\n", input->lastts/1000, input->lastts%1000, fl);
   fflush(input->logfp);
 }
 
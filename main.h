@@ -1,7 +1,9 @@
 #define VERSION "2.1.3"
 #define CONFIG_FILE "/etc/anystat.conf"
-#define VALUE_HIST_SIZE 100
+#define VALUE_HIST_SIZE 100	// Default number of values kept in history per input (see "history" setting)
+#define VALUE_HIST_MAX 1000000	// Max number of values in the history of an input
 #define SUMMARIES_MAX 5		// Max number of summary-columns in monitoring mode
+#define STATS_WINDOW 60		// Default number of samples in the sliding statistics window (see "window" setting)
 
 #define CONFIG_REGEX_NAME "^\\s*([a-zA-Z0-9._-]+)\\s*:\\s*$"
 #define CONFIG_REGEX_SETTING "^\\s*([a-zA-Z-]+)\\s+(?:\"(.*?)\"|'(.*?)'|(.*?))\\s*$"
@@ -9,7 +11,67 @@
 #define MAIN_BUF_SIZE      4096
 #define MIN_INTERVAL         10
 #define DEF_INTERVAL         60
-#define DB_PRUNE_INTERVAL 21600 // 6 hours
+#define CONNECT_BACKOFF_MIN   1 // Secs before a CONNECT input reconnects; doubles up to CONNECT_BACKOFF_MAX
+#define CONNECT_BACKOFF_MAX  64
+#define DB_PRUNE_INTERVAL   600 // Start a new round of pruning every 10 minutes
+#define DB_PRUNE_BATCH     1000 // Max number of rows deleted per prune step
+#define DB_VACUUM_PAGES     256 // Max number of free pages released per prune step
+#define DB_SCHEMA_VERSION     4
+#define DB_SQLITE_MIN   3035000 // Sqlite library version needed for RETURNING and upserts
+#define DB_BATCH_ROWS      5000 // Default max number of rows per sqlite transaction
+#define DB_BATCH_MSEC      1000 // Default max time a row waits for its transaction to commit
+#define DB_READ_BATCH       256 // Number of updates taken from the writer queue at once
+#define DB_RING_SIZE      65536 // Default number of updates the writer queue holds
+#define DB_SPOOL_MAX         64 // Default max size in MB of the spool file for updates that didn't fit the queue
+#define UPLINKS_MAX          16 // Max number of uplink settings; series are spread over them
+#define UPLINK_RING_SIZE  16384 // Number of samples each uplink queue holds
+#define UPLINK_READ_BATCH    64 // Number of samples taken from the uplink queue at once
+#define UPLINK_BUF_SIZE   65536 // Bytes of formatted samples the socket writer holds while the uplink is slow or down
+#define UPLINK_FLUSH_MSEC  1000 // Default max time a sample waits before it is sent to the uplink
+#define UPLINK_FLUSH_BYTES 1300 // Default number of bytes that are sent without waiting for the flush time
+#define UPLINK_BACKOFF_MIN  500 // Msecs before the first reconnect attempt; doubles up to UPLINK_BACKOFF_MAX
+#define UPLINK_BACKOFF_MAX 60000
+#define UPLINK_STATS_INTERVAL 60 // Seconds between uplink statistics in verbose mode
+#define UPLINK_TCP_DEFAULT    0 // Socket options for the uplink connection
+#define UPLINK_TCP_NODELAY    1
+#define UPLINK_TCP_CORK       2
+#define OUTBOX_MAX          256 // Default max size in MB of the uplink outbox
+#define OUTBOX_SEGMENT_SIZE 1048576 // Bytes per outbox file; files are removed once all of their lines are sent
+#define OUTBOX_SEQ_BLOCK  65536 // Sequence numbers reserved in the outbox cursor file at once
+#define PROTO_MAGIC  "ANYSTATB" // Starts a connection in the binary uplink protocol
+#define PROTO_DEFINE          1 // Message types in the binary uplink protocol
+#define PROTO_DOUBLE          2
+#define PROTO_INT             3
+#define PROTO_SKETCH          4
+#define PROTO_SEQ             5
+#define PROTO_HELLO           6
+#define LISTEN_BACKLOG     1024 // Connections the kernel queues per listening socket until they are accepted
+#define LISTEN_EVENTS       256 // Events taken from epoll at once
+#define LISTEN_BUF_SIZE    4096 // Initial buffer per connection; doubles for senders that fill it
+#define LISTEN_BUF_MAX   262144 // Longest line or binary frame a connection may send
+#define LISTEN_READ_MAX   65536 // Bytes read from one connection before the others get their turn
+#define STATSD_BATCH         64 // Datagrams taken from the socket per recvmmsg() call
+#define STATSD_ROUNDS        16 // Max number of recvmmsg() calls before the other inputs get their turn
+#define STATSD_DGRAM_MAX   8192 // Longer datagrams are dropped
+#define STATSD_RCVBUF   4194304 // Requested socket receive buffer, to ride out bursts
+#define FIFO_PIPE_SIZE  1048576 // Requested kernel buffer of FIFO inputs, so producers block less often
+#define SUB_CLIENTS_MAX      64 // Max number of clients on the subscription socket
+#define SUB_PATTERNS_MAX     64 // Max number of patterns a client subscribes to
+#define SUB_BUF_SIZE       4096 // Initial update queue per client; doubles up to SUB_QUEUE_MAX
+#define SUB_QUEUE_MAX   1048576 // Bytes of updates queued for a client before it is dropped as too slow
+#define METRICS_FAMILIES      4 // Number of metric families on the /metrics endpoint, see metrics.c
+#define METRICS_SLOT         24 // Width of a value in the exposition; no rendered double is longer
+#define METRICS_CLIENTS_MAX  16 // Max number of scrapers connected at once
+#define METRICS_REQ_MAX    4096 // Longer HTTP requests are refused
+#define METRICS_SEND_TIMEOUT 30 // Seconds a scraper may stall the sending of a response before it is dropped
+#define RING_POLL_MAX         4 // Max number of other descriptors ring_poll() waits on
+#define ROLLUPS               3 // Number of entries in rollups[]
+#define JOURNAL_SIZE         16 // Default size in MB of the sample journal
+#define JOURNAL_HDR_SIZE   4096
+#define JOURNAL_REC_MAX    1024 // Samples of inputs with longer names aren't journaled
+#define JOURNAL_MAGIC 0x4a545341
+#define JOURNAL_DB            0 // Consumers that acknowledge journaled samples
+#define JOURNAL_UPLINK        1
 
 #define INPUT_CAT      1	// Periodically read file
 #define INPUT_TAIL     2	// Continuously read file
@@ -18,6 +80,11 @@
 #define INPUT_FIFO    16	// Continuously read fifo
 #define INPUT_LISTEN  32	// Bind to port and read data
 #define INPUT_CONNECT 64	// Connect to port and read data
+#define INPUT_STATSD 128	// Receive metrics in the statsd line protocol over UDP
+
+#define OVERFLOW_SPILL 0	// Updates that don't fit the writer queue go to the spool file
+#define OVERFLOW_DROP  1	// Updates that don't fit the writer queue are dropped
+#define OVERFLOW_BLOCK 2	// Wait for room in the writer queue, stalling all inputs
 
 #define TYPE_COUNT               1	// Count output lines;
 #define TYPE_VALPOS              2	// Read value from word x on each line
@@ -28,6 +95,7 @@
 					// For continuous inputs: record the time between output lines
 #define TYPE_AGGREGATE		64	// Read uplink output from another anystat value; reads values prefixed
 					//  with one or more levels of hierarchy names
+#define TYPE_DISTINCT		128	// Estimate the number of distinct names read from word y per interval
 
 #define CONSOL_FIRST		 1
 #define CONSOL_LAST		 2
@@ -35,10 +103,20 @@
 #define CONSOL_MAX		 8
 #define CONSOL_SUM		16
 #define CONSOL_AVG		32
+#define CONSOL_QUANTILE		64	// Percentile given as "pN" (e.g. p99), estimated with a DDSketch
 
 #define ALERT_WARN		 1
 #define ALERT_CRIT		 2
 
+#define HLL_PRECISION		12	// Number of index bits in the HyperLogLog sketch; ~1.6% standard error
+#define HLL_REGISTERS		(1<<HLL_PRECISION)
+
+#define DDS_ACCURACY		0.01	// Relative accuracy of quantiles reported by CONSOL_QUANTILE
+#define DDS_BINS		1024	// Buckets per sign; covers values spanning 8 orders of magnitude
+#define DDS_MIN_VALUE		1e-9	// Values closer to zero than this are counted as zero
+
+#define HISTOGRAM_MAX_BOUNDS	256
+
 
 typedef struct input_cat {
   char *filename;
@@ -72,13 +150,76 @@ typedef struct input_pipe {
 
 typedef struct input_fifo {
   char *filename;
+  int fd;
+  int wfd; // Write side held open, so the read side doesn't see EOF whenever the last producer closes
 } input_fifo;
 
 typedef struct input_sock {
   in_port_t port;
   in_addr_t addr;
+  char *path; // Unix socket to connect to instead
+  int fd;
+  int connecting;
+  int backoff; // Secs until the next reconnect after this one fails
+  time_t retry;
 } input_sock;
 
+typedef struct value_hist {
+  unsigned short *buf; // Packed 16-bit values, see history.c
+  unsigned int size;
+  unsigned int len;
+  unsigned int pos; // Next position to write
+  int delta; // Values are stored as increments on the previous one, while the series never decreased
+} value_hist;
+
+typedef struct hist_iter {
+  value_hist *hist;
+  unsigned int pos;
+  unsigned int left;
+  double cur; // Value at pos, when the increments are summed back from the last value
+} hist_iter;
+
+typedef struct hll {
+  unsigned char reg[HLL_REGISTERS];
+} hll;
+
+typedef struct dds_store {
+  int offset; // Bucket index of bins[0]
+  int min;
+  int max;
+  unsigned int count;
+  unsigned int bins[DDS_BINS];
+} dds_store;
+
+typedef struct ddsketch {
+  dds_store pos;
+  dds_store neg;
+  unsigned int zero;
+  unsigned int count;
+} ddsketch;
+
+typedef struct histogram {
+  int nbounds;
+  int size; // Length of bounds; nbounds+1 rounded up to a power of two
+  float *bounds; // Ascending upper bucket bounds, padded with INFINITY
+} histogram;
+
+typedef struct win_stats {
+  unsigned int size; // Window length in samples
+  unsigned int n; // Samples currently in the window
+  unsigned long long seq; // Total number of samples added
+  double *vals; // Ring of the samples in the window
+  double mean; // Welford mean and sum of squared deviations over the window
+  double m2;
+  double ewma;
+  unsigned int *minq; // Monotonic deques of positions in vals, see stats.c
+  unsigned int minhead;
+  unsigned int minlen;
+  unsigned int *maxq;
+  unsigned int maxhead;
+  unsigned int maxlen;
+} win_stats;
+
 typedef struct input_t {
   struct input_t *next;
   char *name;
@@ -110,6 +251,13 @@ typedef struct input_t {
   struct timeval tv;
   int rate;
   int consol;
+  float quantile;
+  ddsketch *dds;
+  int distinct; // 1 = report estimate; 2 = also export sketch over the uplink
+  hll *hll;
+  histogram *histogram;
+  unsigned int *histcnt; // Counts per bucket, on the input (VALPOS) or named child (NAMEVALPOS) receiving the values
+  struct input_t **histchild; // Child series reporting the cumulative bucket counts
   input_cat *cat;
   input_tail *tail;
   input_cmd *cmd;
@@ -119,20 +267,26 @@ typedef struct input_t {
   time_t start;
   time_t update;
   unsigned int valcnt;
-  float valhist[VALUE_HIST_SIZE];
-  float *vallast;
-  float valsum;
-  float valmin;
-  float valmax;
+  int histsize;
+  value_hist valhist;
+  double vallast;
+  long long lastts; // Time of the last sample in msec since the epoch
+  char *uplinkkey; // Full series name for the uplink; set by the socket writer
+  int uplinkid; // Series number in the binary uplink protocol, on the uplink the series is sharded to
+  int uplinkshard; // Index+1 of that uplink; 0 until the series was first sent
+  unsigned int subid; // Series number on the subscription socket; 0 until the series was first emitted
+  int metricsoff[METRICS_FAMILIES]; // Offsets of the value slots of the series in the /metrics families; 0 until added
+  int window;
+  win_stats stats;
   float updlast;
-  float updsum;
+  double updavg; // EWMAs over the same span as the statistics window
   float roclast;
-  float rocsum;
+  double rocavg;
   float amplast;
-  float ampsum;
-  float deltalast;
+  double ampavg;
+  double deltalast;
   unsigned int consolcnt;
-  float consolsum;
+  double consolsum;
   char *buffer;
   int sqlid;
   FILE *logfp;
@@ -143,12 +297,185 @@ typedef struct input_t {
 #endif
 } input_t;
 
-typedef struct update {
+#define TSDB_CHUNK_SIZE    4096 // Max size of an encoded chunk in bytes
+#define TSDB_SAMPLE_BITS    145 // Worst case size of an encoded sample: 68 bits timestamp, 77 bits value
+#define TSDB_VERSION          2 // Format of the files; version 1 had timestamps in seconds
+#define TSDB_LINE_SIZE     1024 // Max line length in the tsdb series file
+
+typedef struct tsdb_chunk { // Index entry, stored as-is in the series' .idx file
+  long long offset;
+  int len;
+  int cnt;
+  long long first; // Timestamps in msec
+  long long last;
+  double sum;
+  double min;
+  double max;
+} tsdb_chunk;
+
+typedef struct tsdb_key { // Entry of the in-memory index of the series file
+  char *key; // "<name>\t<sub>"
+  int id;
+} tsdb_key;
+
+typedef struct tsdb_series { // Writer state of a series, encoding into its open chunk
   int id;
-  int ts;
-  float val;
+  int datafd;
+  int idxfd;
+  int pos; // Index position of the open chunk
+  long long base; // Logical offset of the first chunk in the data file
+  tsdb_chunk cur;
+  int dirty;
+  int bits;
+  long long ts;
+  long long delta;
+  unsigned long long val;
+  int lead;
+  int trail;
+  unsigned char buf[TSDB_CHUNK_SIZE];
+} tsdb_series;
+
+typedef struct listen_sender { // Anystat that numbers its uplink samples, known by the name in its greeting
+  struct listen_sender *next;
+  char *name;
+  unsigned long long seq; // Highest sequence number received from it
+} listen_sender;
+
+typedef struct listen_conn { // Listening socket or connection of a LISTEN input, see listen.c
+  int fd;
+  int listener;
+  struct input_t *input;
+  struct in_addr addr;
+  char *buf;
+  int len;
+  int size;
+  int binary; // -1 until the first bytes show the protocol of an AGGREGATE input
+  listen_sender *sender;
+  struct input_t **series; // Children by series number in the binary protocol
+  int nseries;
+  int ready; // On the list of connections with data left to read
+  struct listen_conn *nextready;
+} listen_conn;
+
+typedef struct sub_client { // Client of the subscription socket, see subscribe.c
+  int fd;
+  char in[512]; // Partial line of patterns
+  int inlen;
+  char *patterns[SUB_PATTERNS_MAX];
+  int npatterns;
+  unsigned char *match; // By series number: 0 = not checked yet, 1 = no match, 2 = match, 3 = also defined
+  unsigned int nmatch;
+  char *buf; // Queued updates
+  int len;
+  int sent;
+  int size;
+  int frame; // Offset of the length of the frame being filled, or -1
+  long long ts; // Timestamp of the last update, which the next one is a delta to
+  struct sub_client *next;
+} sub_client;
+
+typedef struct metrics_conn { // Connection of a scraper of the /metrics endpoint, see metrics.c
+  int fd;
+  char req[METRICS_REQ_MAX]; // Request up to the empty line
+  int reqlen;
+  char *out; // Response, sent by a thread of its own
+  size_t outlen;
+  struct metrics_conn *next;
+} metrics_conn;
+
+typedef struct tsdb_mapping {
+  tsdb_chunk *idxmap;
+  size_t idxsize;
+  tsdb_chunk *idx; // First index entry with data
+  int first; // Its position in the index file
+  int nchunks;
+  unsigned char *data;
+  size_t datasize;
+  long long base;
+} tsdb_mapping;
+
+typedef struct tsdb_reader {
+  const unsigned char *buf;
+  int size; // In bits
+  int bits;
+  int left;
+  int version; // Chunks written by TSDB_VERSION 1 have 32-bit timestamps
+  long long ts;
+  long long delta;
+  unsigned long long val;
+  int lead;
+  int trail;
+} tsdb_reader;
+
+struct rollup {
+  long long ts; // Start of the bucket in msec
+  int cnt;
+  double sum;
+  double min;
+  double max;
+};
+
+typedef struct ring {
+  unsigned long long head __attribute__((aligned(64))); // Only written by the producer
+  unsigned long long tail __attribute__((aligned(64))); // Only written by the consumer
+  int waiting __attribute__((aligned(64))); // Consumer is asleep on efd
+  unsigned int size;
+  unsigned int recsize;
+  char *buf;
+  int efd;
+  unsigned long full; // Number of times the producer had to wait
+} ring;
+
+typedef struct uplink_t { // Destination for the uplink samples, with its own queue and socket writer thread
+  int id; // Index in settings.uplinks
+  char *host;
+  int port;
+  unsigned long long seed; // Hash of host:port, for rendezvous hashing of the series
+  int sock;
+  int down; // Set by the writer while the uplink can't be reached, so samples go to the next one
+  long long queued; // Journal position of the last sample queued, written by the main thread
+  long long acked; // Journal position of the last sample written, by the socket writer
+  ring ring;
+  pthread_t thread;
+  unsigned long flushes;
+  unsigned long long bytes;
+  double flushlat; // Msecs between the first sample of a flush being formatted and the flush completing
+  double flushmax;
+  unsigned long connects;
+} uplink_t;
+
+struct uplink_rec {
+  struct input_t *input;
+  long long ts;
+  double val;
+  char *sketch; // Encoded distinct sketch to send instead of val
+  long long jpos; // Journal position to acknowledge once sent, or 0
+};
+
+typedef struct update {
+  struct input_t *input;
+  int id; // 0 if the input was new when queued
+  long long ts; // Msecs since the epoch
+  double val;
+  long long jpos; // Journal position to acknowledge once committed, or 0
 } update;
 
+typedef struct journal_hdr { // At the start of the journal file, see journal.c
+  unsigned int magic;
+  unsigned int size; // Of the data area that follows the header page
+  long long head; // Only written by the main thread
+  long long dbacked __attribute__((aligned(64))); // Only written by the db writer
+  long long upacked __attribute__((aligned(64))); // Only written by the socket writer
+} journal_hdr;
+
+typedef struct journal_rec { // Followed by the parent name (or "") and the name, both terminated
+  unsigned short len; // Including the names, padded to a multiple of 8
+  unsigned short plen;
+  int unused;
+  long long ts;
+  double val;
+} journal_rec;
+
 struct {
   char *configfile;
   int daemon;
@@ -156,17 +483,64 @@ struct {
   int verbose;
   char *logdir;
   int logsize;
-  char *uplinkhost;
-  int uplinkport;
+  uplink_t uplinks[UPLINKS_MAX];
+  int nuplinks;
   char *uplinkprefix;
-  int uplinksock;
-  int uplinkpipe[2];
-  pthread_t uplinkthread;
+  int uplinkflushms;
+  int uplinkflushbytes;
+  int uplinktcp;
+  unsigned long long uplinkfailovers; // Samples sent to another uplink than their own as it was down
+  int uplinkbinary;
+  int uplinklevel; // Compression level for the binary protocol
+  int uplinkseq; // Number the lines so an aggregating anystat can skip ones it received twice
+  char *outboxdir;
+  long long outboxmax;
+  long long outboxsize; // Bytes in the outbox files, including sent lines in the oldest one
+  unsigned long long outboxspilled;
+  unsigned long long outboxdropped;
+  unsigned long listenconns;
+  unsigned long long listensamples;
+  unsigned long long listendups; // Samples skipped as their sequence number was received before
+  unsigned long long statsdpackets;
+  unsigned long long statsdmetrics;
+  unsigned long long statsdinvalid;
+  char *subscribepath;
+  int subscribefd;
+  int subclients;
+  unsigned long long subupdates;
+  unsigned long subdropped; // Clients dropped because their queue was full
+  in_addr_t metricsaddr;
+  int metricsport;
+  int metricsfd;
+  int metricsseries;
+  unsigned long long metricsscrapes;
   char *sqlitefile;
   sqlite3 *sqlitehandle;
-  int sqlitepipe[2];
+  ring dbring;
+  int dbqueuesize;
+  int dboverflow;
+  char *spoolfile;
+  int spoolfd;
+  long long spoolmax;
+  long long spoolsize; // Both offsets are only changed with spoollock held
+  long long spoolpos;
+  int spooling; // Set while updates go to the spool file; queue again once the writer has caught up
+  pthread_mutex_t spoollock;
+  unsigned long dbqueued;
+  unsigned long dbspilled;
+  unsigned long dbdropped;
+  char *journalfile;
+  unsigned int journalsize;
+  unsigned long journalskipped;
   pthread_t sqlitethread;
   int sqliteprune;
+  int sqlitebatch;
+  int sqlitecommit;
+  unsigned long dbcommits;
+  unsigned long dbrows;
+  double dbcommitms;
+  double dbcommitmax;
+  char *tsdbdir;
   char *warncmd;
   char *critcmd;
   int alertrepeat;
@@ -188,7 +562,10 @@ char *type[] = {
   NULL, NULL, NULL, NULL, NULL, NULL, NULL,
   "LISTEN",
   NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-  "CONNECT"
+  "CONNECT",
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  "STATSD"
 };
 
 char *subtype[] = {
@@ -202,7 +579,10 @@ char *subtype[] = {
   NULL, NULL, NULL, NULL, NULL, NULL, NULL,
   "TIME",
   NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-  "AGGREGATE"
+  "AGGREGATE",
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  "DISTINCT"
 };
 
 char *consol[] = {
@@ -214,13 +594,21 @@ char *consol[] = {
   NULL, NULL, NULL,
   "SUM",
   NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-  "AVG"
+  "AVG",
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  "QUANTILE"
 };
 
+int rollups[ROLLUPS] = { 60, 3600, 86400 }; // Bucket sizes of the rollup table, in seconds
+struct rollup *rollupacc; // Writer thread accumulators, ROLLUPS per input id
+int rollupids;
+
 input_t *inputs;
 
 time_t now;
 
 int inot;
 
+int epfd; // Epoll instance of the LISTEN inputs, see listen.c
+
 char mainbuf[MAIN_BUF_SIZE+1];
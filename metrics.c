@@ -0,0 +1,269 @@
+void metrics_open(void);
+void metrics_poll(void);
+void do_metrics(void);
+void metrics_accept(void);
+void metrics_read(metrics_conn *);
+void *metrics_send(void *);
+void metrics_update(input_t *);
+int metrics_add(input_t *);
+void metrics_put(char *, double);
+void metrics_close(metrics_conn *, const char *);
+
+// HTTP endpoint for Prometheus scrapers, serving /metrics in the text exposition format (version
+// 0.0.4). Every series has a line in each metric family below, which is rendered when its first
+// value is processed; after that process() only overwrites the value, which has a fixed-width slot
+// padded with blanks (trailing whitespace is allowed by the format). The families are kept ready
+// to send in their own buffers, so all a scrape costs the main loop is a copy of them, however many
+// series there are. The main loop reads the requests; the response, a consistent snapshot of the
+// families, is sent by a thread of its own, so neither its size nor a slow scraper holds things up.
+
+static struct {
+  const char *name, *head;
+  char *buf;
+  size_t len, size;
+} metrics_families[METRICS_FAMILIES] = {
+  { "anystat_value", "# HELP anystat_value Last value of the series\n# TYPE anystat_value gauge\n" },
+  { "anystat_samples_total", "# HELP anystat_samples_total Number of values of the series since startup\n# TYPE anystat_samples_total counter\n" },
+  { "anystat_change_rate", "# HELP anystat_change_rate Rate of change per second between the last two values\n# TYPE anystat_change_rate gauge\n" },
+  { "anystat_last_update_seconds", "# HELP anystat_last_update_seconds Time of the last value, in seconds since the epoch\n# TYPE anystat_last_update_seconds gauge\n" }
+};
+static metrics_conn *metrics_conns = NULL;
+static int metrics_nconns = 0, metrics_sending = 0; // Connections reading a request, and responses being sent
+
+void metrics_open(void) {
+  struct sockaddr_in sa;
+  int i, fd, on = 1;
+
+  for (i = 0; i < METRICS_FAMILIES; i++) {
+    metrics_families[i].len = strlen(metrics_families[i].head);
+    metrics_families[i].size = 65536;
+    if (!(metrics_families[i].buf = (char *)malloc(metrics_families[i].size))) {
+      error_log("Failed to allocate memory for metrics\n");
+      exit(-1);
+    }
+    memcpy(metrics_families[i].buf, metrics_families[i].head, metrics_families[i].len);
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(settings.metricsport);
+  sa.sin_addr.s_addr = settings.metricsaddr;
+  if (((fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1)
+   || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+   || bind(fd, (struct sockaddr *)&sa, sizeof(sa))
+   || listen(fd, METRICS_CLIENTS_MAX)) {
+    error_log("Failed to listen for metrics scrapers on %s:%d: %s\n", inet_ntoa(sa.sin_addr), settings.metricsport, strerror(errno));
+    exit(-1);
+  }
+  settings.metricsfd = fd;
+  if (settings.verbose) printf("Serving /metrics on %s:%d\n", inet_ntoa(sa.sin_addr), settings.metricsport);
+}
+
+void metrics_poll(void) {
+  metrics_conn *conn;
+
+  if (!settings.metricsfd) return;
+  poll_add(settings.metricsfd, POLLIN);
+  for (conn = metrics_conns; conn; conn = conn->next) poll_add(conn->fd, POLLIN);
+}
+
+void do_metrics(void) {
+  metrics_conn *conn, *next;
+
+  if (!settings.metricsfd) return;
+  if (poll_ready(settings.metricsfd, POLLIN)) metrics_accept();
+  for (conn = metrics_conns; conn; conn = next) {
+    next = conn->next;
+    if (poll_ready(conn->fd, POLLIN)) metrics_read(conn);
+  }
+}
+
+void metrics_accept(void) {
+  metrics_conn *conn;
+  int fd;
+
+  while ((fd = accept4(settings.metricsfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1) {
+    if ((metrics_nconns+__atomic_load_n(&metrics_sending, __ATOMIC_RELAXED) >= METRICS_CLIENTS_MAX)) {
+      error_log("Refused metrics scraper: too many connections\n");
+      close(fd);
+      continue;
+    }
+    if (!(conn = (metrics_conn *)calloc(1, sizeof(metrics_conn)))) {
+      error_log("Failed to allocate memory for metrics scraper\n");
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->next = metrics_conns;
+    metrics_conns = conn;
+    metrics_nconns++;
+  }
+  if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) error_log("Failed to accept metrics scraper: %s\n", strerror(errno));
+}
+
+void metrics_read(metrics_conn *conn) { // Reads the request and hands a copy of the families to a sender thread
+  const char *status = "200 OK";
+  char head[256];
+  size_t lens[METRICS_FAMILIES], len = 0;
+  struct timeval tv = { METRICS_SEND_TIMEOUT, 0 };
+  metrics_conn **prev;
+  pthread_t thread;
+  int i, n;
+
+  while ((n = read(conn->fd, conn->req+conn->reqlen, sizeof(conn->req)-conn->reqlen-1)) > 0) {
+    conn->reqlen += n;
+    conn->req[conn->reqlen] = '\0';
+    if (strstr(conn->req, "\r\n\r\n") || strstr(conn->req, "\n\n")) break;
+    if (conn->reqlen == sizeof(conn->req)-1) {
+      metrics_close(conn, "sent a request that is too long");
+      return;
+    }
+  }
+  if (!n) {
+    metrics_close(conn, NULL);
+    return;
+  }
+  if (n == -1) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) metrics_close(conn, "failed");
+    return;
+  }
+
+  memset(lens, 0, sizeof(lens));
+  if (strncmp(conn->req, "GET ", 4)) status = "405 Method Not Allowed";
+  else if (strncmp(conn->req+4, "/metrics", 8) || !strchr(" ?", conn->req[12])) status = "404 Not Found";
+  else {
+    for (i = 0; i < METRICS_FAMILIES; i++) len += lens[i] = metrics_families[i].len;
+    settings.metricsscrapes++;
+  }
+  n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+               "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, len);
+  if (!(conn->out = (char *)malloc(n+len))) {
+    metrics_close(conn, "could not be given memory for the response");
+    return;
+  }
+  memcpy(conn->out, head, n);
+  conn->outlen = n;
+  for (i = 0; i < METRICS_FAMILIES; i++) {
+    memcpy(conn->out+conn->outlen, metrics_families[i].buf, lens[i]);
+    conn->outlen += lens[i];
+  }
+
+  for (prev = &metrics_conns; *prev != conn; prev = &(*prev)->next);
+  *prev = conn->next;
+  metrics_nconns--;
+  __atomic_add_fetch(&metrics_sending, 1, __ATOMIC_RELAXED);
+  fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL)&~O_NONBLOCK);
+  setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); // So a scraper that stops reading can't keep the thread
+  if ((i = pthread_create(&thread, NULL, metrics_send, conn))) {
+    error_log("Failed to start thread for metrics scraper: %s\n", strerror(i));
+    close(conn->fd);
+    free(conn->out);
+    free(conn);
+    __atomic_sub_fetch(&metrics_sending, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void *metrics_send(void *arg) { // Writes one response, however long the scraper takes to read it
+  metrics_conn *conn = (metrics_conn *)arg;
+  size_t sent = 0;
+  ssize_t r;
+
+  while (sent < conn->outlen) {
+    if ((r = write(conn->fd, conn->out+sent, conn->outlen-sent)) > 0) sent += r;
+    else if ((r == -1) && (errno == EINTR)) continue;
+    else {
+      error_log("Metrics scraper failed after %zu of %zu bytes: %s\n", sent, conn->outlen, (r == -1)?strerror(errno):"connection closed");
+      break;
+    }
+  }
+  close(conn->fd);
+  free(conn->out);
+  free(conn);
+  __atomic_sub_fetch(&metrics_sending, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+void metrics_update(input_t *input) { // Called from process() with the new value in place
+  if (!input->metricsoff[0] && metrics_add(input)) return;
+  metrics_put(metrics_families[0].buf+input->metricsoff[0], input->vallast);
+  metrics_put(metrics_families[1].buf+input->metricsoff[1], input->valcnt);
+  metrics_put(metrics_families[2].buf+input->metricsoff[2], input->roclast);
+  metrics_put(metrics_families[3].buf+input->metricsoff[3], input->lastts/1000.0);
+}
+
+int metrics_add(input_t *input) { // Appends a line for a new series to every family
+  char labels[1100], *buf;
+  const char *name;
+  int i, len = 0, part;
+  size_t size, need;
+
+  for (part = 0; part < 2; part++) { // The input and, for a child, the child, with their names escaped
+    if (part == 0) {
+      name = input->parent?input->parent->name:input->name;
+      len += sprintf(labels+len, "{input=\"");
+    }
+    else if (input->parent) {
+      name = input->name;
+      len += sprintf(labels+len, "\",child=\"");
+    }
+    else break;
+    for (; *name && (len < sizeof(labels)-16); name++) {
+      if ((*name == '\\') || (*name == '"')) labels[len++] = '\\';
+      if (*name == '\n') {
+        labels[len++] = '\\';
+        labels[len++] = 'n';
+      }
+      else labels[len++] = *name;
+    }
+  }
+  len += sprintf(labels+len, "\"} ");
+
+  for (i = 0; i < METRICS_FAMILIES; i++) { // Make room in all of them first, so a series is either added everywhere or nowhere
+    need = metrics_families[i].len+strlen(metrics_families[i].name)+len+METRICS_SLOT+1;
+    if (need <= metrics_families[i].size) continue;
+    for (size = metrics_families[i].size*2; size < need; size *= 2);
+    if (!(buf = (char *)realloc(metrics_families[i].buf, size))) {
+      error_log("Failed to allocate memory for metrics of input %s\n", input->name);
+      return -1;
+    }
+    metrics_families[i].buf = buf;
+    metrics_families[i].size = size;
+  }
+  for (i = 0; i < METRICS_FAMILIES; i++) {
+    part = strlen(metrics_families[i].name);
+    buf = metrics_families[i].buf+metrics_families[i].len;
+    memcpy(buf, metrics_families[i].name, part);
+    memcpy(buf+part, labels, len);
+    input->metricsoff[i] = metrics_families[i].len+part+len;
+    memset(buf+part+len, ' ', METRICS_SLOT);
+    buf[part+len+METRICS_SLOT] = '\n';
+    metrics_families[i].len += part+len+METRICS_SLOT+1;
+  }
+  settings.metricsseries++;
+  return 0;
+}
+
+void metrics_put(char *slot, double fl) { // Renders the value into its slot, padded with blanks
+  char str[32];
+  long long n = (long long)fl;
+  int len;
+
+  if (isnan(fl)) len = sprintf(str, "NaN");
+  else if (isinf(fl)) len = sprintf(str, fl > 0?"+Inf":"-Inf");
+  else if (((double)n == fl) && (n < (1LL<<53)) && (n > -(1LL<<53))) len = sprintf(str, "%lld", n);
+  else len = sprintf(str, "%.15g", fl);
+  memcpy(slot, str, len);
+  memset(slot+len, ' ', METRICS_SLOT-len);
+}
+
+void metrics_close(metrics_conn *conn, const char *reason) {
+  metrics_conn **prev;
+
+  if (reason) error_log("Metrics scraper %s; closing it\n", reason);
+  for (prev = &metrics_conns; *prev != conn; prev = &(*prev)->next);
+  *prev = conn->next;
+  close(conn->fd);
+  free(conn);
+  metrics_nconns--;
+}
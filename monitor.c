@@ -1,10 +1,11 @@
-#define _POSIX_C_SOURCE 200112L // Required by setenv() in ncurses.c
+#define _POSIX_C_SOURCE 200809L // Required by setenv() in ncurses.c and pread() in tsdb.c
 // #define _X_OPEN_SOURCE_EXTENDED // Needed for wide-character use of ncurses (or maybe not)
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <float.h> // FLT_MIN and FLT_MAX constants
+#include <math.h> // INFINITY in config.c
 #include <limits.h> // INT_MIN and INT_MAX constants
 #include <string.h>
 #include <strings.h>
@@ -15,6 +16,9 @@
 #include <netinet/in.h>
 #include <netinet/ip.h> // INADDR_ANY and INADDR_NONE macro's
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <time.h>
 #include <signal.h>
 #include <pcre.h>
@@ -22,17 +26,44 @@
 #include <locale.h>
 #include <ncursesw/curses.h> // ncurses functions in ncurses.c and WINDOW declaration in main.h
 #include "main.h"
+#include "history.c"
+#include "stats.c"
+#include "sketch.c" // hash_str() in tsdb.c
 #include "config.c"
+#include "tsdb.c"
 #include "ncurses.c"
 
 void do_winch(int sig) {
   settings.winch = 1;
 }
 
+void add_series(int id, const char *name, const char *sub) {
+  input_t *input;
+
+  for (input = inputs; input; input = input->next) {
+    if (!strcmp(input->name, name)) {
+      if (sub) input = add_input((char *)sub, input);
+      input->sqlid = id;
+    }
+  }
+}
+
+void add_sample(void *arg, long long ts, double value) {
+  input_t *input = (input_t *)arg;
+
+  hist_add(input, value);
+  stats_add(&input->stats, input->window, value);
+  input->valcnt++;
+  if (input->lastts < ts) {
+    input->lastts = ts;
+    input->update = ts/1000;
+  }
+}
+
 int main(int argc, char *argv[]) {
-  char query[100];
-  const char *name, *sub;
-  int i, id, ts, inputid, maxid = 0;
+  char query[120];
+  int i, id, inputid, valcnt;
+  long long ts, maxid = 0;
   double value;
   input_t *input;
   sqlite3_stmt *stmt;
@@ -40,37 +71,56 @@ int main(int argc, char *argv[]) {
   if (argc > 1) read_config(argv[1]);
   else read_config(NULL);
 
-  if (!settings.sqlitefile) {
-    fprintf(stderr, "No sqlite database defined in %s", argc>1?argv[1]:CONFIG_FILE);
-    return EXIT_FAILURE;
-  }
-  if (sqlite3_open(settings.sqlitefile, &settings.sqlitehandle) != SQLITE_OK) {
-    fprintf(stderr, "Failed to open sqlite database '%s': %s\n", settings.sqlitefile, sqlite3_errmsg(settings.sqlitehandle));
-    return EXIT_FAILURE;
+  if (settings.tsdbdir) {
+    char buf[TSDB_LINE_SIZE], *n, *s;
+    FILE *fp;
+
+    if (tsdb_version() != TSDB_VERSION) {
+      fprintf(stderr, "Tsdb directory '%s' is not in the current format; start anystat to convert it\n", settings.tsdbdir);
+      return EXIT_FAILURE;
+    }
+    snprintf(buf, TSDB_LINE_SIZE, "%s/series", settings.tsdbdir);
+    if (!(fp = fopen(buf, "r"))) {
+      fprintf(stderr, "Failed to open tsdb series file '%s': %s\n", buf, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    while ((id = tsdb_read_series(fp, buf, TSDB_LINE_SIZE, &n, &s))) add_series(id, n, s);
+    fclose(fp);
   }
-  sqlite3_prepare_v2(settings.sqlitehandle, "SELECT `id`, `name`, `sub` FROM inputs", 40, &stmt, NULL);
-  if (!stmt) {
-    fprintf(stderr, "Failed to prepare query for inputs on SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+  else if (!settings.sqlitefile) {
+    fprintf(stderr, "No sqlite database or tsdb directory defined in %s", argc>1?argv[1]:CONFIG_FILE);
     return EXIT_FAILURE;
   }
-  while ((i = sqlite3_step(stmt)) == SQLITE_ROW) {
-    if (sqlite3_column_count(stmt) != 3) break;
-    id = sqlite3_column_int(stmt, 0);
-    name = sqlite3_column_text(stmt, 1);
-    sub = sqlite3_column_text(stmt, 2);
-    for (input = inputs; input; input = input->next) {
-      if (!strcmp(input->name, name)) {
-        if (sub) input = add_input((char *)sub, input);
-        input->sqlid = id;
-      }
+  else {
+    if (sqlite3_open(settings.sqlitefile, &settings.sqlitehandle) != SQLITE_OK) {
+      fprintf(stderr, "Failed to open sqlite database '%s': %s\n", settings.sqlitefile, sqlite3_errmsg(settings.sqlitehandle));
+      return EXIT_FAILURE;
+    }
+    sqlite3_prepare_v2(settings.sqlitehandle, "SELECT `id`, `name`, `sub` FROM inputs", 40, &stmt, NULL);
+    if (!stmt) {
+      fprintf(stderr, "Failed to prepare query for inputs on SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return EXIT_FAILURE;
+    }
+    while ((i = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (sqlite3_column_count(stmt) != 3) break;
+      add_series(sqlite3_column_int(stmt, 0), (const char *)sqlite3_column_text(stmt, 1), (const char *)sqlite3_column_text(stmt, 2));
+    }
+    if (i != SQLITE_DONE) {
+      fprintf(stderr, "Error while reading inputs from SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return EXIT_FAILURE;
     }
-  }
-  if (i != SQLITE_DONE) {
-    fprintf(stderr, "Error while reading inputs from SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
-    return EXIT_FAILURE;
   }
 
-  snprintf(query, 100, "SELECT rowid, ts, value FROM data WHERE input = ? ORDER BY ts DESC LIMIT %d", block_width()-9);
+  if (!settings.tsdbdir) { // Rows are numbered in the order they are written; new ones are polled for by id
+    sqlite3_prepare_v2(settings.sqlitehandle, "SELECT MAX(id) FROM data", -1, &stmt, NULL);
+    if (!stmt) {
+      fprintf(stderr, "Failed to prepare query for last data id: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return EXIT_FAILURE;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) maxid = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+  snprintf(query, sizeof(query), "SELECT * FROM (SELECT ts, value FROM data WHERE input = ? AND id <= ? ORDER BY ts DESC LIMIT %d) ORDER BY ts", block_width()-9);
 
   signal(SIGWINCH, do_winch);
   ioctl(0, TIOCGWINSZ, &settings.ws);
@@ -78,6 +128,11 @@ int main(int argc, char *argv[]) {
 
   for (input = inputs; input; input = input->next) {
     if (!input->sqlid) continue;
+    if (settings.tsdbdir) {
+      if (tsdb_latest(input->sqlid, block_width()-9, add_sample, input)) fprintf(stderr, "Error while reading initial data from tsdb series %d\n", input->sqlid);
+      update_block(input);
+      continue;
+    }
     sqlite3_prepare_v2(settings.sqlitehandle, query, -1, &stmt, NULL);
     if (!stmt) {
       fprintf(stderr, "Failed to prepare query for latest data: %s\n", sqlite3_errmsg(settings.sqlitehandle));
@@ -87,17 +142,15 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "Failed to bind param 1 on initial data query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       return EXIT_FAILURE;
     }
+    if (sqlite3_bind_int64(stmt, 2, maxid) != SQLITE_OK) {
+      fprintf(stderr, "Failed to bind param 2 on initial data query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      return EXIT_FAILURE;
+    }
     while ((i = sqlite3_step(stmt)) == SQLITE_ROW) {
-      if (sqlite3_column_count(stmt) != 3) break;
-      id = sqlite3_column_int(stmt, 0);
-      ts = sqlite3_column_int(stmt, 1);
-      value = sqlite3_column_double(stmt, 2);
-      if (id > maxid) maxid = id;
-      if (input->vallast-input->valhist == VALUE_HIST_SIZE-1) input->vallast = input->valhist;
-      else input->vallast++;
-      input->valcnt++;
-      if (input->update < ts) input->update = ts;
-      *input->vallast = value;
+      if (sqlite3_column_count(stmt) != 2) break;
+      ts = sqlite3_column_int64(stmt, 0);
+      value = sqlite3_column_double(stmt, 1);
+      add_sample(input, ts, value);
     }
     sqlite3_finalize(stmt);
     if (i != SQLITE_DONE) fprintf(stderr, "Error while reading initial data from SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
@@ -113,29 +166,36 @@ int main(int argc, char *argv[]) {
       settings.winch = 0;
     }
 
-    sqlite3_prepare_v2(settings.sqlitehandle, "SELECT rowid, input, ts, value FROM data WHERE rowid > ? ORDER BY ts", 69, &stmt, NULL);
+    if (settings.tsdbdir) {
+      for (input = inputs; input; input = input->next) {
+        if (!input->sqlid) continue;
+        valcnt = input->valcnt;
+        if (tsdb_since(input->sqlid, input->lastts, add_sample, input)) fprintf(stderr, "Error while reading data from tsdb series %d\n", input->sqlid);
+        if (input->valcnt != valcnt) update_block(input);
+      }
+      check_updates();
+      sleep(60);
+      continue;
+    }
+
+    sqlite3_prepare_v2(settings.sqlitehandle, "SELECT id, input, ts, value FROM data WHERE id > ? ORDER BY id", -1, &stmt, NULL);
     if (!stmt) {
       fprintf(stderr, "Failed to prepare query for latest data on SQLite db: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       return EXIT_FAILURE;
     }
-    if (sqlite3_bind_int(stmt, 1, maxid) != SQLITE_OK) {
+    if (sqlite3_bind_int64(stmt, 1, maxid) != SQLITE_OK) {
       fprintf(stderr, "Error binding param 1 for latest data query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       return EXIT_FAILURE;
     }
     while ((i = sqlite3_step(stmt)) == SQLITE_ROW) {
       if (sqlite3_column_count(stmt) != 4) break;
-      id = sqlite3_column_int(stmt, 0);
+      maxid = sqlite3_column_int64(stmt, 0);
       inputid = sqlite3_column_int(stmt, 1);
-      ts = sqlite3_column_int(stmt, 2);
+      ts = sqlite3_column_int64(stmt, 2);
       value = sqlite3_column_double(stmt, 3);
-      if (id > maxid) maxid = id;
       for (input = inputs; input; input = input->next) {
         if (inputid == input->sqlid) {
-          if (input->vallast-input->valhist == VALUE_HIST_SIZE-1) input->vallast = input->valhist;
-          else input->vallast++;
-          input->valcnt++;
-          input->update = ts;
-          *input->vallast = value;
+          add_sample(input, ts, value);
           update_block(input);
         }
       }
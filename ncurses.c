@@ -1,10 +1,10 @@
 void create_block(input_t *);
 void arrange_blocks(void);
 void update_block(input_t *);
-void update_summary(input_t *, int, int, float, float, float);
+void update_summary(input_t *, int, int, double, double, double);
 void update_plot(input_t *);
 void draw_column(input_t *, int, int, float, int);
-char *format_float(input_t *, float);
+char *format_float(input_t *, double);
 
 void go_ncurses(void) {
   input_t *input;
@@ -26,7 +26,7 @@ void go_ncurses(void) {
   init_pair(3, COLOR_RED, COLOR_BLACK);
 
   for (input = inputs; input; input = input->next) {
-    if (!(input->subtype & TYPE_NAMEVALPOS)) create_block(input);
+    if (!(input->subtype & TYPE_NAMEVALPOS) && !(input->histogram && !input->parent)) create_block(input); // Histogram parents only feed their bucket series
   }
   arrange_blocks();
 }
@@ -56,7 +56,7 @@ void create_block(input_t *input) {
   if (settings.nsummaries) {
     mvwaddstr(win, 2, 2, "Summ:");
     for (i = 1; i < settings.nsummaries; i++) waddstr(win, "     | ");
-    for (i = 0; i < settings.nsummaries; i++) mvwprintw(win, 2, 7+7*i, " %3s ", itodur(settings.summaries[i]));
+    for (i = 0; i < settings.nsummaries; i++) mvwprintw(win, 2, 7+7*i, " %3s ", settings.summaries[i]?itodur(settings.summaries[i]):"win");
     mvwaddstr(win, 3, 2, "Avg: ");
     for (i = 1; i < settings.nsummaries; i++) waddstr(win, "     | ");
     mvwaddstr(win, 4, 2, "Min: ");
@@ -109,26 +109,51 @@ void check_updates() {
 }
 
 void update_block(input_t *input) {
-  int n, histcount;
-  char query[100];
-  float prev, cur, min = FLT_MAX, max = FLT_MIN, avg, valsum, devsum, rocsum;
+  int n, i, histcount;
+  static int norollup = 0;
+  char *query;
+  float prev, cur, valsum, devsum, rocsum;
+  double min = FLT_MAX, max = FLT_MIN, avg;
   int cnt, curts, prevts, mints;
   sqlite3_stmt *stmt;
   time_t now = time(NULL);
 
   if (input->winhide) return;
 
-  if (input->crit_above && (*input->vallast > *input->crit_above)) wattron(input->win, COLOR_PAIR(3));
-  else if (input->warn_above && (*input->vallast > *input->warn_above)) wattron(input->win, COLOR_PAIR(2));
-  else if (input->crit_below && (*input->vallast < *input->crit_below)) wattron(input->win, COLOR_PAIR(3));
-  else if (input->warn_below && (*input->vallast < *input->warn_below)) wattron(input->win, COLOR_PAIR(2));
-  mvwaddstr(input->win, 1, 8, format_float(input, *input->vallast));
+  if (input->crit_above && (input->vallast > *input->crit_above)) wattron(input->win, COLOR_PAIR(3));
+  else if (input->warn_above && (input->vallast > *input->warn_above)) wattron(input->win, COLOR_PAIR(2));
+  else if (input->crit_below && (input->vallast < *input->crit_below)) wattron(input->win, COLOR_PAIR(3));
+  else if (input->warn_below && (input->vallast < *input->warn_below)) wattron(input->win, COLOR_PAIR(2));
+  mvwaddstr(input->win, 1, 8, format_float(input, input->vallast));
   wattron(input->win, COLOR_PAIR(1));
 
   for (n = 0; n < settings.nsummaries; n++) {
+    if (!settings.summaries[n]) { // Sliding window column, kept in memory
+      if (input->stats.n) update_summary(input, 7+(n*7), input->stats.n, input->stats.mean, stats_min(&input->stats), stats_max(&input->stats));
+      continue;
+    }
     if (input->valcnt%(block_width()-8+n)) continue;
 
-    sqlite3_prepare_v2(settings.sqlitehandle, "SELECT COUNT(*), AVG(value), MIN(value), MAX(value) FROM data WHERE input = ?001 AND ts > ?002 AND ts <= ?003", 110, &stmt, NULL);
+    if (settings.tsdbdir) { // Chunks entirely within the window are aggregated from the index alone
+      double sum, dmin, dmax;
+
+      if (!tsdb_aggregate(input->sqlid, (now-settings.summaries[n])*1000LL, (now-(n?settings.summaries[n-1]:0))*1000LL, &cnt, &sum, &dmin, &dmax) && cnt) {
+        update_summary(input, 7+(n*7), cnt, sum/cnt, dmin, dmax);
+      }
+      continue;
+    }
+
+    // Use the coarsest rollup with at least 10 buckets in the window; the table is missing on databases
+    // that the daemon hasn't upgraded yet, in which case all summaries are taken from the raw data
+    for (i = ROLLUPS-1; (i >= 0) && (rollups[i]*10 > settings.summaries[n]-(n?settings.summaries[n-1]:0)); i--);
+    if ((i >= 0) && !norollup) query = "SELECT SUM(cnt), SUM(sum)/SUM(cnt), MIN(min), MAX(max) FROM rollup WHERE input = ?001 AND span = ?004 AND ts > ?002 AND ts <= ?003";
+    else query = "SELECT COUNT(*), AVG(value), MIN(value), MAX(value) FROM data WHERE input = ?001 AND ts > ?002 AND ts <= ?003";
+    sqlite3_prepare_v2(settings.sqlitehandle, query, -1, &stmt, NULL);
+    if (!stmt && (i >= 0) && !norollup) {
+      norollup = 1;
+      n--;
+      continue;
+    }
     if (!stmt) {
       fprintf(stderr, "Error preparing summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       continue;
@@ -137,14 +162,18 @@ void update_block(input_t *input) {
       fprintf(stderr, "Error binding param 1 for summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       continue;
     }
-    if (sqlite3_bind_int(stmt, 2, now-settings.summaries[n]) != SQLITE_OK) {
+    if (sqlite3_bind_int64(stmt, 2, (now-settings.summaries[n])*1000LL) != SQLITE_OK) {
       fprintf(stderr, "Error binding param 2 for summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       continue;
     }
-    if (sqlite3_bind_int(stmt, 3, now-(n?settings.summaries[n-1]:0)) != SQLITE_OK) {
+    if (sqlite3_bind_int64(stmt, 3, (now-(n?settings.summaries[n-1]:0))*1000LL) != SQLITE_OK) {
       fprintf(stderr, "Error binding param 3 for summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       continue;
     }
+    if ((i >= 0) && !norollup && (sqlite3_bind_int(stmt, 4, rollups[i]) != SQLITE_OK)) {
+      fprintf(stderr, "Error binding param 4 for summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
+      continue;
+    }
     if (sqlite3_step(stmt) != SQLITE_ROW) {
       fprintf(stderr, "Error reading row from summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       continue;
@@ -153,10 +182,10 @@ void update_block(input_t *input) {
       fprintf(stderr, "Invalid column count from summaries query: %s\n", sqlite3_errmsg(settings.sqlitehandle));
       continue;
     }
-    cnt = (float)sqlite3_column_double(stmt, 0);
-    avg = (float)sqlite3_column_double(stmt, 1);
-    min = (float)sqlite3_column_double(stmt, 2);
-    max = (float)sqlite3_column_double(stmt, 3);
+    cnt = sqlite3_column_int(stmt, 0);
+    avg = sqlite3_column_double(stmt, 1);
+    min = sqlite3_column_double(stmt, 2);
+    max = sqlite3_column_double(stmt, 3);
     sqlite3_finalize(stmt);
 
     if (cnt) update_summary(input, 7+(n*7), cnt, avg, min, max);
@@ -168,7 +197,7 @@ void update_block(input_t *input) {
   refresh();
 }
 
-void update_summary(input_t *input, int offset, int cnt, float avg, float min, float max) {
+void update_summary(input_t *input, int offset, int cnt, double avg, double min, double max) {
   if (input->crit_above && (avg > *input->crit_above)) wattron(input->win, COLOR_PAIR(3));
   else if (input->warn_above && (avg > *input->warn_above)) wattron(input->win, COLOR_PAIR(2));
   else if (input->crit_below && (avg < *input->crit_below)) wattron(input->win, COLOR_PAIR(3));
@@ -191,15 +220,13 @@ void update_summary(input_t *input, int offset, int cnt, float avg, float min, f
 
 void update_plot(input_t *input) {
   int row, col, i, top = block_height()-8;
-  float *p, min = FLT_MAX, max = FLT_MIN;
-
-  p = input->vallast;
-  for (col = VALUE_HIST_SIZE; col > 0 && input->valcnt-(VALUE_HIST_SIZE-col) > 0; col--) {
-    if (*p < min) min = *p;
-    if (*p > max) max = *p;
+  float p, min = FLT_MAX, max = FLT_MIN;
+  hist_iter it;
 
-    if (p == input->valhist) p = input->valhist+VALUE_HIST_SIZE-1;
-    else p--;
+  hist_iter_init(&it, input);
+  for (col = block_width()-10; col >= 0 && hist_iter_next(&it, &p); col--) { // Scaled to the values that are drawn
+    if (p < min) min = p;
+    if (p > max) max = p;
   }
 
   if (max-min < 0.001) {
@@ -234,16 +261,14 @@ void update_plot(input_t *input) {
     wmove(input->win, top+row, 7);
     for (i = block_width()-9; i; i--) waddch(input->win, ' ');
   }
-  p = input->vallast;
-  for (col = block_width()-10; col >= 0 && input->valcnt-(block_width()-10-col) > 0; col--) {
-    if (input->crit_above && (*p > *input->crit_above)) wattron(input->win, COLOR_PAIR(3));
-    else if (input->warn_above && (*p > *input->warn_above)) wattron(input->win, COLOR_PAIR(2));
-    else if (input->crit_below && (*p < *input->crit_below)) wattron(input->win, COLOR_PAIR(3));
-    else if (input->warn_below && (*p < *input->warn_below)) wattron(input->win, COLOR_PAIR(2));
-    draw_column(input, top, col, min, (int)((*p-min)/(max-min)*12+0.5));
+  hist_iter_init(&it, input);
+  for (col = block_width()-10; col >= 0 && hist_iter_next(&it, &p); col--) {
+    if (input->crit_above && (p > *input->crit_above)) wattron(input->win, COLOR_PAIR(3));
+    else if (input->warn_above && (p > *input->warn_above)) wattron(input->win, COLOR_PAIR(2));
+    else if (input->crit_below && (p < *input->crit_below)) wattron(input->win, COLOR_PAIR(3));
+    else if (input->warn_below && (p < *input->warn_below)) wattron(input->win, COLOR_PAIR(2));
+    draw_column(input, top, col, min, (int)((p-min)/(max-min)*12+0.5));
     wattron(input->win, COLOR_PAIR(1));
-    if (p == input->valhist) p = input->valhist+VALUE_HIST_SIZE-1;
-    else p--;
   }
 }
 
@@ -270,7 +295,7 @@ void draw_column(input_t *input, int top, int col, float min, int level) {
   }
 }
 
-char *format_float(input_t *input, float fl) {
+char *format_float(input_t *input, double fl) {
   static char buf[6]; // One bigger than the number of characters, because the symbol for micro is a multibyte character
   char tmpbuf[6];
   int exp = 0, i;
@@ -0,0 +1,193 @@
+int outbox_open(void);
+int outbox_write(const char *, int);
+int outbox_read(char *, int);
+void outbox_commit(void);
+int outbox_empty(void);
+unsigned long long outbox_seq(void);
+int outbox_segment(unsigned long long, int);
+void outbox_drop(void);
+void outbox_save(void);
+
+// Disk-backed outbox for the uplink: when the socket writer has no room left for samples because the
+// uplink is down or slow, it appends the formatted lines to numbered segment files instead of waiting,
+// and sends them in order once it can. The cursor file holds the segment and offset up to which lines
+// were written to the uplink, so the outbox survives a restart too. Segments are removed once sent,
+// and the oldest ones are dropped when the outbox would grow beyond its size cap.
+
+static int outbox_wfd = -1, outbox_rfd = -1, outbox_cfd = -1;
+static unsigned long long outbox_wseg, outbox_rseg, outbox_cseg; // Segments being written, read and sent
+static long long outbox_wpos, outbox_rpos, outbox_cpos;
+static unsigned long long outbox_nextseq, outbox_seqmax; // Sequence numbers are reserved in blocks
+
+int outbox_filter(const struct dirent *ent) {
+  return (strlen(ent->d_name) == 24) && !strcmp(ent->d_name+20, ".seg");
+}
+
+int outbox_open(void) {
+  struct dirent **list;
+  struct stat st;
+  unsigned long long seg, first = 0;
+  char buf[PATH_MAX];
+  int i, n;
+
+  if (mkdir(settings.outboxdir, 0700) && (errno != EEXIST)) {
+    error_log("Failed to create outbox directory '%s': %s\n", settings.outboxdir, strerror(errno));
+    return -1;
+  }
+  snprintf(buf, sizeof(buf), "%s/cursor", settings.outboxdir);
+  if ((outbox_cfd = open(buf, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1) {
+    error_log("Failed to open outbox cursor '%s': %s\n", buf, strerror(errno));
+    return -1;
+  }
+  if (((n = pread(outbox_cfd, buf, sizeof(buf)-1, 0)) <= 0) || (buf[n] = '\0', sscanf(buf, "%llu %lld %llu", &outbox_cseg, &outbox_cpos, &outbox_seqmax) != 3)) {
+    outbox_cseg = outbox_cpos = outbox_seqmax = 0;
+  }
+  outbox_nextseq = outbox_seqmax+1;
+
+  if ((n = scandir(settings.outboxdir, &list, outbox_filter, alphasort)) == -1) {
+    error_log("Failed to read outbox directory '%s': %s\n", settings.outboxdir, strerror(errno));
+    return -1;
+  }
+  settings.outboxsize = 0;
+  for (i = 0; i < n; i++) { // In order of segment number
+    seg = strtoull(list[i]->d_name, NULL, 10);
+    snprintf(buf, sizeof(buf), "%s/%s", settings.outboxdir, list[i]->d_name);
+    if (seg < outbox_cseg) unlink(buf); // Sent, but not yet removed before the last exit
+    else {
+      if (!stat(buf, &st)) settings.outboxsize += st.st_size;
+      if (!first) first = seg;
+      outbox_wseg = seg;
+    }
+    free(list[i]);
+  }
+  free(list);
+  if (!first) {
+    outbox_cseg = outbox_wseg = outbox_cseg?outbox_cseg:1;
+    outbox_cpos = 0;
+  }
+  else if (first != outbox_cseg) { // The segment with the cursor was dropped
+    outbox_cseg = first;
+    outbox_cpos = 0;
+  }
+
+  if ((outbox_wfd = outbox_segment(outbox_wseg, O_WRONLY|O_CREAT|O_APPEND)) == -1) return -1;
+  outbox_wpos = fstat(outbox_wfd, &st)?0:st.st_size;
+  if ((outbox_cseg == outbox_wseg) && (outbox_cpos > outbox_wpos)) outbox_cpos = outbox_wpos;
+  outbox_rseg = outbox_cseg;
+  outbox_rpos = outbox_cpos;
+  outbox_save();
+  if (!outbox_empty() && settings.verbose) printf("Outbox %s holds %lld bytes to send to the uplink\n", settings.outboxdir, settings.outboxsize-outbox_cpos);
+  return 0;
+}
+
+int outbox_segment(unsigned long long seg, int flags) {
+  char path[PATH_MAX];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%020llu.seg", settings.outboxdir, seg);
+  if (flags == -1) return unlink(path);
+  if (((fd = open(path, flags|O_CLOEXEC, 0600)) == -1) && (errno != ENOENT)) error_log("Failed to open outbox segment '%s': %s\n", path, strerror(errno));
+  return fd;
+}
+
+int outbox_write(const char *buf, int len) { // Takes whole lines; returns -1 if they couldn't be stored
+  if ((outbox_wpos+len > OUTBOX_SEGMENT_SIZE) && outbox_wpos) {
+    close(outbox_wfd);
+    if ((outbox_wfd = outbox_segment(++outbox_wseg, O_WRONLY|O_CREAT|O_APPEND|O_TRUNC)) == -1) {
+      settings.outboxdropped += len;
+      return -1;
+    }
+    outbox_wpos = 0;
+  }
+  while ((settings.outboxsize+len > settings.outboxmax) && (outbox_cseg < outbox_wseg)) outbox_drop();
+  if (write(outbox_wfd, buf, len) != len) {
+    error_log("Failed to write to outbox '%s': %s\n", settings.outboxdir, strerror(errno));
+    if (ftruncate(outbox_wfd, outbox_wpos)) outbox_wpos = lseek(outbox_wfd, 0, SEEK_END); // Keep only whole lines
+    settings.outboxdropped += len;
+    return -1;
+  }
+  outbox_wpos += len;
+  settings.outboxsize += len;
+  settings.outboxspilled += len;
+  return 0;
+}
+
+void outbox_drop(void) { // Removes the oldest segment, sent or not
+  struct stat st;
+  int fd = outbox_segment(outbox_cseg, O_RDONLY);
+
+  if ((fd != -1) && !fstat(fd, &st)) {
+    settings.outboxsize -= st.st_size;
+    settings.outboxdropped += st.st_size-outbox_cpos;
+  }
+  if (fd != -1) close(fd);
+  outbox_segment(outbox_cseg, -1);
+  if (outbox_rseg == outbox_cseg) {
+    if (outbox_rfd != -1) close(outbox_rfd);
+    outbox_rfd = -1;
+    outbox_rseg++;
+    outbox_rpos = 0;
+  }
+  outbox_cseg++;
+  outbox_cpos = 0;
+  outbox_save();
+  error_log("Outbox '%s' is full; dropped its oldest segment\n", settings.outboxdir);
+}
+
+int outbox_read(char *buf, int size) { // Returns the number of bytes read, always whole lines
+  int n;
+
+  while ((outbox_rseg < outbox_wseg) || (outbox_rpos < outbox_wpos)) {
+    if ((outbox_rfd == -1) && ((outbox_rfd = outbox_segment(outbox_rseg, O_RDONLY)) == -1)) n = 0;
+    else if ((n = pread(outbox_rfd, buf, size, outbox_rpos)) == -1) {
+      error_log("Failed to read from outbox '%s': %s\n", settings.outboxdir, strerror(errno));
+      n = 0;
+    }
+    if (n > 0) {
+      while (n && (buf[n-1] != '\n')) n--;
+      outbox_rpos += n;
+      return n;
+    }
+    if (outbox_rseg == outbox_wseg) break;
+    if (outbox_rfd != -1) close(outbox_rfd);
+    outbox_rfd = -1;
+    outbox_rseg++;
+    outbox_rpos = 0;
+  }
+  return 0;
+}
+
+void outbox_commit(void) { // Called once everything read so far was written to the uplink
+  struct stat st;
+  int fd;
+
+  while (outbox_cseg < outbox_rseg) {
+    if ((fd = outbox_segment(outbox_cseg, O_RDONLY)) != -1) {
+      if (!fstat(fd, &st)) settings.outboxsize -= st.st_size;
+      close(fd);
+      outbox_segment(outbox_cseg, -1);
+    }
+    outbox_cseg++;
+  }
+  outbox_cpos = outbox_rpos;
+  outbox_save();
+}
+
+int outbox_empty(void) { // Returns 1 if all lines were read
+  return (outbox_rseg == outbox_wseg) && (outbox_rpos == outbox_wpos);
+}
+
+unsigned long long outbox_seq(void) {
+  if (outbox_nextseq > outbox_seqmax) { // Reserve the next block before using it, so numbers are never reused after a crash
+    outbox_seqmax = outbox_nextseq+OUTBOX_SEQ_BLOCK-1;
+    outbox_save();
+  }
+  return outbox_nextseq++;
+}
+
+void outbox_save(void) { // Fixed width, so the cursor file never needs truncating
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%020llu %020lld %020llu\n", outbox_cseg, outbox_cpos, outbox_seqmax);
+  if (pwrite(outbox_cfd, buf, strlen(buf), 0) == -1) error_log("Failed to write outbox cursor: %s\n", strerror(errno));
+}
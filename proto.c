@@ -0,0 +1,257 @@
+int proto_series(const char *, int, int *);
+int proto_len(struct uplink_rec *);
+int proto_encode(uplink_t *, struct uplink_rec *, char *);
+int proto_encode_lines(const char *, int, char *);
+int proto_sample(char *, int, long long, double, const char *, int);
+int proto_define(char *, int);
+int proto_frame(const char *, int, char *, int);
+void proto_sent(void);
+int proto_greeting(int *, char *, int);
+int proto_varint(char *, unsigned long long);
+int proto_getvarint(const char *, int, unsigned long long *);
+
+// Binary uplink protocol: the connection starts with PROTO_MAGIC, followed by frames of a 4-byte
+// compressed and a 4-byte uncompressed length (both big-endian) and a zlib stream. Uncompressed, a
+// frame holds the timestamp and sequence number its deltas start from, then messages of a type byte
+// and varint fields. Series are numbered, and their names are defined once per connection: all known
+// ones in the first frames, and new ones in the frame where they first appear. Timestamps are msec
+// deltas, and values that are whole numbers are sent as varints instead of 8-byte doubles.
+// The encoder state is per thread, as every uplink has its own socket writer and connection.
+
+static __thread char **proto_keys = NULL; // Series names by number, from 1
+static __thread int proto_nkeys = 0, proto_maxkeys = 0;
+static __thread int *proto_hash = NULL; // Open addressing table of series numbers
+static __thread unsigned int proto_hashsize = 0;
+static __thread long long proto_ts = 0, proto_basets = 0, proto_endts = 0; // Encoder state after the last message, at the
+static __thread unsigned long long proto_seq = 0, proto_baseseq = 0, proto_endseq = 0; // start of the buffer and after the frame
+static __thread z_stream proto_zs;
+static __thread int proto_zinit = 0;
+
+int proto_series(const char *key, int len, int *created) { // Returns the number of the series, or 0 if out of memory
+  unsigned int i, mask = proto_hashsize-1;
+  unsigned long long h;
+  char *name;
+
+  *created = 0;
+  if (proto_nkeys*2 >= (int)proto_hashsize) { // Grow the table, keeping it at most half full
+    unsigned int size = proto_hashsize?proto_hashsize*2:1024;
+    int *hash = (int *)calloc(size, sizeof(int)), n;
+    if (!hash) return 0;
+    for (n = 1; n <= proto_nkeys; n++) {
+      for (i = hash_str(proto_keys[n])&(size-1); hash[i]; i = (i+1)&(size-1));
+      hash[i] = n;
+    }
+    free(proto_hash);
+    proto_hash = hash;
+    proto_hashsize = size;
+    mask = size-1;
+  }
+  if (!(name = strndup(key, len))) return 0;
+  h = hash_str(name);
+  for (i = h&mask; proto_hash[i]; i = (i+1)&mask) {
+    if (!strcmp(proto_keys[proto_hash[i]], name)) {
+      free(name);
+      return proto_hash[i];
+    }
+  }
+  if (proto_nkeys+1 >= proto_maxkeys) {
+    int max = proto_maxkeys?proto_maxkeys*2:1024;
+    char **keys = (char **)realloc(proto_keys, max*sizeof(char *));
+    if (!keys) {
+      free(name);
+      return 0;
+    }
+    proto_keys = keys;
+    proto_maxkeys = max;
+  }
+  proto_keys[++proto_nkeys] = name;
+  proto_hash[i] = proto_nkeys;
+  *created = 1;
+  return proto_nkeys;
+}
+
+int proto_len(struct uplink_rec *rec) { // Upper bound of the encoded length
+  return strlen(uplink_key(rec->input))+(rec->sketch?strlen(rec->sketch):0)+60;
+}
+
+int proto_encode(uplink_t *up, struct uplink_rec *rec, char *buf) {
+  input_t *input = rec->input;
+  char *key = uplink_key(input);
+  int len = 0, created, id;
+  unsigned long long seq;
+
+  if ((settings.nuplinks > 1) && (input->uplinkshard != up->id+1)) { // Failed over; the number is only kept for its own uplink
+    if (!(id = proto_series(key, strlen(key), &created))) return 0;
+    if (created) len += proto_define(buf, id);
+  }
+  else if (!(id = input->uplinkid)) {
+    if (!(id = input->uplinkid = proto_series(key, strlen(key), &created))) return 0;
+    if (created) len += proto_define(buf, id);
+  }
+  if (settings.uplinkseq) {
+    if ((seq = outbox_seq()) != proto_seq+1) {
+      buf[len++] = PROTO_SEQ;
+      len += proto_varint(buf+len, seq);
+    }
+    proto_seq = seq;
+  }
+  return len+proto_sample(buf+len, id, rec->ts, rec->val, rec->sketch, rec->sketch?strlen(rec->sketch):0);
+}
+
+// Encodes lines in the text format, as read back from the outbox; returns the encoded length, which
+// for lines with epoch timestamps is less than three times the length of the lines
+int proto_encode_lines(const char *lines, int size, char *buf) {
+  const char *line, *end, *val, *ts;
+  char *cp;
+  int len = 0, id, created;
+  long long msec;
+  unsigned long long seq;
+  double fl;
+
+  for (line = lines; line < lines+size; line = end+1) {
+    if (!(end = memchr(line, '\n', lines+size-line))) break;
+    if (!(val = memchr(line, ' ', end-line)) || !(ts = memchr(val+1, ' ', end-val-1))) continue;
+    msec = strtoll(ts+1, &cp, 10)*1000;
+    if (*cp == '.') msec += strtol(cp+1, &cp, 10);
+    seq = (*cp == ' ')?strtoull(cp+1, NULL, 10):0;
+    if (!(id = proto_series(line, val-line, &created))) continue;
+    if (created) len += proto_define(buf+len, id);
+    if (seq) {
+      if (seq != proto_seq+1) {
+        buf[len++] = PROTO_SEQ;
+        len += proto_varint(buf+len, seq);
+      }
+      proto_seq = seq;
+    }
+    if (!strncmp(val+1, "hll:", 4)) len += proto_sample(buf+len, id, msec, 0, val+5, ts-val-5);
+    else {
+      fl = strtod(val+1, NULL);
+      len += proto_sample(buf+len, id, msec, fl, NULL, 0);
+    }
+  }
+  return len;
+}
+
+int proto_sample(char *buf, int id, long long ts, double fl, const char *sketch, int slen) {
+  long long dts = ts-proto_ts, n = (long long)fl;
+  int len = 1;
+
+  proto_ts = ts;
+  len += proto_varint(buf+len, id);
+  len += proto_varint(buf+len, ((unsigned long long)dts<<1)^(dts>>63)); // Zigzag, as samples needn't be in time order
+  if (sketch) {
+    buf[0] = PROTO_SKETCH;
+    len += proto_varint(buf+len, slen);
+    memcpy(buf+len, sketch, slen);
+    return len+slen;
+  }
+  if (((double)n == fl) && (n < (1LL<<53)) && (n > -(1LL<<53))) {
+    buf[0] = PROTO_INT;
+    return len+proto_varint(buf+len, ((unsigned long long)n<<1)^(n>>63));
+  }
+  buf[0] = PROTO_DOUBLE;
+  memcpy(buf+len, &fl, sizeof(double)); // Little-endian, like every host anystat runs on
+  return len+sizeof(double);
+}
+
+int proto_define(char *buf, int id) {
+  int len = 1, klen = strlen(proto_keys[id]);
+
+  buf[0] = PROTO_DEFINE;
+  len += proto_varint(buf+len, id);
+  len += proto_varint(buf+len, klen);
+  memcpy(buf+len, proto_keys[id], klen);
+  return len+klen;
+}
+
+int proto_varint(char *buf, unsigned long long n) { // LEB128: 7 bits per byte, low bits first
+  int len = 0;
+
+  while (n >= 0x80) {
+    buf[len++] = (n&0x7f)|0x80;
+    n >>= 7;
+  }
+  buf[len++] = n;
+  return len;
+}
+
+int proto_getvarint(const char *buf, int size, unsigned long long *n) { // Returns the number of bytes read, or 0 if cut off
+  int len = 0, shift = 0;
+
+  *n = 0;
+  while ((len < size) && (shift < 64)) {
+    *n |= (unsigned long long)(buf[len]&0x7f)<<shift;
+    if (!(buf[len++]&0x80)) return len;
+    shift += 7;
+  }
+  return 0;
+}
+
+// Compresses a buffer of messages into a frame; returns its length, or -1 on failure. The frame
+// starts from the encoder state at the start of the buffer, which moves to the end of it once the
+// frame is sent (proto_sent()), so a frame that was cut off can be encoded again unchanged.
+int proto_frame(const char *raw, int len, char *buf, int size) {
+  char hdr[20];
+  int hlen = 0, zlen;
+
+  if (!proto_zinit) {
+    memset(&proto_zs, 0, sizeof(proto_zs));
+    if (deflateInit(&proto_zs, settings.uplinklevel) != Z_OK) return -1;
+    proto_zinit = 1;
+  }
+  else deflateReset(&proto_zs);
+  hlen += proto_varint(hdr+hlen, proto_basets);
+  hlen += proto_varint(hdr+hlen, proto_baseseq);
+  proto_zs.next_in = (unsigned char *)hdr;
+  proto_zs.avail_in = hlen;
+  proto_zs.next_out = (unsigned char *)buf+8;
+  proto_zs.avail_out = size-8;
+  if (deflate(&proto_zs, Z_NO_FLUSH) != Z_OK) return -1;
+  proto_zs.next_in = (unsigned char *)raw;
+  proto_zs.avail_in = len;
+  if (deflate(&proto_zs, Z_FINISH) != Z_STREAM_END) return -1;
+  zlen = size-8-proto_zs.avail_out;
+  len += hlen;
+  buf[0] = zlen>>24; buf[1] = zlen>>16; buf[2] = zlen>>8; buf[3] = zlen;
+  buf[4] = len>>24; buf[5] = len>>16; buf[6] = len>>8; buf[7] = len;
+  proto_endts = proto_ts;
+  proto_endseq = proto_seq;
+  return zlen+8;
+}
+
+void proto_sent(void) {
+  proto_basets = proto_endts;
+  proto_baseseq = proto_endseq;
+}
+
+// Builds the next part of the greeting for a new connection into buf: the magic, the sender's name
+// when sequence numbers are used, and the definitions of all known series, in frames of at most
+// UPLINK_BUF_SIZE uncompressed bytes. Sets *next to -1 after the last part.
+int proto_greeting(int *next, char *buf, int size) {
+  static __thread char raw[UPLINK_BUF_SIZE];
+  char name[HOST_NAME_MAX+1] = "";
+  int len = 0, hlen = 0, r;
+
+  if (!*next) {
+    memcpy(buf, PROTO_MAGIC, hlen = strlen(PROTO_MAGIC));
+    if (settings.uplinkseq) {
+      if (settings.uplinkprefix) strncat(name, settings.uplinkprefix, HOST_NAME_MAX);
+      else if (gethostname(name, HOST_NAME_MAX)) strcpy(name, "anystat");
+      raw[len++] = PROTO_HELLO;
+      len += proto_varint(raw+len, strlen(name));
+      memcpy(raw+len, name, strlen(name));
+      len += strlen(name);
+    }
+    *next = 1;
+  }
+  for (; *next <= proto_nkeys; (*next)++) {
+    if (len+strlen(proto_keys[*next])+11 > UPLINK_BUF_SIZE) break;
+    len += proto_define(raw+len, *next);
+  }
+  if (*next > proto_nkeys) *next = -1;
+  if (!len) return hlen;
+  r = proto_frame(raw, len, buf+hlen, size-hlen);
+  proto_endts = proto_basets; // The greeting has no samples, so the data frames' base stays put
+  proto_endseq = proto_baseseq;
+  return r == -1?-1:hlen+r;
+}
@@ -0,0 +1,103 @@
+int ring_init(ring *, unsigned int, unsigned int);
+int ring_push(ring *, const void *);
+void ring_put(ring *, const void *);
+unsigned int ring_pop(ring *, void *, unsigned int);
+int ring_wait(ring *, int);
+int ring_poll(ring *, struct pollfd *, int, int);
+void ring_wake(ring *);
+
+// Lock-free single-producer/single-consumer queue of fixed size records between the main thread and
+// a writer thread. The producer only writes head and the consumer only writes tail, so a push or pop
+// is a copy and one atomic store. A consumer that runs out of work sets 'waiting' and sleeps on an
+// eventfd; the producer only makes the wakeup syscall when it finds that flag set, so while the
+// consumer is busy, samples pass through without any syscalls at all.
+
+int ring_init(ring *r, unsigned int count, unsigned int recsize) {
+  r->size = 1;
+  while (r->size < count) r->size <<= 1; // Power of two, so positions wrap with a mask
+  r->recsize = recsize;
+  r->head = r->tail = 0;
+  r->waiting = 0;
+  r->full = 0;
+  if (!(r->buf = (char *)malloc((size_t)r->size*recsize))) return -1;
+  if ((r->efd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    free(r->buf);
+    return -1;
+  }
+  return 0;
+}
+
+int ring_push(ring *r, const void *rec) { // Returns -1 if the ring is full
+  unsigned long long head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  unsigned long long one = 1;
+
+  if (head-__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size) return -1;
+  memcpy(r->buf+(head&(r->size-1))*r->recsize, rec, r->recsize);
+  __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // Pairs with the fence in ring_wait()
+  if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&r->waiting, 0, __ATOMIC_RELAXED)) {
+    if (write(r->efd, &one, sizeof(one)) != sizeof(one)) return 0; // The consumer wakes up on its timeout
+  }
+  return 0;
+}
+
+void ring_put(ring *r, const void *rec) { // Waits for room like a write on a full pipe would
+  unsigned long long one = 1;
+
+  if (!ring_push(r, rec)) return;
+  r->full++;
+  do {
+    if (write(r->efd, &one, sizeof(one)) != sizeof(one)) usleep(1000);
+    usleep(1000);
+  } while (ring_push(r, rec));
+}
+
+unsigned int ring_pop(ring *r, void *recs, unsigned int max) { // Returns the number of records copied
+  unsigned long long tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  unsigned long long avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)-tail;
+  unsigned int n, pos, first;
+
+  n = avail<max?avail:max;
+  if (!n) return 0;
+  pos = tail&(r->size-1);
+  first = r->size-pos<n?r->size-pos:n; // Copy in up to two parts when wrapping around
+  memcpy(recs, r->buf+(size_t)pos*r->recsize, (size_t)first*r->recsize);
+  if (n > first) memcpy((char *)recs+(size_t)first*r->recsize, r->buf, (size_t)(n-first)*r->recsize);
+  __atomic_store_n(&r->tail, tail+n, __ATOMIC_RELEASE);
+  return n;
+}
+
+int ring_wait(ring *r, int timeout) { // Returns 1 if there are records, 0 on timeout; timeout in msec or -1
+  return ring_poll(r, NULL, 0, timeout);
+}
+
+// Like ring_wait(), but also returns when one of the up to RING_POLL_MAX other descriptors is ready,
+// with their revents filled in as by poll()
+int ring_poll(ring *r, struct pollfd *fds, int nfds, int timeout) {
+  struct pollfd pfd[RING_POLL_MAX+1];
+  unsigned long long val;
+  int i;
+
+  for (i = 0; i < nfds; i++) fds[i].revents = 0;
+  if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&r->tail, __ATOMIC_RELAXED)) return 1;
+  if (!timeout && !nfds) return 0;
+  pfd[0].fd = r->efd;
+  pfd[0].events = POLLIN;
+  for (i = 0; (i < nfds) && (i < RING_POLL_MAX); i++) pfd[i+1] = fds[i];
+  __atomic_store_n(&r->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // Either the producer sees 'waiting' or we see its record
+  if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_RELAXED)) {
+    if (poll(pfd, i+1, timeout) > 0) {
+      if ((pfd[0].revents & POLLIN) && (read(r->efd, &val, sizeof(val)) != sizeof(val))) val = 0;
+      for (i = 0; i < nfds; i++) fds[i].revents = pfd[i+1].revents;
+    }
+  }
+  __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+void ring_wake(ring *r) { // Wakes up the consumer for work that isn't in the ring
+  unsigned long long one = 1;
+
+  if (write(r->efd, &one, sizeof(one)) != sizeof(one)) return; // The consumer wakes up on its timeout
+}
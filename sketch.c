@@ -0,0 +1,217 @@
+unsigned long long hash_str(const char *);
+unsigned long long hash_mix(unsigned long long);
+int histogram_bucket(histogram *, float);
+void hll_add(hll *, const char *);
+double hll_estimate(hll *);
+void hll_merge(hll *, hll *);
+int hll_encode(hll *, char *, int);
+int hll_decode(hll *, const char *);
+
+static const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+unsigned long long hash_str(const char *str) { // FNV-1a with the MurmurHash3 finalizer for better bit dispersion
+  unsigned long long h = 0xcbf29ce484222325ULL;
+
+  while (*str) {
+    h ^= (unsigned char)*str++;
+    h *= 0x100000001b3ULL;
+  }
+  return hash_mix(h);
+}
+
+unsigned long long hash_mix(unsigned long long h) { // MurmurHash3 finalizer
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// HyperLogLog distinct counter: the top HLL_PRECISION bits of the hash select a register,
+// which keeps the highest position of the first set bit seen in the remaining bits
+
+void hll_add(hll *sketch, const char *str) {
+  unsigned long long h = hash_str(str);
+  unsigned int idx = h >> (64-HLL_PRECISION);
+  unsigned char rank = __builtin_clzll((h << HLL_PRECISION) | (1ULL << (HLL_PRECISION-1)))+1;
+
+  if (sketch->reg[idx] < rank) sketch->reg[idx] = rank;
+}
+
+double hll_estimate(hll *sketch) {
+  int i, zeros = 0;
+  double sum = 0, est;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -sketch->reg[i]);
+    if (!sketch->reg[i]) zeros++;
+  }
+  est = 0.7213/(1+1.079/HLL_REGISTERS)*HLL_REGISTERS*HLL_REGISTERS/sum;
+  if ((est <= 2.5*HLL_REGISTERS) && zeros) est = HLL_REGISTERS*log((double)HLL_REGISTERS/zeros); // Small range correction
+  return est;
+}
+
+void hll_merge(hll *dst, hll *src) {
+  int i;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    if (dst->reg[i] < src->reg[i]) dst->reg[i] = src->reg[i];
+  }
+}
+
+// Text encoding for the uplink: one base64 character per register (ranks never exceed 63),
+// with runs of four or more empty registers written as '*' followed by the run length and a '.'
+// Returns the encoded length, or -1 if the buffer is too small
+int hll_encode(hll *sketch, char *buf, int size) {
+  int i, run, len = 0;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    if (size-len < 8) return -1;
+    if (!sketch->reg[i]) {
+      for (run = 1; (i+run < HLL_REGISTERS) && !sketch->reg[i+run]; run++);
+      if (run >= 4) {
+        len += sprintf(buf+len, "*%d.", run);
+        i += run-1;
+        continue;
+      }
+    }
+    buf[len++] = b64chars[sketch->reg[i]];
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+int hll_decode(hll *sketch, const char *buf) {
+  int i = 0, run;
+  char *end;
+  const char *c;
+
+  while (*buf && (*buf != ' ') && (*buf != '\n')) {
+    if (*buf == '*') {
+      run = strtol(buf+1, &end, 10);
+      if ((end == buf+1) || (*end != '.') || (run <= 0) || (i+run > HLL_REGISTERS)) return -1;
+      memset(sketch->reg+i, 0, run);
+      i += run;
+      buf = end+1;
+      continue;
+    }
+    if ((i == HLL_REGISTERS) || !(c = strchr(b64chars, *buf))) return -1;
+    sketch->reg[i++] = c-b64chars;
+    buf++;
+  }
+  return i == HLL_REGISTERS?0:-1;
+}
+
+// DDSketch quantile estimator: values are counted in logarithmically sized buckets, so any
+// reported quantile is within DDS_ACCURACY of the true value relative to that value. Each store
+// holds a window of DDS_BINS consecutive buckets; when values fall outside the window the lowest
+// buckets are collapsed, which keeps the upper quantiles accurate and the memory use fixed.
+
+void dds_add(ddsketch *, double);
+double dds_quantile(ddsketch *, double);
+void dds_merge(ddsketch *, ddsketch *);
+void dds_clear(ddsketch *);
+void dds_store_add(dds_store *, int, unsigned int);
+void dds_store_shift(dds_store *, int);
+
+static double dds_gamma_ln = 0;
+
+int dds_index(double fl) {
+  if (!dds_gamma_ln) dds_gamma_ln = log((1+DDS_ACCURACY)/(1-DDS_ACCURACY));
+  return (int)ceil(log(fl)/dds_gamma_ln);
+}
+
+double dds_value(int idx) { // Midpoint of the bucket in relative terms
+  return 2*exp(idx*dds_gamma_ln)/(1+exp(dds_gamma_ln));
+}
+
+void dds_add(ddsketch *sketch, double fl) {
+  sketch->count++;
+  if (fl > DDS_MIN_VALUE) dds_store_add(&sketch->pos, dds_index(fl), 1);
+  else if (fl < -DDS_MIN_VALUE) dds_store_add(&sketch->neg, dds_index(-fl), 1);
+  else sketch->zero++;
+}
+
+void dds_store_add(dds_store *store, int idx, unsigned int n) {
+  if (!store->count) {
+    memset(store->bins, 0, sizeof(store->bins));
+    store->offset = idx-DDS_BINS/2;
+    store->min = store->max = idx;
+  }
+  if (idx >= store->offset+DDS_BINS) dds_store_shift(store, idx-DDS_BINS+1);
+  else if (idx < store->offset) {
+    if (store->max-idx < DDS_BINS) dds_store_shift(store, idx);
+    else idx = store->offset; // Out of range at the bottom: collapse into the lowest bucket
+  }
+  store->bins[idx-store->offset] += n;
+  store->count += n;
+  if (idx < store->min) store->min = idx;
+  if (idx > store->max) store->max = idx;
+}
+
+void dds_store_shift(dds_store *store, int offset) {
+  int i, d = offset-store->offset;
+  unsigned int sum = 0;
+
+  if (d > 0) { // Moving up; buckets that fall off the bottom are added to the new lowest one
+    for (i = 0; (i < d) && (i < DDS_BINS); i++) sum += store->bins[i];
+    if (d < DDS_BINS) memmove(store->bins, store->bins+d, (DDS_BINS-d)*sizeof(unsigned int));
+    memset(store->bins+(d<DDS_BINS?DDS_BINS-d:0), 0, (d<DDS_BINS?d:DDS_BINS)*sizeof(unsigned int));
+    store->bins[0] += sum;
+    if (store->min < offset) store->min = offset;
+  }
+  else if (d < 0) { // Moving down; only done when the highest bucket still fits
+    memmove(store->bins-d, store->bins, (DDS_BINS+d)*sizeof(unsigned int));
+    memset(store->bins, 0, -d*sizeof(unsigned int));
+  }
+  store->offset = offset;
+}
+
+double dds_quantile(ddsketch *sketch, double q) {
+  int i;
+  double rank;
+  unsigned long long n = 0;
+
+  if (!sketch->count) return 0;
+  rank = q*(sketch->count-1);
+
+  if (sketch->neg.count) {
+    for (i = sketch->neg.max; i >= sketch->neg.min; i--) {
+      if ((n += sketch->neg.bins[i-sketch->neg.offset]) > rank) return -dds_value(i);
+    }
+  }
+  if ((n += sketch->zero) > rank) return 0;
+  for (i = sketch->pos.min; i <= sketch->pos.max; i++) {
+    if ((n += sketch->pos.bins[i-sketch->pos.offset]) > rank) return dds_value(i);
+  }
+  return dds_value(sketch->pos.max);
+}
+
+void dds_merge(ddsketch *dst, ddsketch *src) {
+  int i;
+
+  for (i = src->pos.min; src->pos.count && (i <= src->pos.max); i++) {
+    if (src->pos.bins[i-src->pos.offset]) dds_store_add(&dst->pos, i, src->pos.bins[i-src->pos.offset]);
+  }
+  for (i = src->neg.min; src->neg.count && (i <= src->neg.max); i++) {
+    if (src->neg.bins[i-src->neg.offset]) dds_store_add(&dst->neg, i, src->neg.bins[i-src->neg.offset]);
+  }
+  dst->zero += src->zero;
+  dst->count += src->count;
+}
+
+void dds_clear(ddsketch *sketch) { // Bins are reset on the next add
+  sketch->pos.count = sketch->neg.count = 0;
+  sketch->zero = sketch->count = 0;
+}
+
+// Fixed-bucket histogram: the bucket is found with a binary search over the padded bounds array
+// that compiles to conditional moves instead of branches, so lookups cost the same log2(size)
+// steps for every value and never mispredict. Values above the last bound land in bucket nbounds.
+int histogram_bucket(histogram *hist, float fl) {
+  int idx = 0, step;
+
+  for (step = hist->size/2; step; step >>= 1) idx += (hist->bounds[idx+step-1] < fl)?step:0;
+  return idx;
+}
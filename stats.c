@@ -0,0 +1,89 @@
+void stats_add(win_stats *, unsigned int, double);
+void stats_deque_push(win_stats *, unsigned int *, unsigned int *, unsigned int *, int);
+double stats_ewma(win_stats *, double, double);
+double stats_stddev(win_stats *);
+double stats_min(win_stats *);
+double stats_max(win_stats *);
+
+// Sliding window statistics over the last <size> samples, all updated in O(1) per sample:
+// mean and variance with Welford's method (adding the new and removing the expired sample),
+// minimum and maximum with monotonic deques of positions in the sample ring, plus an EWMA
+// with the same span as the window
+
+void stats_add(win_stats *st, unsigned int size, double fl) {
+  double old, prevmean;
+  unsigned int pos;
+
+  if (!st->vals) { // Allocate on first use, like the value history
+    if (!size) return;
+    st->vals = (double *)malloc(size*sizeof(double));
+    st->minq = (unsigned int *)malloc(size*sizeof(unsigned int));
+    st->maxq = (unsigned int *)malloc(size*sizeof(unsigned int));
+    if (!st->vals || !st->minq || !st->maxq) {
+      free(st->vals);
+      free(st->minq);
+      free(st->maxq);
+      st->vals = NULL;
+      return;
+    }
+    st->size = size;
+    st->ewma = fl;
+  }
+  else st->ewma = stats_ewma(st, st->ewma, fl);
+
+  pos = st->seq++%st->size;
+  if (st->n < st->size) {
+    st->n++;
+    old = fl-st->mean;
+    st->mean += old/st->n;
+    st->m2 += old*(fl-st->mean);
+  }
+  else {
+    old = st->vals[pos];
+    prevmean = st->mean;
+    st->mean += (fl-old)/st->size;
+    st->m2 += (fl-old)*(fl-st->mean+old-prevmean);
+    if (st->m2 < 0) st->m2 = 0; // Rounding can push it just below zero
+  }
+  st->vals[pos] = fl;
+
+  stats_deque_push(st, st->minq, &st->minhead, &st->minlen, 0);
+  stats_deque_push(st, st->maxq, &st->maxhead, &st->maxlen, 1);
+}
+
+// The deques hold ring positions of samples in the window in order of arrival, and only those
+// samples that can still become the minimum (or maximum); the front is the current extreme
+void stats_deque_push(win_stats *st, unsigned int *q, unsigned int *head, unsigned int *len, int max) {
+  unsigned int pos = (st->seq-1)%st->size;
+  double fl = st->vals[pos], back;
+
+  if (*len && (q[*head] == pos)) { // Front sample just left the window (its slot was reused)
+    *head = (*head+1)%st->size;
+    (*len)--;
+  }
+  while (*len) {
+    back = st->vals[q[(*head+*len-1)%st->size]];
+    if (max?(back > fl):(back < fl)) break;
+    (*len)--;
+  }
+  q[(*head+*len)%st->size] = pos;
+  (*len)++;
+}
+
+double stats_ewma(win_stats *st, double avg, double fl) {
+  if (!st->size) return fl;
+  return avg+2.0/(st->size+1)*(fl-avg);
+}
+
+double stats_stddev(win_stats *st) {
+  if (st->n < 2) return 0;
+  return sqrt(st->m2/(st->n-1));
+}
+
+double stats_min(win_stats *st) {
+  return st->minlen?st->vals[st->minq[st->minhead]]:0;
+}
+
+double stats_max(win_stats *st) {
+  return st->maxlen?st->vals[st->maxq[st->maxhead]]:0;
+}
@@ -0,0 +1,126 @@
+void statsd_line(input_t *, char *);
+
+// Receiver for STATSD inputs: metrics arrive as "<name>:<value>|<type>[|@<rate>]" lines, one or more
+// per UDP datagram, and are taken from the socket in batches with recvmmsg(). Each name becomes a child
+// of the input, and its values are consolidated in memory until the end of the interval: counters (c)
+// are summed, gauges (g) keep their last value and may be changed by a signed amount, timers (ms, h, d)
+// use the consolidation function of the input (AVG if none), and sets (s) count distinct values.
+
+int statsd_open(input_t *input) {
+  struct sockaddr_in sa;
+  int fd, size = STATSD_RCVBUF;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(input->sock->port);
+  sa.sin_addr.s_addr = input->sock->addr;
+  if (((fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1)
+   || bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+    error_log("Input %s: failed to bind UDP socket on %s:%d: %s\n", input->name, inet_ntoa(sa.sin_addr), input->sock->port, strerror(errno));
+    return -1;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) error_log("Input %s: failed to set receive buffer size: %s\n", input->name, strerror(errno));
+  input->sock->fd = fd;
+  input->update = now;
+  if (settings.verbose) printf("Input %s receiving statsd metrics on %s:%d\n", input->name, inet_ntoa(sa.sin_addr), input->sock->port);
+  return 0;
+}
+
+void do_statsd(input_t *input) {
+  static char bufs[STATSD_BATCH][STATSD_DGRAM_MAX+1];
+  static struct iovec iovs[STATSD_BATCH];
+  static struct mmsghdr msgs[STATSD_BATCH];
+  char *buf, *line, *end;
+  int i, n, len, round;
+
+  if (!msgs[0].msg_hdr.msg_iov) {
+    for (i = 0; i < STATSD_BATCH; i++) {
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = STATSD_DGRAM_MAX;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  for (round = 0; round < STATSD_ROUNDS; round++) { // The socket stays readable if there's more
+    if ((n = recvmmsg(input->sock->fd, msgs, STATSD_BATCH, MSG_DONTWAIT, NULL)) <= 0) {
+      if ((n == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) error_log("Input %s: recvmmsg() failed: %s\n", input->name, strerror(errno));
+      return;
+    }
+    settings.statsdpackets += n;
+    for (i = 0; i < n; i++) {
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        settings.statsdinvalid++;
+        continue;
+      }
+      buf = bufs[i];
+      len = msgs[i].msg_len;
+      buf[len] = '\0';
+      for (line = buf; line < buf+len; line = end+1) {
+        if (!(end = memchr(line, '\n', buf+len-line))) end = buf+len;
+        *end = '\0';
+        if (end > line) statsd_line(input, line);
+      }
+    }
+    if (n < STATSD_BATCH) return;
+  }
+}
+
+void statsd_line(input_t *input, char *line) {
+  char *val, *type, *opt, *cp;
+  double fl, rate = 1;
+  input_t *child;
+
+  if ((cp = strchr(line, '\r'))) *cp = '\0';
+  if (!(val = strchr(line, ':')) || (val == line) || !(type = strchr(val+1, '|'))) {
+    settings.statsdinvalid++;
+    return;
+  }
+  *val++ = '\0';
+  *type++ = '\0';
+  for (opt = strchr(type, '|'); opt; opt = strchr(opt, '|')) { // Sample rate; tags are ignored
+    *opt++ = '\0';
+    if (*opt == '@') rate = strtod(opt+1, NULL);
+  }
+  if (!strcmp(type, "s")) {
+    if (!(child = listen_child(input, line))) return;
+    if (!child->hll && !(child->hll = (hll *)calloc(1, sizeof(hll)))) {
+      error_log("Failed to allocate memory for distinct counter on input %s\n", child->name);
+      return;
+    }
+    hll_add(child->hll, val);
+    settings.statsdmetrics++;
+    return;
+  }
+  fl = strtod(val, &cp);
+  if ((cp == val) || *cp || (strcmp(type, "c") && strcmp(type, "g") && strcmp(type, "ms") && strcmp(type, "h") && strcmp(type, "d"))) {
+    settings.statsdinvalid++;
+    return;
+  }
+  if (!(child = listen_child(input, line))) return;
+  if (*type == 'c') {
+    child->consol = CONSOL_SUM;
+    if ((rate > 0) && (rate < 1)) fl /= rate;
+  }
+  else if (*type == 'g') {
+    child->consol = CONSOL_LAST;
+    if ((*val == '+') || (*val == '-')) fl += child->consolcnt?child->consolsum:child->vallast;
+  }
+  else child->consol = input->consol?input->consol:CONSOL_AVG;
+  consolidate(child, fl);
+  settings.statsdmetrics++;
+}
+
+// Called once per interval: counters and sets are reported even when they had no samples, gauges and
+// timers only when they had
+void report_statsd(input_t *input) {
+  input_t *sub;
+
+  input->update = now;
+  for (sub = input->next; sub && sub->parent; sub = sub->next) {
+    if (sub->hll) report_distinct(sub);
+    else if ((sub->consol & CONSOL_SUM) || (sub->consolcnt && !(sub->consol & CONSOL_FIRST))) report_consol(sub);
+  }
+  if (settings.verbose) printf("Input %s: %llu datagrams with %llu metrics received, %llu invalid\n", input->name,
+                               settings.statsdpackets, settings.statsdmetrics, settings.statsdinvalid);
+}
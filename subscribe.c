@@ -0,0 +1,262 @@
+void sub_open(void);
+void sub_poll(void);
+void do_subscribe(void);
+void sub_accept(void);
+void sub_read(sub_client *);
+int sub_match(sub_client *, input_t *);
+void sub_emit(input_t *, long long, double);
+void sub_flush(void);
+int sub_write(sub_client *);
+void sub_close(sub_client *, const char *);
+
+// Live updates over a unix socket: a client sends glob patterns, one per line, which are matched
+// against the series names ("input" or "input.child"), and from then on every sample of a matching
+// series is pushed to it as process() emits it. Updates use the messages of the binary uplink
+// protocol, uncompressed: a DEFINE with the number and name of a series the first time the client
+// gets it, then INT or DOUBLE messages with that number, the msec delta to the previous update's
+// timestamp and the value. The messages emitted during one turn of the main loop go out together
+// as a frame (a 4-byte big-endian length and the messages), split when the queue must be written
+// out before the turn ends. Each client has its own bounded queue, and a client that lets it fill
+// up is dropped, so a slow reader never holds up the collection.
+
+static sub_client *sub_clients = NULL;
+static unsigned int sub_nextid = 1;
+
+void sub_open(void) {
+  struct sockaddr_un sun;
+  int fd;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, settings.subscribepath, sizeof(sun.sun_path)-1);
+  unlink(settings.subscribepath); // Left behind by an earlier run
+  if (((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1)
+   || bind(fd, (struct sockaddr *)&sun, sizeof(sun))
+   || listen(fd, SUB_CLIENTS_MAX)) {
+    error_log("Failed to listen on subscription socket %s: %s\n", settings.subscribepath, strerror(errno));
+    exit(-1);
+  }
+  settings.subscribefd = fd;
+}
+
+void sub_poll(void) {
+  sub_client *client;
+
+  if (!settings.subscribefd) return;
+  poll_add(settings.subscribefd, POLLIN);
+  for (client = sub_clients; client; client = client->next) {
+    poll_add(client->fd, client->sent < client->len?POLLIN|POLLOUT:POLLIN); // Written by sub_flush() after the loop
+  }
+}
+
+void do_subscribe(void) {
+  sub_client *client, *next;
+
+  if (!settings.subscribefd) return;
+  if (poll_ready(settings.subscribefd, POLLIN)) sub_accept();
+  for (client = sub_clients; client; client = next) {
+    next = client->next;
+    if (poll_ready(client->fd, POLLIN)) sub_read(client);
+  }
+}
+
+void sub_accept(void) {
+  sub_client *client;
+  int fd;
+
+  while ((fd = accept4(settings.subscribefd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1) {
+    if (settings.subclients == SUB_CLIENTS_MAX) {
+      error_log("Refused subscription client: too many clients\n");
+      close(fd);
+      continue;
+    }
+    if (!(client = (sub_client *)calloc(1, sizeof(sub_client)))) {
+      error_log("Failed to allocate memory for subscription client\n");
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->frame = -1;
+    client->next = sub_clients;
+    sub_clients = client;
+    settings.subclients++;
+    if (settings.verbose) printf("New subscription client (%d connected)\n", settings.subclients);
+  }
+  if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) error_log("Failed to accept subscription client: %s\n", strerror(errno));
+}
+
+void sub_read(sub_client *client) { // Takes the patterns the client sends
+  char *start, *end;
+  int n;
+
+  while ((n = read(client->fd, client->in+client->inlen, sizeof(client->in)-client->inlen-1)) > 0) {
+    client->inlen += n;
+    client->in[client->inlen] = '\0';
+    for (start = client->in; (end = strchr(start, '\n')); start = end+1) {
+      *end = '\0';
+      if ((end > start) && (end[-1] == '\r')) end[-1] = '\0';
+      if (!*start) continue;
+      if (client->npatterns == SUB_PATTERNS_MAX) {
+        sub_close(client, "sent too many patterns");
+        return;
+      }
+      if (!(client->patterns[client->npatterns] = strdup(start))) {
+        sub_close(client, "could not be given memory for its patterns");
+        return;
+      }
+      client->npatterns++;
+      if (client->match) memset(client->match, 0, client->nmatch); // Series that didn't match may now; defined ones are defined again
+      if (settings.verbose) printf("Subscription client subscribed to %s\n", start);
+    }
+    client->inlen -= start-client->in;
+    memmove(client->in, start, client->inlen);
+    if (client->inlen == sizeof(client->in)-1) {
+      sub_close(client, "sent a pattern that is too long");
+      return;
+    }
+  }
+  if (!n) sub_close(client, NULL);
+  else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) sub_close(client, "failed");
+}
+
+int sub_match(sub_client *client, input_t *input) { // Returns the match state, checking the patterns once per series
+  char buf[512], *name = buf;
+  unsigned char *match;
+  unsigned int n, len;
+  int i;
+
+  if (input->subid >= client->nmatch) {
+    for (n = client->nmatch?client->nmatch:1024; n <= input->subid; n *= 2);
+    if (!(match = (unsigned char *)realloc(client->match, n))) return 1;
+    memset(match+client->nmatch, 0, n-client->nmatch);
+    client->match = match;
+    client->nmatch = n;
+  }
+  if (!client->match[input->subid]) {
+    len = (input->parent?strlen(input->parent->name)+1:0)+strlen(input->name);
+    if ((len >= sizeof(buf)) && !(name = (char *)malloc(len+1))) return 1; // Matched in full, however long
+    sprintf(name, "%s%s%s", input->parent?input->parent->name:"", input->parent?".":"", input->name);
+    client->match[input->subid] = 1;
+    for (i = 0; i < client->npatterns; i++) {
+      if (!fnmatch(client->patterns[i], name, 0)) {
+        client->match[input->subid] = 2;
+        break;
+      }
+    }
+    if (name != buf) free(name);
+  }
+  return client->match[input->subid];
+}
+
+void sub_emit(input_t *input, long long ts, double fl) { // Called from process() while there are clients
+  sub_client *client, *next;
+  char *buf;
+  long long dts, n = (long long)fl;
+  int state, plen = 0, nlen = 0, need, size, isint = ((double)n == fl) && (n < (1LL<<53)) && (n > -(1LL<<53));
+
+  if (!input->subid) input->subid = sub_nextid++;
+  for (client = sub_clients; client; client = next) {
+    next = client->next;
+    if (!client->npatterns || ((state = sub_match(client, input)) < 2)) continue;
+    if (state == 2) { // The DEFINE carries the full name, copied straight into the queue
+      plen = input->parent?strlen(input->parent->name)+1:0;
+      nlen = plen+strlen(input->name);
+    }
+    need = 4+(state == 2?nlen+21:0)+30;
+    if (client->len+need > client->size) { // Make room: first send what the socket takes, then grow
+      if (sub_write(client)) continue;
+      if (client->sent) {
+        memmove(client->buf, client->buf+client->sent, client->len-client->sent);
+        if (client->frame != -1) client->frame -= client->sent;
+        client->len -= client->sent;
+        client->sent = 0;
+      }
+      if (client->len+need > client->size) {
+        for (size = client->size?client->size:SUB_BUF_SIZE; size < client->len+need; size *= 2);
+        if ((size > SUB_QUEUE_MAX) || !(buf = (char *)realloc(client->buf, size))) {
+          settings.subdropped++;
+          sub_close(client, "does not keep up with the updates");
+          continue;
+        }
+        client->buf = buf;
+        client->size = size;
+      }
+    }
+    buf = client->buf;
+    if (client->frame == -1) {
+      client->frame = client->len;
+      client->len += 4;
+    }
+    if (state == 2) {
+      buf[client->len++] = PROTO_DEFINE;
+      client->len += proto_varint(buf+client->len, input->subid);
+      client->len += proto_varint(buf+client->len, nlen);
+      if (plen) {
+        memcpy(buf+client->len, input->parent->name, plen-1);
+        buf[client->len+plen-1] = '.';
+      }
+      memcpy(buf+client->len+plen, input->name, nlen-plen);
+      client->len += nlen;
+      client->match[input->subid] = 3;
+    }
+    dts = ts-client->ts;
+    client->ts = ts;
+    buf[client->len++] = isint?PROTO_INT:PROTO_DOUBLE;
+    client->len += proto_varint(buf+client->len, input->subid);
+    client->len += proto_varint(buf+client->len, ((unsigned long long)dts<<1)^(dts>>63));
+    if (isint) {
+      client->len += proto_varint(buf+client->len, ((unsigned long long)n<<1)^(n>>63));
+    }
+    else {
+      memcpy(buf+client->len, &fl, sizeof(double));
+      client->len += sizeof(double);
+    }
+    settings.subupdates++;
+  }
+}
+
+void sub_flush(void) { // Writes what the clients can take at the end of each turn of the main loop
+  sub_client *client, *next;
+
+  for (client = sub_clients; client; client = next) {
+    next = client->next;
+    sub_write(client);
+  }
+}
+
+int sub_write(sub_client *client) { // Closes the open frame and writes without blocking; returns -1 if the client was closed
+  int n;
+
+  if (client->frame != -1) {
+    n = client->len-client->frame-4;
+    client->buf[client->frame] = n>>24; client->buf[client->frame+1] = n>>16;
+    client->buf[client->frame+2] = n>>8; client->buf[client->frame+3] = n;
+    client->frame = -1;
+  }
+  if (client->sent == client->len) return 0;
+  if ((n = write(client->fd, client->buf+client->sent, client->len-client->sent)) > 0) {
+    if ((client->sent += n) == client->len) client->sent = client->len = 0;
+  }
+  else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+    sub_close(client, "failed");
+    return -1;
+  }
+  return 0;
+}
+
+void sub_close(sub_client *client, const char *reason) {
+  sub_client **prev;
+  int i;
+
+  if (reason) error_log("Subscription client %s; closing it\n", reason);
+  for (prev = &sub_clients; *prev != client; prev = &(*prev)->next);
+  *prev = client->next;
+  close(client->fd);
+  for (i = 0; i < client->npatterns; i++) free(client->patterns[i]);
+  free(client->match);
+  free(client->buf);
+  free(client);
+  settings.subclients--;
+  if (settings.verbose) printf("Subscription client disconnected (%d connected, %llu updates sent, %lu dropped as too slow)\n",
+                               settings.subclients, settings.subupdates, settings.subdropped);
+}
@@ -0,0 +1,679 @@
+int tsdb_lookup(const char *, const char *);
+int tsdb_index_add(char *, int);
+int tsdb_read_series(FILE *, char *, int, char **, char **);
+int tsdb_version(void);
+int tsdb_upgrade(void);
+int tsdb_upgrade_series(int);
+tsdb_series *tsdb_open(int);
+void tsdb_append(int, long long, double);
+void tsdb_encode(tsdb_series *, long long, double);
+void tsdb_put(tsdb_series *, unsigned long long, int);
+int tsdb_flush(void);
+int tsdb_write(tsdb_series *);
+int tsdb_prune(int, long long);
+int tsdb_prune_all(long long);
+int tsdb_map(int, tsdb_mapping *);
+void tsdb_unmap(tsdb_mapping *);
+void tsdb_reader_init(tsdb_reader *, tsdb_mapping *, int);
+int tsdb_reader_next(tsdb_reader *, long long *, double *);
+unsigned long long tsdb_get(tsdb_reader *, int);
+int tsdb_latest(int, int, void (*)(void *, long long, double), void *);
+int tsdb_since(int, long long, void (*)(void *, long long, double), void *);
+int tsdb_aggregate(int, long long, long long, int *, double *, double *, double *);
+
+// Native storage: every series has an append-only data file <id>.dat with a sequence of compressed
+// chunks, and an index file <id>.idx with one tsdb_chunk per chunk that holds its position, time range
+// and count/sum/min/max, so aggregates over whole chunks never touch the data. Within a chunk the
+// samples are encoded as in Facebook's Gorilla: timestamps in msec as delta-of-delta in 1 to 68 bits and values
+// as the XOR with the previous value, storing only the meaningful bits. Regular samples of a steady
+// value take about 2 bits. Series ids are assigned in the text file 'series' with one line per series
+// of "<id>\t<name>\t<sub>", and are used as input->sqlid. The writer reads that file once into a hash table
+// and only appends to it after. The file 'version' holds the TSDB_VERSION.
+
+static tsdb_series **tsdb_open_series = NULL;
+static int tsdb_open_size = 0;
+static tsdb_key *tsdb_index = NULL; // Open addressing table of the series file
+static unsigned int tsdb_index_size = 0, tsdb_index_count = 0;
+static int tsdb_last_id = 0;
+
+int tsdb_read_series(FILE *fp, char *buf, int size, char **name, char **sub) {
+  char *c;
+  int id;
+
+  while (fgets(buf, size, fp)) {
+    if ((c = strchr(buf, '\n'))) *c = '\0';
+    id = strtol(buf, &c, 10);
+    if ((id <= 0) || (*c != '\t')) continue;
+    *name = c+1;
+    if ((c = strchr(*name, '\t'))) {
+      *c = '\0';
+      *sub = *(c+1)?c+1:NULL;
+    }
+    else *sub = NULL;
+    return id;
+  }
+  return 0;
+}
+
+int tsdb_lookup(const char *name, const char *sub) { // Looks up the id of a series, adding it if needed
+  static int indexed = 0;
+  char path[PATH_MAX], buf[TSDB_LINE_SIZE], line[TSDB_LINE_SIZE], key[TSDB_LINE_SIZE], *n, *s;
+  unsigned int i, mask;
+  int id;
+  FILE *fp;
+
+  // A tab or newline would split the line in the series file; 12 bytes are left for the id and separators
+  if (strpbrk(name, "\t\n") || (sub && strpbrk(sub, "\t\n"))
+   || (snprintf(key, TSDB_LINE_SIZE, "%s\t%s", name, sub?sub:"") >= TSDB_LINE_SIZE-12)) {
+    fprintf(stderr, "Series %s%s%s can't be stored in tsdb: its name is too long or holds a tab or newline\n", name, sub?".":"", sub?sub:"");
+    return -1;
+  }
+  snprintf(path, PATH_MAX, "%s/series", settings.tsdbdir);
+  if (!indexed) {
+    if ((fp = fopen(path, "r"))) {
+      while ((id = tsdb_read_series(fp, buf, TSDB_LINE_SIZE, &n, &s))) {
+        snprintf(line, TSDB_LINE_SIZE, "%s\t%s", n, s?s:"");
+        if (!(n = strdup(line)) || tsdb_index_add(n, id)) {
+          fprintf(stderr, "Failed to allocate memory for tsdb series index\n");
+          free(n);
+          fclose(fp);
+          return -1;
+        }
+      }
+      fclose(fp);
+    }
+    indexed = 1;
+  }
+  if (tsdb_index_size) {
+    mask = tsdb_index_size-1;
+    for (i = hash_str(key)&mask; tsdb_index[i].key; i = (i+1)&mask) {
+      if (!strcmp(tsdb_index[i].key, key)) return tsdb_index[i].id;
+    }
+  }
+  id = tsdb_last_id+1;
+  if (!(fp = fopen(path, "a")) || (fprintf(fp, "%d\t%s\n", id, key) < 0) || fclose(fp)) {
+    fprintf(stderr, "Failed to add series %s to tsdb: %s\n", name, strerror(errno));
+    return -1;
+  }
+  tsdb_last_id = id;
+  if (!(n = strdup(key)) || tsdb_index_add(n, id)) {
+    fprintf(stderr, "Failed to allocate memory for tsdb series index\n");
+    free(n);
+  }
+  return id;
+}
+
+int tsdb_index_add(char *key, int id) { // Takes over the key; returns -1 if out of memory
+  unsigned int i, j, size;
+  tsdb_key *index;
+
+  if (tsdb_index_count*2 >= tsdb_index_size) { // Grow the table, keeping it at most half full
+    size = tsdb_index_size?tsdb_index_size*2:1024;
+    if (!(index = (tsdb_key *)calloc(size, sizeof(tsdb_key)))) return -1;
+    for (j = 0; j < tsdb_index_size; j++) {
+      if (!tsdb_index[j].key) continue;
+      for (i = hash_str(tsdb_index[j].key)&(size-1); index[i].key; i = (i+1)&(size-1));
+      index[i] = tsdb_index[j];
+    }
+    free(tsdb_index);
+    tsdb_index = index;
+    tsdb_index_size = size;
+  }
+  for (i = hash_str(key)&(tsdb_index_size-1); tsdb_index[i].key; i = (i+1)&(tsdb_index_size-1));
+  tsdb_index[i].key = key;
+  tsdb_index[i].id = id;
+  tsdb_index_count++;
+  if (id > tsdb_last_id) tsdb_last_id = id;
+  return 0;
+}
+
+int tsdb_version(void) { // Returns 0 for a new directory; ones without a version file are from before version 2
+  char path[PATH_MAX];
+  int version = 1;
+  FILE *fp;
+
+  snprintf(path, PATH_MAX, "%s/version", settings.tsdbdir);
+  if ((fp = fopen(path, "r"))) {
+    if (fscanf(fp, "%d", &version) != 1) version = -1;
+    fclose(fp);
+    return version;
+  }
+  snprintf(path, PATH_MAX, "%s/series", settings.tsdbdir);
+  return access(path, F_OK)?0:1;
+}
+
+// Writer side; only used from the writer thread, or before it is started
+
+int tsdb_upgrade(void) { // Converts the files of all series to the current format
+  char path[PATH_MAX], buf[TSDB_LINE_SIZE], *name, *sub;
+  int id, version = tsdb_version();
+  FILE *fp;
+
+  if (version == TSDB_VERSION) return 0;
+  if (version == 1) {
+    if (settings.verbose) printf("Converting tsdb directory %s to version %d\n", settings.tsdbdir, TSDB_VERSION);
+    snprintf(path, PATH_MAX, "%s/series", settings.tsdbdir);
+    if (!(fp = fopen(path, "r"))) {
+      fprintf(stderr, "Failed to open tsdb series file %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    while ((id = tsdb_read_series(fp, buf, TSDB_LINE_SIZE, &name, &sub))) {
+      if (tsdb_upgrade_series(id)) {
+        fclose(fp);
+        return -1;
+      }
+    }
+    fclose(fp);
+  }
+  else if (version) {
+    fprintf(stderr, "Tsdb directory %s has version %d, which this version of anystat can't read (%d)\n", settings.tsdbdir, version, TSDB_VERSION);
+    return -1;
+  }
+  snprintf(path, PATH_MAX, "%s/version", settings.tsdbdir);
+  if (!(fp = fopen(path, "w")) || (fprintf(fp, "%d\n", TSDB_VERSION) < 0) || fclose(fp)) {
+    fprintf(stderr, "Failed to write tsdb version file %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Version 1 had timestamps in seconds: 32 bits for the first one in a chunk and for large
+// delta-of-deltas, and 32-bit first and last fields in the index. The old files are moved aside and
+// their samples appended to new ones; if this is interrupted, it starts over from the old files.
+int tsdb_upgrade_series(int id) {
+  struct {
+    long long offset;
+    int len, cnt, first, last;
+    double sum, min, max;
+  } chunk;
+  char dat[PATH_MAX], idx[PATH_MAX], old[PATH_MAX];
+  unsigned char *data = NULL;
+  tsdb_series *series;
+  tsdb_reader rd;
+  long long base, ts;
+  double fl;
+  struct stat st;
+  int datfd = -1, idxfd = -1, r = -1;
+
+  snprintf(dat, PATH_MAX, "%s/%d.dat", settings.tsdbdir, id);
+  snprintf(idx, PATH_MAX, "%s/%d.idx", settings.tsdbdir, id);
+  snprintf(old, PATH_MAX, "%s/%d.dat.v1", settings.tsdbdir, id);
+  if (!access(old, F_OK)) { // Left by an interrupted conversion
+    unlink(dat);
+    unlink(idx);
+  }
+  else if (rename(dat, old)) return errno==ENOENT?0:-1;
+  else {
+    snprintf(old, PATH_MAX, "%s/%d.idx.v1", settings.tsdbdir, id);
+    if (rename(idx, old) && (errno != ENOENT)) return -1;
+  }
+
+  snprintf(old, PATH_MAX, "%s/%d.dat.v1", settings.tsdbdir, id);
+  if (((datfd = open(old, O_RDONLY)) < 0) || fstat(datfd, &st)) goto out;
+  if ((st.st_size > sizeof(long long)) && ((data = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, datfd, 0)) == MAP_FAILED)) goto out;
+  snprintf(old, PATH_MAX, "%s/%d.idx.v1", settings.tsdbdir, id);
+  if (data && ((idxfd = open(old, O_RDONLY)) >= 0)) {
+    memcpy(&base, data, sizeof(long long));
+    while (read(idxfd, &chunk, sizeof(chunk)) == sizeof(chunk)) {
+      if ((chunk.offset < base) || (chunk.offset-base+chunk.len+sizeof(long long) > st.st_size)) continue;
+      memset(&rd, 0, sizeof(tsdb_reader));
+      rd.buf = data+sizeof(long long)+(chunk.offset-base);
+      rd.size = chunk.len*8;
+      rd.left = chunk.cnt;
+      rd.lead = -1;
+      rd.version = 1;
+      while (tsdb_reader_next(&rd, &ts, &fl)) tsdb_append(id, ts*1000, fl);
+    }
+  }
+  if ((series = tsdb_open(id)) && series->dirty && tsdb_write(series)) goto out;
+  unlink(old);
+  snprintf(old, PATH_MAX, "%s/%d.dat.v1", settings.tsdbdir, id);
+  unlink(old);
+  r = 0;
+out:
+  if (r) fprintf(stderr, "Failed to convert tsdb series %d: %s\n", id, strerror(errno));
+  if (data && (data != MAP_FAILED)) munmap(data, st.st_size);
+  if (datfd >= 0) close(datfd);
+  if (idxfd >= 0) close(idxfd);
+  return r;
+}
+
+tsdb_series *tsdb_open(int id) {
+  char path[PATH_MAX];
+  tsdb_series *series, **table;
+  int n;
+
+  if (id >= tsdb_open_size) {
+    n = id+64;
+    if (!(table = (tsdb_series **)realloc(tsdb_open_series, n*sizeof(tsdb_series *)))) { // The old table stays valid
+      fprintf(stderr, "Failed to allocate tsdb series table for %d series\n", n);
+      return NULL;
+    }
+    memset(table+tsdb_open_size, 0, (n-tsdb_open_size)*sizeof(tsdb_series *));
+    tsdb_open_series = table;
+    tsdb_open_size = n;
+  }
+  if (tsdb_open_series[id]) return tsdb_open_series[id];
+
+  if (!(series = (tsdb_series *)calloc(1, sizeof(tsdb_series)))) {
+    fprintf(stderr, "Failed to allocate tsdb series %d\n", id);
+    return NULL;
+  }
+  snprintf(path, PATH_MAX, "%s/%d.dat", settings.tsdbdir, id);
+  if ((series->datafd = open(path, O_RDWR|O_CREAT, 0644)) < 0) {
+    fprintf(stderr, "Failed to open tsdb data file %s: %s\n", path, strerror(errno));
+    free(series);
+    return NULL;
+  }
+  snprintf(path, PATH_MAX, "%s/%d.idx", settings.tsdbdir, id);
+  if ((series->idxfd = open(path, O_RDWR|O_CREAT, 0644)) < 0) {
+    fprintf(stderr, "Failed to open tsdb index file %s: %s\n", path, strerror(errno));
+    close(series->datafd);
+    free(series);
+    return NULL;
+  }
+  if (pread(series->datafd, &series->base, sizeof(long long), 0) != sizeof(long long)) { // New file
+    series->base = 0;
+    if (pwrite(series->datafd, &series->base, sizeof(long long), 0) != sizeof(long long)) {
+      fprintf(stderr, "Failed to write tsdb data file %s: %s\n", path, strerror(errno));
+      close(series->datafd);
+      close(series->idxfd);
+      free(series);
+      return NULL;
+    }
+  }
+  // A chunk left open by a previous run is kept as it is; appending always starts a new one
+  series->pos = lseek(series->idxfd, 0, SEEK_END)/sizeof(tsdb_chunk);
+  series->cur.offset = series->base+lseek(series->datafd, 0, SEEK_END)-sizeof(long long);
+  series->id = id;
+  return tsdb_open_series[id] = series;
+}
+
+void tsdb_append(int id, long long ts, double fl) {
+  tsdb_series *series;
+
+  if (!(series = tsdb_open(id))) return;
+  if (series->cur.cnt && (series->bits+TSDB_SAMPLE_BITS > TSDB_CHUNK_SIZE*8)) { // Chunk is full; seal it
+    if (tsdb_write(series)) return;
+    series->pos++;
+    series->cur.offset += series->cur.len;
+    series->cur.cnt = 0;
+    series->bits = 0;
+    memset(series->buf, 0, TSDB_CHUNK_SIZE);
+  }
+  tsdb_encode(series, ts, fl);
+  series->dirty = 1;
+}
+
+void tsdb_encode(tsdb_series *series, long long ts, double fl) {
+  unsigned long long val, x;
+  long long delta, dod;
+  int lead, trail;
+
+  memcpy(&val, &fl, sizeof(val));
+  if (!series->cur.cnt) { // First sample of a chunk is stored in full
+    tsdb_put(series, (unsigned long long)ts, 64);
+    tsdb_put(series, val, 64);
+    series->delta = 0;
+    series->lead = -1;
+    series->cur.first = ts;
+    series->cur.sum = 0;
+    series->cur.min = series->cur.max = fl;
+  }
+  else {
+    delta = ts-series->ts;
+    dod = delta-series->delta;
+    if (!dod) tsdb_put(series, 0, 1);
+    else if ((dod >= -63) && (dod <= 64)) {
+      tsdb_put(series, 2, 2);
+      tsdb_put(series, dod+63, 7);
+    }
+    else if ((dod >= -255) && (dod <= 256)) {
+      tsdb_put(series, 6, 3);
+      tsdb_put(series, dod+255, 9);
+    }
+    else if ((dod >= -2047) && (dod <= 2048)) {
+      tsdb_put(series, 14, 4);
+      tsdb_put(series, dod+2047, 12);
+    }
+    else {
+      tsdb_put(series, 15, 4);
+      tsdb_put(series, (unsigned long long)dod, 64);
+    }
+    series->delta = delta;
+
+    if (!(x = val^series->val)) tsdb_put(series, 0, 1);
+    else {
+      lead = __builtin_clzll(x);
+      trail = __builtin_ctzll(x);
+      if (lead > 31) lead = 31;
+      if ((series->lead >= 0) && (lead >= series->lead) && (trail >= series->trail)) { // Fits in the previous window
+        tsdb_put(series, 2, 2);
+        tsdb_put(series, x >> series->trail, 64-series->lead-series->trail);
+      }
+      else {
+        tsdb_put(series, 3, 2);
+        tsdb_put(series, lead, 5);
+        tsdb_put(series, (64-lead-trail)&63, 6); // A length of 64 is stored as 0
+        tsdb_put(series, x >> trail, 64-lead-trail);
+        series->lead = lead;
+        series->trail = trail;
+      }
+    }
+    if (fl < series->cur.min) series->cur.min = fl;
+    if (fl > series->cur.max) series->cur.max = fl;
+  }
+  series->ts = ts;
+  series->val = val;
+  series->cur.last = ts;
+  series->cur.sum += fl;
+  series->cur.cnt++;
+}
+
+void tsdb_put(tsdb_series *series, unsigned long long val, int n) { // Appends the low n bits of val
+  int room, take;
+
+  while (n) {
+    room = 8-series->bits%8;
+    take = n<room?n:room;
+    series->buf[series->bits/8] |= ((val >> (n-take)) & ((1u << take)-1)) << (room-take);
+    series->bits += take;
+    n -= take;
+  }
+}
+
+int tsdb_flush(void) { // Writes out the open chunks of all series that received samples
+  int id, r = 0;
+
+  for (id = 0; id < tsdb_open_size; id++) {
+    if (tsdb_open_series[id] && tsdb_open_series[id]->dirty && tsdb_write(tsdb_open_series[id])) r = -1;
+  }
+  return r;
+}
+
+int tsdb_write(tsdb_series *series) { // The data goes first, so a reader never finds an entry without it
+  series->cur.len = (series->bits+7)/8;
+  if (pwrite(series->datafd, series->buf, series->cur.len, series->cur.offset-series->base+sizeof(long long)) != series->cur.len) {
+    fprintf(stderr, "Failed to write tsdb data for series %d: %s\n", series->id, strerror(errno));
+    return -1;
+  }
+  if (pwrite(series->idxfd, &series->cur, sizeof(tsdb_chunk), series->pos*sizeof(tsdb_chunk)) != sizeof(tsdb_chunk)) {
+    fprintf(stderr, "Failed to write tsdb index for series %d: %s\n", series->id, strerror(errno));
+    return -1;
+  }
+  series->dirty = 0;
+  return 0;
+}
+
+// Drops the chunks that ended before cutoff from the head of a series. Chunk offsets are logical: the
+// data file starts with the offset of its first byte, so the files are rewritten without the expired
+// chunks but the remaining index entries stay the same, and any combination of old and new index and
+// data file that a reader might open during the renames is consistent. This is only done once at least
+// half of the chunks have expired, so the copying amounts to at most one extra write per sample.
+int tsdb_prune(int id, long long cutoff) {
+  char path[PATH_MAX], tmp[PATH_MAX];
+  tsdb_series *series = (id < tsdb_open_size)?tsdb_open_series[id]:NULL;
+  tsdb_mapping map;
+  long long base;
+  int n, fd, r = -1;
+  size_t len;
+
+  if (series && series->dirty && tsdb_write(series)) return -1;
+  if (tsdb_map(id, &map)) return -1;
+  for (n = 0; (n < map.nchunks) && (!series || (n < series->pos-map.first)) && (map.idx[n].last < cutoff); n++);
+  if (!n || (n*2 < map.nchunks)) {
+    tsdb_unmap(&map);
+    return 0;
+  }
+  if (n < map.nchunks) base = map.idx[n].offset;
+  else base = map.idx[n-1].offset+map.idx[n-1].len;
+  len = map.datasize-sizeof(long long)-(base-map.base);
+
+  snprintf(tmp, PATH_MAX, "%s/%d.dat.new", settings.tsdbdir, id);
+  if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) goto out;
+  if ((write(fd, &base, sizeof(long long)) != sizeof(long long))
+   || (write(fd, map.data+sizeof(long long)+(base-map.base), len) != len)) {
+    close(fd);
+    goto out;
+  }
+  close(fd);
+  snprintf(tmp, PATH_MAX, "%s/%d.idx.new", settings.tsdbdir, id);
+  if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) goto out;
+  if (write(fd, map.idx+n, (map.nchunks-n)*sizeof(tsdb_chunk)) != (map.nchunks-n)*sizeof(tsdb_chunk)) {
+    close(fd);
+    goto out;
+  }
+  close(fd);
+
+  snprintf(path, PATH_MAX, "%s/%d.dat", settings.tsdbdir, id);
+  snprintf(tmp, PATH_MAX, "%s/%d.dat.new", settings.tsdbdir, id);
+  if (rename(tmp, path)) goto out;
+  snprintf(path, PATH_MAX, "%s/%d.idx", settings.tsdbdir, id);
+  snprintf(tmp, PATH_MAX, "%s/%d.idx.new", settings.tsdbdir, id);
+  if (rename(tmp, path)) goto out;
+  if (series) { // Switch the open chunk over to the new files
+    close(series->datafd);
+    close(series->idxfd);
+    snprintf(path, PATH_MAX, "%s/%d.dat", settings.tsdbdir, id);
+    series->datafd = open(path, O_RDWR);
+    snprintf(path, PATH_MAX, "%s/%d.idx", settings.tsdbdir, id);
+    series->idxfd = open(path, O_RDWR);
+    if ((series->datafd < 0) || (series->idxfd < 0)) {
+      if (series->datafd >= 0) close(series->datafd);
+      if (series->idxfd >= 0) close(series->idxfd);
+      tsdb_open_series[id] = NULL; // Start over with a new chunk on the next sample
+      free(series);
+      goto out;
+    }
+    series->pos -= map.first+n;
+    series->base = base;
+  }
+  if (settings.verbose) printf("Pruned %d chunks older than %s from tsdb series %d\n", n, itodur(settings.sqliteprune), id);
+  r = 0;
+out:
+  if (r) fprintf(stderr, "Failed to prune tsdb series %d: %s\n", id, strerror(errno));
+  tsdb_unmap(&map);
+  return r;
+}
+
+int tsdb_prune_all(long long cutoff) {
+  char buf[TSDB_LINE_SIZE], *name, *sub;
+  int id;
+  FILE *fp;
+
+  snprintf(buf, TSDB_LINE_SIZE, "%s/series", settings.tsdbdir);
+  if (!(fp = fopen(buf, "r"))) return errno==ENOENT?0:-1;
+  while ((id = tsdb_read_series(fp, buf, TSDB_LINE_SIZE, &name, &sub))) tsdb_prune(id, cutoff);
+  fclose(fp);
+  return 0;
+}
+
+// Reader side; used by the monitor, which maps the files read-only for each query
+
+int tsdb_map(int id, tsdb_mapping *map) {
+  char path[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  memset(map, 0, sizeof(tsdb_mapping));
+  snprintf(path, PATH_MAX, "%s/%d.dat", settings.tsdbdir, id);
+  if ((fd = open(path, O_RDONLY)) < 0) return errno==ENOENT?0:-1;
+  if (!fstat(fd, &st) && (st.st_size > sizeof(long long))) {
+    map->datasize = st.st_size;
+    map->data = (unsigned char *)mmap(NULL, map->datasize, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map->data == MAP_FAILED) map->data = NULL;
+  if (!map->data) return 0;
+  memcpy(&map->base, map->data, sizeof(long long));
+
+  snprintf(path, PATH_MAX, "%s/%d.idx", settings.tsdbdir, id);
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    tsdb_unmap(map);
+    return errno==ENOENT?0:-1;
+  }
+  if (!fstat(fd, &st) && (st.st_size >= sizeof(tsdb_chunk))) {
+    map->idxsize = st.st_size;
+    map->idxmap = (tsdb_chunk *)mmap(NULL, map->idxsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map->idxmap == MAP_FAILED) map->idxmap = NULL;
+  if (!map->idxmap) return 0;
+  map->idx = map->idxmap;
+  map->nchunks = map->idxsize/sizeof(tsdb_chunk);
+
+  // Only use the chunks that are in the data file; we may have opened it in the middle of a write or prune
+  while (map->nchunks && (map->idx->offset < map->base)) {
+    map->idx++;
+    map->nchunks--;
+    map->first++;
+  }
+  while (map->nchunks && (map->idx[map->nchunks-1].offset-map->base+map->idx[map->nchunks-1].len+sizeof(long long) > map->datasize)) map->nchunks--;
+  return 0;
+}
+
+void tsdb_unmap(tsdb_mapping *map) {
+  if (map->idxmap) munmap(map->idxmap, map->idxsize);
+  if (map->data) munmap(map->data, map->datasize);
+  memset(map, 0, sizeof(tsdb_mapping));
+}
+
+void tsdb_reader_init(tsdb_reader *rd, tsdb_mapping *map, int chunk) {
+  memset(rd, 0, sizeof(tsdb_reader));
+  rd->buf = map->data+sizeof(long long)+(map->idx[chunk].offset-map->base);
+  rd->size = map->idx[chunk].len*8;
+  rd->left = map->idx[chunk].cnt;
+  rd->lead = -1;
+}
+
+int tsdb_reader_next(tsdb_reader *rd, long long *ts, double *fl) {
+  unsigned long long x;
+  long long dod;
+  int len;
+
+  if (!rd->left) return 0;
+  if (!rd->bits) {
+    if (rd->size < (rd->version == 1?96:128)) return rd->left = 0;
+    if (rd->version == 1) rd->ts = (int)tsdb_get(rd, 32);
+    else rd->ts = (long long)tsdb_get(rd, 64);
+    rd->val = tsdb_get(rd, 64);
+  }
+  else {
+    if (!tsdb_get(rd, 1)) dod = 0;
+    else if (!tsdb_get(rd, 1)) dod = (int)tsdb_get(rd, 7)-63;
+    else if (!tsdb_get(rd, 1)) dod = (int)tsdb_get(rd, 9)-255;
+    else if (!tsdb_get(rd, 1)) dod = (int)tsdb_get(rd, 12)-2047;
+    else if (rd->version == 1) dod = (int)(unsigned int)tsdb_get(rd, 32);
+    else dod = (long long)tsdb_get(rd, 64);
+    rd->delta += dod;
+    rd->ts += rd->delta;
+
+    if (tsdb_get(rd, 1)) {
+      if (tsdb_get(rd, 1)) {
+        rd->lead = tsdb_get(rd, 5);
+        if (!(len = tsdb_get(rd, 6))) len = 64;
+        rd->trail = 64-rd->lead-len;
+      }
+      if ((rd->lead < 0) || (rd->trail < 0)) return rd->left = 0; // Corrupt chunk
+      x = tsdb_get(rd, 64-rd->lead-rd->trail);
+      rd->val ^= x << rd->trail;
+    }
+  }
+  if (rd->bits > rd->size) return rd->left = 0; // Ran past the end of the chunk
+  *ts = rd->ts;
+  memcpy(fl, &rd->val, sizeof(double));
+  rd->left--;
+  return 1;
+}
+
+unsigned long long tsdb_get(tsdb_reader *rd, int n) {
+  unsigned long long val = 0;
+  int room, take;
+
+  while (n) {
+    if (rd->bits >= rd->size) { // The caller checks the position afterwards
+      rd->bits += n;
+      return 0;
+    }
+    room = 8-rd->bits%8;
+    take = n<room?n:room;
+    val = (val << take) | ((rd->buf[rd->bits/8] >> (room-take)) & ((1u << take)-1));
+    rd->bits += take;
+    n -= take;
+  }
+  return val;
+}
+
+int tsdb_latest(int id, int n, void (*cb)(void *, long long, double), void *arg) { // Oldest to newest
+  tsdb_mapping map;
+  tsdb_reader rd;
+  int chunk, skip = 0;
+  long long ts;
+  double fl;
+
+  if (tsdb_map(id, &map)) return -1;
+  for (chunk = map.nchunks-1; (chunk >= 0) && (skip < n); chunk--) skip += map.idx[chunk].cnt;
+  skip = skip>n?skip-n:0; // Series may have fewer than n samples
+  for (chunk++; chunk < map.nchunks; chunk++) {
+    tsdb_reader_init(&rd, &map, chunk);
+    while (tsdb_reader_next(&rd, &ts, &fl)) {
+      if (skip) skip--;
+      else cb(arg, ts, fl);
+    }
+  }
+  tsdb_unmap(&map);
+  return 0;
+}
+
+int tsdb_since(int id, long long since, void (*cb)(void *, long long, double), void *arg) { // Samples after since
+  tsdb_mapping map;
+  tsdb_reader rd;
+  int chunk;
+  long long ts;
+  double fl;
+
+  if (tsdb_map(id, &map)) return -1;
+  for (chunk = map.nchunks; (chunk > 0) && (map.idx[chunk-1].last > since); chunk--);
+  for (; chunk < map.nchunks; chunk++) {
+    tsdb_reader_init(&rd, &map, chunk);
+    while (tsdb_reader_next(&rd, &ts, &fl)) {
+      if (ts > since) cb(arg, ts, fl);
+    }
+  }
+  tsdb_unmap(&map);
+  return 0;
+}
+
+int tsdb_aggregate(int id, long long from, long long to, int *cnt, double *sum, double *min, double *max) { // Over (from, to]
+  tsdb_mapping map;
+  tsdb_reader rd;
+  tsdb_chunk *chunk;
+  int i;
+  long long ts;
+  double fl;
+
+  *cnt = 0;
+  *sum = 0;
+  if (tsdb_map(id, &map)) return -1;
+  for (i = 0; i < map.nchunks; i++) {
+    chunk = &map.idx[i];
+    if ((chunk->last <= from) || (chunk->first > to)) continue;
+    if ((chunk->first > from) && (chunk->last <= to)) { // Entirely inside; the index entry has it all
+      if (!*cnt || (chunk->min < *min)) *min = chunk->min;
+      if (!*cnt || (chunk->max > *max)) *max = chunk->max;
+      *cnt += chunk->cnt;
+      *sum += chunk->sum;
+      continue;
+    }
+    tsdb_reader_init(&rd, &map, i);
+    while (tsdb_reader_next(&rd, &ts, &fl)) {
+      if ((ts <= from) || (ts > to)) continue;
+      if (!*cnt || (fl < *min)) *min = fl;
+      if (!*cnt || (fl > *max)) *max = fl;
+      (*cnt)++;
+      *sum += fl;
+    }
+  }
+  tsdb_unmap(&map);
+  return 0;
+}